@@ -0,0 +1,58 @@
+#pragma once
+
+#include <engine/culling.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace Engine {
+
+// 32 bytes, two per cache line
+struct BVHNode {
+    AABB bounds;
+    uint32_t left_or_first;     // inner: left child (right child is left + 1), leaf: first entry in the leaf ranges
+    uint32_t count;             // primitives in the leaf, 0 for inner nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// Flat BVH over boxes. Built top down with binned SAH, the children of a node are
+// always after it in the array so refit is a single reverse sweep.
+class BVH {
+public:
+    // ids are what the queries hand back, boxes[i] belongs to ids[i]
+    void build(const std::vector<AABB> &boxes, const std::vector<uint32_t> &ids);
+
+    // Keeps the topology and only updates bounds, boxes must be in the same order as in build.
+    // Cheap enough for every frame, quality drops if objects move far from where they were built.
+    void refit(const std::vector<AABB> &boxes);
+
+    void clear();
+    bool empty() const { return m_nodes.empty(); }
+    size_t node_count() const { return m_nodes.size(); }
+
+    // Appends the ids of every box touching the frustum. Not const, leaf tests go through a scratch list
+    void query_frustum(const Frustum &frustum, std::vector<uint32_t> &out);
+
+    // Closest hit along origin + t * dir. hit_test gets an id whose box the ray enters and returns
+    // the exact hit distance, or a negative value for a miss. Without it the box entry distance is used.
+    bool raycast(const glm::vec3 &origin, const glm::vec3 &dir, float &t_hit, uint32_t &id_hit,
+                 const std::function<float(uint32_t)> &hit_test = nullptr) const;
+
+private:
+    void subdivide(uint32_t node_idx);
+    void update_leaf_bounds(uint32_t node_idx);
+    void collect(uint32_t node_idx, std::vector<uint32_t> &out) const;
+    // query_frustum from a node that already passed the planes not in plane_mask
+    void query_node(const Frustum &frustum, uint32_t node_idx, uint32_t plane_mask, std::vector<uint32_t> &out);
+
+    std::vector<BVHNode> m_nodes;
+    std::vector<uint32_t> m_prims;      // leaf ranges point in here, values index m_boxes/m_ids
+    std::vector<AABB> m_boxes;
+    std::vector<uint32_t> m_ids;
+    FrustumCuller m_leaf_boxes;         // m_boxes in m_prims order so leaves are tested with SIMD
+    std::vector<uint32_t> m_leaf_hits;  // kept between queries so they do not allocate
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <VkBootstrap.h>
+
+#include <cstdint>
+
+namespace Engine {
+
+struct RecorderStats {
+    uint32_t issued = 0;
+    uint32_t skipped = 0;   // binds and push constants that would not have changed anything
+};
+
+// Thin layer over the dispatch table for one command buffer at a time. Remembers what is bound
+// and drops calls that would bind the same thing again. Draws and dispatches always go through
+class CommandRecorder {
+public:
+    void init(vkb::DispatchTable *dispatch) { m_dispatch = dispatch; }
+
+    // Starts tracking a freshly begun command buffer, nothing is assumed to be bound
+    void begin(VkCommandBuffer command_buffer);
+    // Forget all bound state, for when something was recorded around the recorder
+    void invalidate();
+
+    VkCommandBuffer get_command_buffer() const { return m_command_buffer; }
+
+    void bind_pipeline(VkPipelineBindPoint bind_point, VkPipeline pipeline);
+    void bind_descriptor_set(VkPipelineBindPoint bind_point, VkPipelineLayout layout, uint32_t set, VkDescriptorSet descriptor_set);
+    void bind_vertex_buffer(VkBuffer buffer, VkDeviceSize offset=0);
+    void bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType index_type);
+    void push_constants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size, const void *data);
+
+    void draw_indexed(uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance);
+    void draw_indexed_indirect(VkBuffer buffer, VkDeviceSize offset, uint32_t draw_count, uint32_t stride);
+    void draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer count_buffer, VkDeviceSize count_offset, uint32_t max_draw_count, uint32_t stride);
+    void dispatch(uint32_t x, uint32_t y, uint32_t z);
+
+    // Counts since begin, and the totals of the command buffer before that
+    RecorderStats get_stats() const { return m_stats; }
+    RecorderStats get_last_stats() const { return m_last_stats; }
+    // Folds in the counts of secondaries that were recorded for this command buffer
+    void add_stats(const RecorderStats &stats) { m_stats.issued += stats.issued; m_stats.skipped += stats.skipped; }
+
+private:
+    static constexpr uint32_t MAX_PUSH_CONSTANT_BYTES = 256;
+    static constexpr uint32_t MAX_TRACKED_SETS = 4;
+    static constexpr int BIND_POINT_COUNT = 2;     // graphics and compute
+
+    struct BindPointState {
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkPipelineLayout set_layouts[MAX_TRACKED_SETS] = {};
+        VkDescriptorSet sets[MAX_TRACKED_SETS] = {};
+    };
+
+    vkb::DispatchTable *m_dispatch = nullptr;
+    VkCommandBuffer m_command_buffer = VK_NULL_HANDLE;
+
+    BindPointState m_bind_points[BIND_POINT_COUNT];
+
+    VkBuffer m_vertex_buffer = VK_NULL_HANDLE;
+    VkDeviceSize m_vertex_offset = 0;
+    VkBuffer m_index_buffer = VK_NULL_HANDLE;
+    VkDeviceSize m_index_offset = 0;
+    VkIndexType m_index_type = VK_INDEX_TYPE_UINT32;
+
+    // Last push, only skipped when the layout, range and bytes all match
+    VkPipelineLayout m_push_layout = VK_NULL_HANDLE;
+    VkShaderStageFlags m_push_stages = 0;
+    uint32_t m_push_offset = 0;
+    uint32_t m_push_size = 0;
+    uint8_t m_push_data[MAX_PUSH_CONSTANT_BYTES];
+
+    RecorderStats m_stats;
+    RecorderStats m_last_stats;
+};
+
+}
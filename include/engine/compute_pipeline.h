@@ -0,0 +1,54 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <VkBootstrap.h>
+
+#include <engine/compute_pipeline_builder.h>
+
+namespace Engine {
+class Renderer;
+
+class ComputePipeline {
+public:
+    virtual ~ComputePipeline() = default;
+    virtual void create_pipeline(Renderer &device) = 0;
+
+    void destroy_pipeline(vkb::DispatchTable &dispatch_table);
+
+    // One set per frame in flight, from a pool sized for this pipeline's bindings
+    void create_descriptor_sets(Renderer &device);
+    // Any number of sets, e.g. one per dispatch that reads different resources. Replaces earlier sets
+    void create_descriptor_sets(Renderer &device, uint32_t set_count);
+    void write_storage_buffer(Renderer &device, int set, uint32_t binding, VkBuffer buffer, VkDeviceSize range=VK_WHOLE_SIZE);
+    // Storage image or combined image sampler
+    void write_image(Renderer &device, int set, uint32_t binding, VkDescriptorType type, VkImageView view, VkImageLayout layout, VkSampler sampler=VK_NULL_HANDLE);
+    // Through the renderer's command recorder
+    void bind(Renderer &device, int set);
+
+    VkPipeline get_pipeline() { return m_data.pipeline; }
+    VkPipelineLayout get_pipeline_layout() { return m_data.pipeline_layout; }
+
+protected:
+    ComputePipelineData m_data;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> m_descriptor_sets;
+};
+
+// Frustum and occlusion culls the per-object bounds and writes indirect draw commands (resources/shaders/cull.comp)
+class CullPipeline: public ComputePipeline {
+public:
+    void create_pipeline(Engine::Renderer &device) override;
+};
+
+// Assigns the local lights to the froxels of the camera (resources/shaders/light_clusters.comp)
+class LightClusterPipeline: public ComputePipeline {
+public:
+    void create_pipeline(Engine::Renderer &device) override;
+};
+
+// Builds one level of the depth pyramid from the depth buffer or the level above (resources/shaders/depth_pyramid.comp)
+class DepthPyramidPipeline: public ComputePipeline {
+public:
+    void create_pipeline(Engine::Renderer &device) override;
+};
+
+}
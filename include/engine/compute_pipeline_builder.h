@@ -0,0 +1,38 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <VkBootstrap.h>
+
+#include <engine/shaders.h>
+
+namespace Engine {
+class Renderer;
+
+struct ComputePipelineData {
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout;
+    VkDescriptorSetLayout descriptor_set_layout = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    Shader comp_shader;
+};
+
+// Compute counterpart of PipelineBuilder, compute pipelines get their own descriptor set layout
+// since they usually read and write buffers the graphics set does not have
+class ComputePipelineBuilder {
+public:
+    void set_shader(Renderer &device, const std::string &comp_shader_filename);
+    void add_push_constants(uint32_t pc_size, uint32_t offset=0);
+    void add_storage_buffer(uint32_t binding);
+    void add_storage_image(uint32_t binding);
+    void add_combined_image_sampler(uint32_t binding);
+
+    ComputePipelineData build(Renderer &device);
+
+private:
+    void add_binding(uint32_t binding, VkDescriptorType type);
+
+    Shader m_comp_shader;
+    std::vector<VkPushConstantRange> m_push_constant_ranges;
+    std::vector<VkDescriptorSetLayoutBinding> m_bindings;
+};
+
+}
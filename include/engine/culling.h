@@ -0,0 +1,63 @@
+#pragma once
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace Engine {
+
+struct AABB {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+    void expand(const glm::vec3 &point) { min = glm::min(min, point); max = glm::max(max, point); }
+    void expand(const AABB &other) { min = glm::min(min, other.min); max = glm::max(max, other.max); }
+
+    bool valid() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    glm::vec3 extent() const { return (max - min) * 0.5f; }
+    float surface_area() const;
+
+    // Box around the transformed box (Arvo's method), not the tightest box of the transformed points
+    AABB transformed(const glm::mat4 &matrix) const;
+};
+
+struct Frustum {
+    // Normals point inwards, a point p is inside a plane if dot(plane.xyz, p) + plane.w >= 0
+    glm::vec4 planes[6];
+
+    // Expects a Vulkan style clip space (0 <= z <= w)
+    static Frustum from_matrix(const glm::mat4 &view_proj);
+
+    bool intersects_sphere(const glm::vec3 &center, float radius) const;
+    bool intersects_aabb(const AABB &box) const;
+};
+
+struct CullStats {
+    uint32_t visible = 0;
+    uint32_t culled = 0;
+};
+
+// World space boxes stored as SoA center/extent so that four (SSE) or
+// eight (AVX) of them are tested against one plane at a time
+class FrustumCuller {
+public:
+    void clear();
+    void resize(size_t count);
+    void set_box(size_t idx, const AABB &box);
+    void add_box(const AABB &box);
+    size_t size() const { return m_center_x.size(); }
+
+    // Appends the indices of the boxes in [first, first + count) that intersect the frustum to visible
+    CullStats cull(const Frustum &frustum, std::vector<uint32_t> &visible) const { return cull(frustum, visible, 0, size()); }
+    CullStats cull(const Frustum &frustum, std::vector<uint32_t> &visible, size_t first, size_t count) const;
+
+private:
+    std::vector<float> m_center_x, m_center_y, m_center_z;
+    std::vector<float> m_extent_x, m_extent_y, m_extent_z;
+};
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <engine/compute_pipeline.h>
+#include <engine/image.h>
+
+#include <glm/glm.hpp>
+
+namespace Engine {
+class Renderer;
+
+// Matches the push constants in depth_pyramid.comp
+struct DepthPyramidPushConstants {
+    glm::uvec2 src_size;
+    glm::uvec2 dst_size;
+    uint32_t level;
+    uint32_t sample_count;
+    uint32_t padding[2];
+};
+
+// Max reduced mip chain of the main depth buffer for occlusion tests. Level 0 is the largest power of
+// two that fits in the framebuffer, every texel holds the farthest depth of the pixels it covers
+class DepthPyramid {
+public:
+    void create_pipeline(Renderer &renderer);
+    // Again after every resize, once the old images are destroyed
+    void create_images(Renderer &renderer, VkImageView depth_view, uint32_t width, uint32_t height);
+    void destroy_images(vkb::DispatchTable &dispatch);
+
+    // Reads the depth written so far this frame. Has to be recorded outside of a render pass, the depth
+    // buffer is left as an attachment again
+    void build(Renderer &renderer, VkCommandBuffer command_buffer, VkImage depth_image);
+
+    VkImageView get_view() const { return m_image.m_image_view; }
+    VkSampler get_sampler() const { return m_image.m_sampler; }
+    uint32_t get_width() const { return m_width; }
+    uint32_t get_height() const { return m_height; }
+    uint32_t get_mip_count() const { return m_mip_count; }
+    // Bumped whenever the images are recreated, descriptors holding the old view have to be rewritten
+    uint32_t get_version() const { return m_version; }
+
+private:
+    DepthPyramidPipeline m_pipeline;
+    DepthPyramidImage m_image{};
+    bool m_has_images = false;
+    uint32_t m_depth_width = 0, m_depth_height = 0;
+    uint32_t m_width = 0, m_height = 0;
+    uint32_t m_mip_count = 0;
+    uint32_t m_version = 0;
+};
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace Engine {
+
+struct DirtyRange {
+    uint32_t first;
+    uint32_t count;
+};
+
+// Marked element indices of a buffer, turned into sorted and merged ranges for uploading.
+// Marking is O(1) and the same index marked twice is only kept once
+class DirtyRanges {
+public:
+    // Also clears, everything starts out clean
+    void resize(uint32_t size);
+    uint32_t size() const { return static_cast<uint32_t>(m_flags.size()); }
+
+    // Indices past size are ignored, nothing has been uploaded for them yet
+    void mark(uint32_t idx);
+    bool empty() const { return m_indices.empty(); }
+    void clear();
+
+    // Ranges with at most merge_gap clean elements between them are joined, one bigger copy
+    // is cheaper than many tiny ones. Valid until the next mark or clear
+    const std::vector<DirtyRange>& build_ranges(uint32_t merge_gap=0);
+
+private:
+    std::vector<uint8_t> m_flags;
+    std::vector<uint32_t> m_indices;
+    std::vector<DirtyRange> m_ranges;
+};
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <engine/compute_pipeline.h>
+#include <engine/models.h>
+#include <engine/culling.h>
+
+namespace Engine {
+class Renderer;
+
+// Matches ObjectData in cull.comp (std430)
+struct GpuCullObject {
+    glm::vec4 center;           // object space bounds, w is the radius of the bounding sphere
+    glm::vec4 extent;
+    uint32_t transform_idx;
+    uint32_t batch_idx;         // command slot of LOD 0 within a section, LOD l is batch_idx + l
+    uint32_t batch_first_instance;
+    float base_texture;
+    uint32_t lod_instance_stride;   // instances between the batches of two LODs
+    uint32_t lod_count;
+    uint32_t padding[2];
+};
+
+// What a dispatch tests besides the frustum, see cull.comp
+constexpr uint32_t CULL_PHASE_FRUSTUM = 0;     // nothing, for the light views
+constexpr uint32_t CULL_PHASE_EARLY = 1;       // drawn only if it passed the occlusion test last frame
+constexpr uint32_t CULL_PHASE_LATE = 2;        // the rest, against the depth pyramid of the early draws
+// Light views, split so the renderer can cache the static casters' shadow
+constexpr uint32_t CULL_PHASE_STATIC_CASTERS = 3;
+constexpr uint32_t CULL_PHASE_DYNAMIC_CASTERS = 4;
+
+// Casters of one or more light views into one section. A caster is kept if it touches any of the
+// frustums [first_frustum, first_frustum + frustum_count) of the list passed with it, several of
+// them merge the lights of a multiview shadow pass.
+// Static casters are cached for the whole light volume, the dynamic ones only need the part that
+// can shadow the camera's view
+struct ShadowCullJob {
+    uint32_t first_frustum;
+    uint32_t frustum_count;
+    uint32_t section;
+    uint32_t phase;     // CULL_PHASE_STATIC_CASTERS or CULL_PHASE_DYNAMIC_CASTERS
+};
+
+// Frustums of the jobs that test more than one, the others go in the push constants
+constexpr uint32_t MAX_CULL_FRUSTUMS = 2 * MAX_SHADOW_LIGHTS;
+
+// Matches the push constants in cull.comp
+struct CullPushConstants {
+    glm::vec4 planes[6];
+    uint32_t object_count;
+    uint32_t first_command;     // first slot of the section being written
+    uint32_t first_instance;    // first slot of the section in the instance buffer
+    uint32_t phase;
+    uint32_t first_frustum;     // in the frustum buffer, only used when frustum_count is not 0
+    uint32_t frustum_count;     // otherwise planes is the frustum
+};
+
+// Matches Frustums in cull.comp (std430)
+struct GpuCullFrustums {
+    glm::vec4 planes[MAX_CULL_FRUSTUMS][6];
+};
+
+// Matches OcclusionView in cull.comp (std430)
+struct GpuOcclusionView {
+    glm::mat4 view_proj;
+    glm::vec4 pyramid_size;     // width, height, mip count, unused
+    // What the early phase picks the LODs from, see Scene::select_lods
+    glm::vec4 lod_eye;          // camera position, projection scale
+    glm::vec4 lod_params;       // near plane, 1 if perspective, hysteresis, unused
+    glm::vec4 lod_sizes;        // LOD_SCREEN_SIZES
+};
+
+// Culls the opaque models on the GPU and fills the renderer's indirect sections directly.
+// Every batch keeps its command, visible models bump its instanceCount and write their instance data.
+// The camera uses two-phase occlusion culling: what was visible last frame is drawn first, a depth
+// pyramid is built from that, and everything else is tested against it and drawn in a second pass
+class GpuCuller {
+public:
+    void initialize(Renderer &renderer, const std::vector<Model> &models, const std::vector<Mesh> &meshes, const std::vector<DrawBatch> &batches,
+                    size_t static_transform_group, size_t dynamic_transform_group, size_t instance_group, uint32_t instance_section_size);
+
+    // Camera the next record picks the LODs for, proj_scale is |proj[1][1]|
+    void set_lod_view(const glm::vec3 &eye, float proj_scale, bool perspective, float near_plane);
+
+    // LODs and early phase into camera_section, and the casters of the light jobs, whose frustums are
+    // indices into light_frustums. Has to be recorded outside of a render pass
+    void record(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, const glm::mat4 &camera_view_proj, uint32_t camera_section,
+                const std::vector<Frustum> &light_frustums, const std::vector<ShadowCullJob> &light_jobs);
+    // Late phase into late_section, after the early section is drawn and the renderer's depth pyramid
+    // is built from it. Also decides what the next frame draws early
+    void record_late(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, uint32_t late_section);
+
+    bool initialized() const { return m_initialized; }
+
+private:
+    // Batch commands with instanceCount 0, filled in by the dispatches
+    void reset_section(Renderer &renderer, int current_frame, uint32_t section);
+    void dispatch(Renderer &renderer, const Frustum &frustum, uint32_t section, uint32_t phase);
+    void dispatch(Renderer &renderer, const std::vector<Frustum> &frustums, const ShadowCullJob &job);
+    void write_pyramid_descriptors(Renderer &renderer);
+
+    CullPipeline m_pipeline;
+    size_t m_object_buffer_idx = 0;
+    // One flag per object, set when it passed the last occlusion test. Shared by the frames in flight,
+    // the GPU runs them in order
+    size_t m_visibility_buffer_idx = 0;
+    // Per frame, the camera the LODs are picked for and the pyramid the late phase tests against
+    size_t m_occlusion_view_buffer_idx = 0;
+    GpuOcclusionView m_view{};
+    // Per frame, GpuCullFrustums
+    size_t m_frustum_buffer_idx = 0;
+    uint32_t m_pyramid_version = 0;
+    // One LOD per object, written by the early phase. It is also the hysteresis state, so like the
+    // visibility flags it is shared by the frames in flight
+    size_t m_lod_buffer_idx = 0;
+    uint32_t m_object_count = 0;
+    uint32_t m_instance_section_size = 0;
+    // instanceCount 0, firstInstance relative to the section
+    std::vector<VkDrawIndexedIndirectCommand> m_batch_commands;
+    bool m_initialized = false;
+};
+
+}
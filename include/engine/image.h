@@ -7,6 +7,13 @@ namespace Engine {
 
 class Renderer;
 
+// CPU-side RGBA8 pixels, decoded ahead of the GPU upload
+struct DecodedImage {
+    std::string m_filename;
+    int m_width = 0, m_height = 0;
+    std::vector<unsigned char> m_pixels;
+};
+
 struct TextureImage {
     std::string m_filename;
     VkImage m_image;
@@ -27,6 +34,9 @@ struct TextureImageArray {
     uint32_t m_width, m_height;
     uint32_t layer_count = 1;
 
+    // Optional, if filled (one per filename) the files are not decoded again
+    std::vector<DecodedImage> m_decoded;
+
     void cleanup(vkb::DispatchTable &dispatch_table);
 };
 
@@ -46,6 +56,17 @@ struct DepthImage {
     void cleanup(vkb::DispatchTable &dispatch_table);
 };
 
+// Single channel float mip chain. Stays in VK_IMAGE_LAYOUT_GENERAL so compute can write one level while reading another
+struct DepthPyramidImage {
+    VkImage m_image;
+    VkDeviceMemory m_image_memory;
+    VkImageView m_image_view;                   // every level, for sampling
+    std::vector<VkImageView> m_level_views;     // one per level, for storage writes
+    VkSampler m_sampler;
+
+    void cleanup(vkb::DispatchTable &dispatch_table);
+};
+
 struct ShadowMapImage {
     VkImage m_image;
     VkDeviceMemory m_image_memory;
@@ -58,18 +79,22 @@ struct ShadowMapImage {
 class Image {
 public:
     static TextureImage create_texture_image(std::string filename);
-    static TextureImageArray create_texture_image_array(std::vector<std::string> m_filenames, uint32_t width, uint32_t height, uint32_t layer_count);
+    static TextureImageArray create_texture_image_array(std::vector<std::string> m_filenames, uint32_t width, uint32_t height, uint32_t layer_count, std::vector<DecodedImage> decoded={});
     static DepthImage create_depth_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat depth_format);
     static ShadowMapImage create_shadow_map_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat depth_format, uint32_t layer_count=32);
+    static DepthPyramidImage create_depth_pyramid_image(Renderer &renderer, uint32_t width, uint32_t height, uint32_t mip_count);
     static ColorImage create_color_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkSampleCountFlagBits num_samples);
 
+    // Thread-safe, does not touch the device
+    static DecodedImage decode_image(const std::string &filename);
+
     static void initialize_texture_image(Renderer &renderer, TextureImage &texture_image);
     static void initialize_texture_image_array(Renderer &renderer, TextureImageArray &texture_image_array);
 
     static void transition_image_layout(Renderer &renderer, VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, uint32_t layer_count=1, VkCommandBuffer command_buffer=VK_NULL_HANDLE);
 private:
 
-    static void create_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits num_samples, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, uint32_t layer_count=1, VkImageCreateFlags flags=0, VkImageLayout layout=VK_IMAGE_LAYOUT_UNDEFINED);
+    static void create_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits num_samples, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, uint32_t layer_count=1, VkImageCreateFlags flags=0, VkImageLayout layout=VK_IMAGE_LAYOUT_UNDEFINED, uint32_t mip_levels=1);
     static VkImageView create_image_view(Renderer &renderer, VkImage image, VkFormat format, VkImageAspectFlags aspect_flags);
     static VkImageView create_image_array_view(Renderer &renderer, VkImage image, VkFormat format, VkImageAspectFlags aspect_flags, uint32_t layer_count=1);
     static VkSampler create_texture_sampler(Renderer &renderer);
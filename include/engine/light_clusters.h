@@ -0,0 +1,67 @@
+#pragma once
+#include <engine/compute_pipeline.h>
+
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace Engine {
+class Renderer;
+
+// Froxel grid: screen tiles times exponential depth slices between the camera's near and far plane
+constexpr uint32_t CLUSTER_TILES_X = 16;
+constexpr uint32_t CLUSTER_TILES_Y = 9;
+constexpr uint32_t CLUSTER_SLICES = 24;
+constexpr uint32_t CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+constexpr uint32_t MAX_LOCAL_LIGHTS = 256;
+// Index list room, on average this many lights per cluster. Clusters past the end get fewer lights
+constexpr uint32_t CLUSTER_AVERAGE_LIGHTS = 32;
+
+// Point or spot light without a shadow, matches LocalLight in light_clusters.comp and shader.frag (std430)
+struct LocalLight {
+    glm::vec3 position;
+    float range;            // no light past this distance
+    glm::vec3 color;
+    float intensity;
+    glm::vec3 direction;    // spot lights only
+    float cos_outer;        // -1 or less for a point light
+    float cos_inner;
+    float padding[3];
+};
+
+// Matches ClusterParams in light_clusters.comp and shader.frag (std430), in front of the lights
+struct LightClusterParams {
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::mat4 inverse_proj;
+    glm::vec4 screen;       // width, height, tile width, tile height in pixels
+    float slice_scale;      // slice = log(view depth) * slice_scale + slice_bias
+    float slice_bias;
+    uint32_t light_count;
+    uint32_t index_count;   // bumped by the cluster pass, 0 from the CPU
+    uint32_t index_capacity;
+    uint32_t padding[3];
+};
+
+// Clustered forward shading for many small lights. A compute pass assigns the lights to the froxels
+// they touch, each cluster gets a range in one compact index list, and the fragment shader only
+// loops over its own cluster's lights.
+// The main set gets three per-frame storage buffers: params and lights, cluster ranges (offset, count)
+// and the index list
+class LightClusters {
+public:
+    // Creates the groups at lights_binding, lights_binding + 1 and + 2, before the renderer is initialized
+    void initialize(Renderer &renderer, uint32_t lights_binding);
+
+    // Uploads the lights and the camera and assigns them to the clusters. Has to be recorded outside
+    // of a render pass, before anything that shades
+    void record(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, const std::vector<LocalLight> &lights,
+                const glm::mat4 &view, const glm::mat4 &proj, float near_plane, float far_plane);
+
+private:
+    LightClusterPipeline m_pipeline;
+    size_t m_light_group = 0;
+    size_t m_range_group = 0;
+    size_t m_index_group = 0;
+};
+
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace Engine {
+
+// Quadric error metric edge collapse (Garland & Heckbert) that only ever moves a vertex onto the
+// other end of an edge, so the result indexes the same vertices as the input and LODs can share
+// one vertex range. Border vertices and seam vertices (same position, split attributes) stay put,
+// which keeps outlines and UV/material seams closed.
+// Stops at target_index_count, or once the cheapest collapse would move the surface further than
+// max_error (mesh units). out_error gets the largest error that was accepted
+std::vector<uint32_t> simplify_mesh(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices,
+                                    size_t target_index_count, float max_error, float *out_error=nullptr);
+
+}
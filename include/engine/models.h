@@ -13,6 +13,7 @@
 
 #include <tiny_obj_loader.h>
 #include <engine/renderer.h>
+#include <engine/culling.h>
 
 namespace Engine {
 struct Vertex {
@@ -73,18 +74,42 @@ struct Vertex {
 
         return attr_desc;
     }
+
+    // Position only, same binding (and stride) as the full layout
+    static std::vector<VkVertexInputAttributeDescription> get_position_attribute_description() {
+        return {get_attribute_description()[0]};
+    }
 };
 
+// Size of the layers of the shadow map image. Each light gets a square of its shadow resolution
+// somewhere in them (the atlas), smaller lights share a layer. The upper half of the layers holds
+// the lights' cached static casters, at the same place as the light
+constexpr uint32_t SHADOW_MAP_SIZE = 1024;
+constexpr uint32_t MIN_SHADOW_RESOLUTION = 128;
+constexpr uint32_t SHADOW_MAP_LAYERS = 32;
+constexpr uint32_t MAX_SHADOW_LIGHTS = SHADOW_MAP_LAYERS / 2;
+constexpr uint32_t MAX_SHADOW_CASCADES = 4;
+// maxMultiviewViewCount is at least 6, with more lights every light gets its own shadow pass
+constexpr uint32_t MAX_MULTIVIEW_SHADOW_LIGHTS = 6;
+
 struct Light {
     glm::mat4 mvp;
-    VkImageView image_view;
-    VkFramebuffer framebuffer;
     int type;   // 0 is directional
-
-    void cleanup(vkb::DispatchTable &dispatch_table) {
-        dispatch_table.destroyImageView(image_view, nullptr);
-        dispatch_table.destroyFramebuffer(framebuffer, nullptr);
-    }
+    bool skip_shadow_pass;
+
+    // Power of two between MIN_SHADOW_RESOLUTION and SHADOW_MAP_SIZE. The lights share one image,
+    // it is only D16 if every light asks for it
+    uint32_t shadow_resolution = SHADOW_MAP_SIZE;
+    bool low_precision_shadow = false;
+    // Place of the square in the atlas, picked by the renderer
+    uint32_t atlas_layer;
+    VkOffset2D atlas_offset;
+
+    // Static casters only, same square in layer MAX_SHADOW_LIGHTS + atlas_layer. Valid while the
+    // light has not moved and nothing static has
+    glm::mat4 cached_mvp;
+    uint32_t cached_static_version;
+    bool cache_valid;
 };
 
 struct PushConstants {
@@ -95,23 +120,99 @@ struct PushConstants {
     glm::vec4 light_color = glm::vec4(1.f, 1.f, 1.f, 1.f);
 };
 
-struct Model {
+// Read by the fragment shader (binding 5) to pick the shadow map layer. A light without cascades is
+// a single cascade that reaches infinitely far
+struct ShadowCascades {
+    glm::mat4 light_pv[MAX_SHADOW_CASCADES];
+    glm::vec4 split_depths = glm::vec4(0.f);    // far view space depth of each cascade
+    glm::vec4 atlas_rects[MAX_SHADOW_CASCADES]; // uv offset, uv scale and layer, see Renderer::get_shadow_atlas_rect
+    uint32_t count = 0;
+    uint32_t first_light = 0;                   // light index of cascade 0
+    uint32_t padding[2] = {};
+};
+
+// Read by the multiview shadow pass (binding 6), view i draws light i
+struct ShadowViews {
+    glm::mat4 light_pv[MAX_MULTIVIEW_SHADOW_LIGHTS];
+};
+
+// Per draw instance, read by the vertex shaders through gl_InstanceIndex
+struct InstanceData {
+    uint32_t transform_idx;     // slot in the model matrix storage buffer
+    float base_texture;         // added to the vertex material idx
+    uint32_t padding[2];
+};
+
+// Level 0 is the full mesh, the rest come from simplification at import
+constexpr uint32_t MAX_MESH_LODS = 4;
+// Screen size (sphere radius / half screen height) below which LOD l + 1 is used. Picked on the CPU,
+// or in cull.comp for the opaque models when the GPU culls
+constexpr float LOD_SCREEN_SIZES[MAX_MESH_LODS - 1] = {0.3f, 0.12f, 0.05f};
+constexpr float LOD_HYSTERESIS = 0.15f;
+
+// Index range of one detail level, relative to the mesh's first_index. Every level uses the same vertices
+struct MeshLod {
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+    float error = 0.f;          // how far the surface moved, mesh units
+};
+
+// Geometry loaded once per file, shared by every model that references it
+struct Mesh {
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
-    size_t vertex_buffer_idx, index_buffer_idx;
-    size_t vertex_buffer_size, index_buffer_size;
+    std::vector<uint32_t> lod_indices;      // levels 1+ back to back, they follow indices in the index buffer
+
+    // Where the mesh sits in the scene wide vertex/index buffers, index_count is level 0
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+    int32_t vertex_offset = 0;
+
+    MeshLod lods[MAX_MESH_LODS];
+    uint32_t lod_count = 1;
+
+    glm::mat4 import_matrix = glm::mat4(1.f);   // axis fix for the file format
+
+    // Object space bounds, filled in at import
+    AABB local_bounds;
+    glm::vec4 local_sphere = glm::vec4(0.f);    // xyz center, w radius
+
+    void compute_bounds();
+    // Needs the bounds, the error budget scales with the mesh
+    void generate_lods();
+};
+
+// An instance of a mesh in the scene
+struct Model {
+    uint32_t mesh_idx = 0;
+    uint32_t transform_idx = 0;         // slot in the model matrix storage buffer
+    uint32_t batch_idx = 0;             // first opaque draw batch of the mesh (one per LOD), set in create_buffers
+    uint32_t lod = 0;                   // picked every frame from the size on screen
 
     glm::mat4 model_matrix = glm::mat4(1.f);
-    float base_texture=0;   // idx of first texture (float so I can pass it as an attr)
+    float base_texture=0;   // idx of first texture
+    bool updating = false;  // moves at runtime
+
+    // Copied from the mesh so culling does not need the mesh table
+    AABB local_bounds;
+    glm::vec4 local_sphere = glm::vec4(0.f);    // xyz center, w radius
+
+    AABB world_bounds() const { return local_bounds.transformed(model_matrix); }
+    glm::vec4 world_sphere() const;
+};
 
-    void create_buffers(Engine::Renderer &renderer);
-    void refresh_buffers(Engine::Renderer &renderer);
+// Opaque models sharing a mesh and LOD, drawn with one instanced command
+struct DrawBatch {
+    uint32_t mesh_idx;
+    uint32_t lod;
+    uint32_t first_instance;    // within a section of the instance buffer
+    uint32_t instance_count;    // models using the mesh, any of them can pick this LOD
 };
 
 struct ModelInfo {
     size_t model_idx;               // idx in scene models
     size_t model_sub_idx;           // idx within a model
-    size_t model_transform_idx;     // idx for the transform 
+    size_t model_transform_idx;     // load order idx, the GPU slot is assigned in create_buffers
 };
 
 }
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <engine/culling.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace Engine {
+
+// Low resolution depth buffer rasterized on the CPU, for occlusion culling where a compute cull against
+// a depth pyramid costs more than it saves (software Vulkan, small integrated GPUs).
+// A few simplified occluder meshes are drawn into it, then boxes are tested against it.
+// Depth is [0, 1] with 1 far, same as the main pass
+class OcclusionRasterizer {
+public:
+    static constexpr uint32_t WIDTH = 256;
+    static constexpr uint32_t HEIGHT = 128;
+    // One thread per tile at a time, the width stays a multiple of the SIMD width
+    static constexpr uint32_t TILE_WIDTH = 64;
+    static constexpr uint32_t TILE_HEIGHT = 32;
+    static constexpr uint32_t TILES_X = WIDTH / TILE_WIDTH;
+    static constexpr uint32_t TILES_Y = HEIGHT / TILE_HEIGHT;
+    static constexpr uint32_t TILE_COUNT = TILES_X * TILES_Y;
+
+    // Occluder geometry is kept here, add_occluder refers to it by the returned id
+    uint32_t add_mesh(std::vector<glm::vec3> positions, std::vector<uint32_t> indices);
+
+    // Drops the last frame's occluders
+    void begin(const glm::mat4 &view_proj);
+    // Projects the mesh's triangles and bins them into the tiles they touch
+    void add_occluder(uint32_t mesh, const glm::mat4 &model_matrix);
+    // Clears the depth and draws the binned triangles, tiles are split across the thread pool
+    void rasterize();
+
+    // False only if every pixel the box could cover has an occluder in front of the whole box
+    bool is_visible(const AABB &box) const;
+
+private:
+    struct OccluderMesh {
+        std::vector<glm::vec3> positions;
+        std::vector<uint32_t> indices;
+    };
+
+    // Counter clockwise in screen space, inside is every edge function >= 0.
+    // Depth is the plane z = z_a * x + z_b * y + z_c
+    struct Triangle {
+        float edge_a[3], edge_b[3], edge_c[3];
+        float z_a, z_b, z_c;
+        int min_x, min_y, max_x, max_y;
+    };
+
+    void rasterize_tile(uint32_t tile);
+
+    std::vector<OccluderMesh> m_meshes;
+    glm::mat4 m_view_proj = glm::mat4(1.f);
+    std::vector<glm::vec4> m_projected;     // screen x, y, depth, 0 if the vertex is in front of the near plane
+
+    std::vector<Triangle> m_triangles;
+    std::vector<uint32_t> m_bins[TILE_COUNT];
+
+    // Tile after tile, each TILE_WIDTH x TILE_HEIGHT row major so a thread only touches its own lines
+    std::vector<float> m_depth;
+    float m_tile_max[TILE_COUNT];
+};
+
+}
@@ -29,6 +29,20 @@ protected:
 };
 
 class ShadowPipeline: public Pipeline {
+public:
+    // With a view_mask it draws every light at once through multiview, view i is light i.
+    // The light matrices come from binding 6 instead of the push constants, see Renderer::use_multiview_shadows
+    explicit ShadowPipeline(uint32_t view_mask=0): m_view_mask(view_mask) {}
+
+    void create_pipeline(Engine::Renderer &device, VkFormat image_format, VkRenderPass render_pass=VK_NULL_HANDLE) override;
+
+private:
+    uint32_t m_view_mask;
+};
+
+// Depth only version of the main opaque pipeline, runs before it in the same pass.
+// render_pass is the main pass, the color attachment is there but never written
+class DepthPrepassPipeline: public Pipeline {
     void create_pipeline(Engine::Renderer &device, VkFormat image_format, VkRenderPass render_pass=VK_NULL_HANDLE) override;
 };
 
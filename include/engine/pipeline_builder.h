@@ -20,6 +20,8 @@ public:
     void create_pipeline_layout(Renderer &device, std::vector<VkDescriptorSetLayout> descriptor_set_layout);
 
     void set_shaders(Renderer &device, const std::string &vert_shader_filename, const std::string &frag_shader_filename);
+    // No fragment stage at all, for depth only pipelines
+    void set_vertex_shader(Renderer &device, const std::string &vert_shader_filename);
     void add_push_constants(uint32_t pc_size, uint32_t offset=0, VkShaderStageFlags shader_stage=VK_SHADER_STAGE_VERTEX_BIT);
     
     void set_input_topology(VkPrimitiveTopology input_topology) { m_input_topology = input_topology; }
@@ -39,12 +41,17 @@ public:
 
     void enable_depth_write() { m_enable_depth_write = true; }
     void disable_depth_write() { m_enable_depth_write = false; }
+    void set_depth_compare_op(VkCompareOp compare_op) { m_depth_compare_op = compare_op; }
 
     void enable_msaa() { m_enable_msaa = true; }
     void disable_msaa() { m_enable_msaa = false; }
 
     void enable_color_attachment() { m_use_color_attachment = true; }
     void disable_color_attachment() { m_use_color_attachment = false; }
+    // Keeps the attachment (so the render pass still matches) but writes nothing to it
+    void disable_color_write() { m_enable_color_write = false; }
+    // Needs the depthClamp feature
+    void enable_depth_clamp() { m_enable_depth_clamp = true; }
 
     void enable_dynamic_state() { m_enable_dynamic_state = true; }
     void disable_dynamic_state() { m_enable_dynamic_state = false; }
@@ -53,9 +60,16 @@ public:
     
     PipelineData build(Renderer &device);
 
-    void create_render_pass(Renderer &renderer, vkb::Swapchain swapchain, VkRenderPass old_render_pass);
+    // keep_contents loads the color and depth left by an earlier main pass instead of clearing them.
+    // Both variants are compatible, pipelines and framebuffers work with either.
+    // With dynamic rendering no render pass is made, the pipeline is built for the main attachment formats
+    void create_render_pass(Renderer &renderer, vkb::Swapchain swapchain, VkRenderPass old_render_pass, bool keep_contents=false);
     void set_render_pass(VkRenderPass render_pass) { m_render_pass = render_pass; }
-    void create_shadow_render_pass(Renderer &renderer); 
+    VkRenderPass get_render_pass() const { return m_render_pass; }
+    // keep_contents loads the depth already in the layer (left in DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    // instead of clearing it, compatible with the clearing variant.
+    // A non zero view_mask makes it a multiview pass, view i draws into layer i of the attachment
+    void create_shadow_render_pass(Renderer &renderer, bool keep_contents=false, uint32_t view_mask=0);
 
 private:
     VkPipelineDynamicStateCreateInfo get_dynamic_state_create_info();
@@ -74,6 +88,10 @@ private:
 
     Shader m_vert_shader, m_frag_shader;
     VkRenderPass m_render_pass = VK_NULL_HANDLE;;
+    // Main pass formats for VkPipelineRenderingCreateInfo, in place of the render pass
+    bool m_dynamic_rendering = false;
+    VkFormat m_rendering_color_format = VK_FORMAT_UNDEFINED;
+    VkFormat m_rendering_depth_format = VK_FORMAT_UNDEFINED;
     VkPipeline m_pipeline;
     VkPipelineLayout m_pipeline_layout;
     std::vector<VkDynamicState> m_dynamic_states;
@@ -92,6 +110,9 @@ private:
     bool m_enable_blending = false;
     bool m_enable_depth_test = false;
     bool m_enable_depth_write = false;
+    VkCompareOp m_depth_compare_op = VK_COMPARE_OP_LESS;
+    bool m_enable_color_write = true;
+    bool m_enable_depth_clamp = false;
     bool m_enable_msaa = true;
     bool m_use_color_attachment = true;
     bool m_enable_dynamic_state = true;
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Engine {
+
+struct ProfileEvent {
+    std::string m_name;
+    uint32_t m_thread_id;
+    uint32_t m_depth;           // nesting depth on the recording thread
+    int64_t m_start_us;         // relative to the start of the session
+    int64_t m_duration_us;
+};
+
+// Collects scoped timings (mostly startup stages) from any thread.
+// A summary table is printed by end_session(), and a Chrome trace
+// (chrome://tracing / ui.perfetto.dev) is written if a trace file was set.
+class Profiler {
+public:
+    static Profiler& get();
+
+    void set_chrome_trace_file(std::string filename) { m_trace_filename = filename; }
+
+    int64_t now_us();
+    void record(std::string name, int64_t start_us, int64_t duration_us, uint32_t depth);
+    // Records an event spanning from the start of the session until now
+    void record_since_start(std::string name);
+
+    void print_summary();
+    void write_chrome_trace(const std::string &filename);
+    void end_session();
+
+    static uint32_t current_thread_id();
+
+private:
+    Profiler(): m_session_start(std::chrono::steady_clock::now()) {}
+
+    std::chrono::steady_clock::time_point m_session_start;
+    std::mutex m_mutex;
+    std::vector<ProfileEvent> m_events;
+    std::string m_trace_filename;
+};
+
+class ScopedTimer {
+public:
+    ScopedTimer(std::string name);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    std::string m_name;
+    int64_t m_start_us;
+    uint32_t m_depth;
+};
+
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) Engine::ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(name)
@@ -2,6 +2,8 @@
 #include <vulkan/vulkan.h>
 #include <VkBootstrap.h>
 #include <stdexcept>
+#include <map>
+#include <functional>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
@@ -16,6 +18,9 @@
 #include <engine/window.h>
 #include <engine/image.h>
 #include <engine/pipeline.h>
+#include <engine/compute_pipeline.h>
+#include <engine/command_recorder.h>
+#include <engine/depth_pyramid.h>
 #include <engine/models.h>
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
@@ -26,10 +31,18 @@ class Texture;
 struct Model;
 struct Light;
 
+// Fragment shader invocations in the main passes, the last frame measured with the depth pre-pass on and off
+struct FragmentStats {
+    uint64_t with_prepass = 0;
+    uint64_t without_prepass = 0;
+};
+
 struct UniformBufferGroup {
     size_t m_base_index;
     size_t m_size;
     uint32_t m_binding;
+    bool m_per_frame = true;    // otherwise one device local buffer shared by every frame
+    size_t m_staging_index = 0; // static groups: per-frame staging copies for record_static_group_update
 };
 
 class Renderer {
@@ -45,9 +58,13 @@ public:
     // Return a new command buffer to be filled in
     bool begin_frame(int &current_frame, uint32_t &image_index, VkCommandBuffer &out_buffer);
 
-    void begin_render_pass(VkCommandBuffer &command_buffer, uint32_t image_index);
-    void bind_pipeline_and_descriptors(VkCommandBuffer &command_buffer, int pipeline_idx, int current_frame);
-    void set_default_viewport_and_scissor(VkCommandBuffer &command_buffer);
+    // Use VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS when the pass is filled with record_secondaries.
+    // keep_contents continues on top of an earlier main pass of the same frame instead of clearing.
+    // With dynamic rendering the attachments are given here and there is no render pass object
+    void begin_render_pass(VkCommandBuffer &command_buffer, uint32_t image_index, VkSubpassContents contents=VK_SUBPASS_CONTENTS_INLINE, bool keep_contents=false);
+    void bind_pipeline_and_descriptors(CommandRecorder &recorder, int pipeline_idx, int current_frame);
+    void set_default_viewport_and_scissor(CommandRecorder &recorder);
+    void end_render_pass(VkCommandBuffer command_buffer);
     void end_render_pass_and_command_buffer(VkCommandBuffer command_buffer);
     
     // Draw to the swapchain and perform sync
@@ -60,12 +77,28 @@ public:
     size_t create_vertex_buffer(VkDeviceSize buffer_size);
     size_t create_buffer(VkDeviceSize buffer_size, uint32_t usage, uint32_t memory_props, bool per_frame=false);
     void update_buffer(size_t buffer_idx, void* src_data, size_t src_data_size);
+    // Device local buffers, filled through a temporary staging buffer. Waits for the device to go
+    // idle first so nothing in flight reads the buffer while it is written. Setup only, every call
+    // takes a new buffer slot
+    size_t create_device_local_buffer(VkDeviceSize buffer_size, uint32_t usage);
+    void upload_buffer(size_t buffer_idx, const void* src_data, size_t src_data_size);
 
     void add_descriptor_set_layout_binding(VkDescriptorSetLayoutBinding binding, VkDescriptorBindingFlags binding_flag);
     
     VkDescriptorSetLayout get_descriptor_set_layout() { return m_descriptor_set_layout; }
     
     vkb::DispatchTable m_dispatch;
+    // Tracks the frame's command buffer from begin_frame, record binds and draws through this
+    CommandRecorder& get_recorder() { return m_recorder; }
+
+    // Secondary command buffers =====================================================================
+    // Records framebuffers.size() secondaries that continue render_pass, spread over the thread pool.
+    // record(i, recorder) fills secondary i, they come back in order in out for cmdExecuteCommands.
+    // Dynamic state is not inherited, each secondary has to set its own viewport and scissor.
+    // A null render_pass continues a main pass begun with dynamic rendering
+    void record_secondaries(int current_frame, VkRenderPass render_pass, const std::vector<VkFramebuffer> &framebuffers,
+                            const std::function<void(uint32_t, CommandRecorder&)> &record, std::vector<VkCommandBuffer> &out);
+    uint32_t get_secondary_slot_count() const { return m_secondary_slot_count; }
 
     VkCommandBuffer begin_single_time_command();
     void end_single_time_command(VkCommandBuffer command_buffer);
@@ -73,10 +106,88 @@ public:
     void copy_buffer_to_image(size_t buffer_idx, VkImage &image, uint32_t width, uint32_t height, uint32_t layer=0);
 
     void add_texture(std::string filename, uint32_t binding);
-    void add_texture_array(std::vector<std::string> filename, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t binding);
-
-    int add_light(glm::mat4 mvp, int type);
-    void render_shadow_maps(VkCommandBuffer command_buffer, std::vector<Engine::Model> &models);
+    void add_texture_array(std::vector<std::string> filename, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t binding, std::vector<DecodedImage> decoded={});
+
+    // shadow_resolution is the side of the light's square in the shadow atlas, see Light
+    int add_light(glm::mat4 mvp, int type, uint32_t shadow_resolution=SHADOW_MAP_SIZE, bool low_precision_shadow=false);
+    // uv offset (xy), uv scale (z) and layer (w) of the light's square in the shadow map image
+    glm::vec4 get_shadow_atlas_rect(uint32_t light) const;
+    // D16 when every light asked for it, D32 otherwise. Known once initialize made the image
+    VkFormat get_shadow_format() const { return m_shadow_format; }
+    // Lights that follow the camera (shadow cascades) are moved every frame before the shadow pass
+    void set_light_matrix(uint32_t light, const glm::mat4 &mvp) { m_lights[light].mvp = mvp; }
+    // For lights that cannot shadow anything on screen, their layer is left as it is
+    void set_skip_shadow_pass(uint32_t light, bool skip) { m_lights[light].skip_shadow_pass = skip; }
+    // Shadow passes clamp depth instead of clipping at the light's near plane
+    bool supports_depth_clamp() const { return m_depth_clamp; }
+    // Each light's static casters are drawn into a cached layer, which is copied into the light's
+    // layer every frame before its dynamic casters are drawn on top. The cache is redrawn when the
+    // light moves or static_version (see Scene::get_static_version) changes. Lights that share an
+    // atlas layer are redrawn together, one stale light makes the others stale too
+    bool shadow_cache_valid(uint32_t light, uint32_t static_version) const;
+    // Light l draws its static casters from section first_section + 2l, only if its cache is stale,
+    // and its dynamic ones from first_section + 2l + 1. With multiview shadows every light draws
+    // from first_section (static) and first_section + 1 (dynamic)
+    void render_shadow_maps(VkCommandBuffer command_buffer, int current_frame, uint32_t first_section, uint32_t static_version);
+    // With the multiview feature, at most MAX_MULTIVIEW_SHADOW_LIGHTS lights and one shadow resolution
+    // for all of them, each light is a view of a single shadow pass and every caster is submitted once
+    // for all of them. Known once the lights are added
+    bool use_multiview_shadows() const;
+    // Multiview redraws the caches of all lights at once, when any light that is not skipped is stale
+    bool shadow_caches_valid(uint32_t static_version) const;
+
+    // Scene wide geometry, every draw indexes into these two buffers
+    void set_geometry_buffers(size_t vertex_buffer_idx, size_t index_buffer_idx) { m_vertex_buffer_idx = vertex_buffer_idx; m_index_buffer_idx = index_buffer_idx; }
+    void bind_geometry_buffers(CommandRecorder &recorder);
+
+    // Multi-draw indirect ===========================================================================
+    // Per-frame, persistently mapped buffer of VkDrawIndexedIndirectCommand split into sections
+    // (one per pass), each with room for max_draws commands
+    void create_indirect_buffers(uint32_t section_count, uint32_t max_draws);
+    VkDrawIndexedIndirectCommand* get_indirect_commands(int current_frame, uint32_t section);
+    void set_indirect_draw_count(int current_frame, uint32_t section, uint32_t count);
+    // One vkCmdDrawIndexedIndirect(Count) for the whole section, or one per command without multiDrawIndirect
+    void draw_indirect(CommandRecorder &recorder, int current_frame, uint32_t section);
+    bool supports_multi_draw_indirect() const { return m_multi_draw_indirect; }
+    bool supports_draw_indirect_count() const { return m_draw_indirect_count; }
+    // For compute passes that write the commands themselves
+    VkBuffer get_indirect_buffer(int current_frame) { return get_buffer(m_indirect_buffer_idx + current_frame); }
+    VkBuffer get_indirect_count_buffer(int current_frame) { return get_buffer(m_indirect_count_buffer_idx + current_frame); }
+    uint32_t get_indirect_section_size() const { return m_indirect_section_size; }
+
+    // Destroyed in cleanup, the pipeline object itself is owned by the caller
+    void add_compute_pipeline(ComputePipeline* pipeline) { m_compute_pipelines.push_back(pipeline); }
+
+    // Occlusion ======================================================================================
+    // Max depth mip chain of what the main passes drew so far this frame, between two main passes
+    void build_depth_pyramid(VkCommandBuffer command_buffer) { m_depth_pyramid.build(*this, command_buffer, m_depth.m_image); }
+    const DepthPyramid& get_depth_pyramid() const { return m_depth_pyramid; }
+
+    // Dynamic rendering =============================================================================
+    // Main passes begin with the swapchain, color and depth views instead of a render pass and
+    // framebuffers, so a resize only recreates the images. On by default with VK_KHR_dynamic_rendering
+    // (core in 1.3), can be turned off between initialize_vulkan and initialize. The shadow passes
+    // keep their render passes, their framebuffers are made once
+    void set_dynamic_rendering(bool enabled) { m_dynamic_rendering = enabled && m_dynamic_rendering_supported; }
+    bool uses_dynamic_rendering() const { return m_dynamic_rendering; }
+
+    // Depth pre-pass =================================================================================
+    // Pipeline 2 has to be the opaque pipeline with an EQUAL depth test and no depth writes, it takes
+    // the place of pipeline 0 after the pre-pass. Can be switched between any two frames
+    void set_depth_prepass(bool enabled) { m_depth_prepass = enabled && m_pipelines.size() > 2; }
+    bool depth_prepass_enabled() const { return m_depth_prepass; }
+    void bind_depth_prepass_pipeline(CommandRecorder &recorder, int current_frame);
+    VkPipelineLayout get_depth_prepass_pipeline_layout() { return m_depth_prepass_pipeline.get_pipeline_layout(); }
+
+    // Counts fragment shader invocations from here (outside of any render pass) until
+    // end_render_pass_and_command_buffer. Read back once the frame's fence has signaled.
+    // Needs pipelineStatisticsQuery and inheritedQueries, a no-op without
+    void begin_pipeline_statistics(VkCommandBuffer command_buffer);
+    bool supports_pipeline_statistics() const { return m_pipeline_statistics; }
+    FragmentStats get_fragment_stats() const { return m_fragment_stats; }
+
+    // Maps on first use and stays mapped until the buffer is destroyed
+    void* map_buffer(size_t buffer_idx);
 
     template<typename T>
     size_t create_uniform_group(uint32_t binding, VkShaderStageFlags stage_flags, bool storage_buffer=false) {
@@ -129,13 +240,24 @@ public:
 
         return m_uniforms.size() - 1;
     }
+    // Device local storage buffer written through staging, for data that (almost) never changes.
+    // Not mappable, update_uniform_group on it stalls the device
+    size_t create_static_storage_group(uint32_t binding, uint32_t size, VkShaderStageFlags stage_flags);
+    // Rewrites a static group from the frame's command buffer through the frame's staging copy, no
+    // stall. Outside of any render pass, before anything that reads the group
+    void record_static_group_update(VkCommandBuffer command_buffer, int current_frame, size_t idx, const void* data);
     void update_uniform_group(size_t idx, void* data);
+    VkBuffer get_uniform_buffer(size_t idx, int current_frame) { return m_buffers[uniform_buffer_idx(idx, current_frame)]; }
+    void* map_uniform_group(size_t idx, int current_frame) { return map_buffer(uniform_buffer_idx(idx, current_frame)); }
     size_t create_storage_buffer(VkDeviceSize buffer_size);
 
 
     bool window_should_close();
+    Window& get_window() { return m_window; }
     VkRenderPass get_render_pass() { return m_render_pass; }
-    VkFramebuffer get_framebuffer(int image_index) { return m_swapchain_framebuffers[image_index]; }
+    VkRenderPass get_keep_contents_render_pass() { return m_keep_contents_render_pass; }
+    // Null with dynamic rendering, like the render passes
+    VkFramebuffer get_framebuffer(int image_index) { return m_swapchain_framebuffers.empty() ? VK_NULL_HANDLE : m_swapchain_framebuffers[image_index]; }
     VkExtent2D get_swapchain_extent() { return m_swapchain.extent; }
     VkBuffer get_buffer(size_t idx) { return m_buffers[idx]; }
     VkDescriptorSet get_descriptor_set(int idx) { return m_descriptor_sets[idx]; }
@@ -157,9 +279,21 @@ private:
     // Must set a render pass before calling this
     void create_framebuffers();
     void create_command_pool();
-    void create_command_buffer();
+    // One transient pool per frame in flight, reset as a whole once the frame's fence signals
+    void create_frame_command_pools();
+    // One pool per frame in flight and recording thread, pools are not thread safe
+    void create_secondary_command_pools();
+    VkCommandBuffer begin_secondary(int current_frame, uint32_t slot, VkRenderPass render_pass, VkFramebuffer framebuffer, CommandRecorder &recorder);
 
     void create_sync_objects();
+    void create_query_pool();
+    // Results of the frame that last used this frame's query, if it has been recorded
+    void read_pipeline_statistics(int current_frame);
+    void end_pipeline_statistics(VkCommandBuffer command_buffer);
+
+    // Barriers in place of the render pass layouts and dependency, see begin_render_pass
+    void begin_rendering(VkCommandBuffer command_buffer, uint32_t image_index, VkSubpassContents contents, bool keep_contents);
+    void end_rendering(VkCommandBuffer command_buffer, bool present);
 
     void recreate_swap_chain();
     void cleanup_swapchain();
@@ -169,6 +303,7 @@ private:
     void create_descriptor_set_layout();
 
     size_t create_uniform_buffer(VkDeviceSize buffer_size);
+    size_t uniform_buffer_idx(size_t idx, int current_frame) const { return m_uniforms[idx].m_base_index + (m_uniforms[idx].m_per_frame ? current_frame : 0); }
     void destroy_buffer(int buffer_idx);
     void destroy_pipeline(int pipeline_idx);
 
@@ -179,6 +314,14 @@ private:
     VkSampleCountFlagBits get_max_usable_sample_count();
     
     void initialize_lights();
+    // Only this light's own cache, shadow_cache_valid also looks at the lights sharing its layer
+    bool light_cache_valid(uint32_t light, uint32_t static_version) const;
+    void set_shadow_viewport(CommandRecorder &recorder, const Light &light);
+    void record_shadow_pass(CommandRecorder &recorder, int current_frame, uint32_t light, uint32_t section);
+    void create_multiview_shadow_resources();
+    void render_multiview_shadow_maps(VkCommandBuffer command_buffer, int current_frame, uint32_t first_section, uint32_t static_version);
+    // Caches into their light's square, leaves the layers of the lights ready for the keep pass
+    void copy_shadow_caches(VkCommandBuffer command_buffer, const std::vector<uint32_t> &lights);
 
 
     // Vulkan context
@@ -199,10 +342,39 @@ private:
     std::vector<VkImageView> m_swapchain_image_views;
     std::vector<VkFramebuffer> m_swapchain_framebuffers;
     VkRenderPass m_render_pass = VK_NULL_HANDLE;
+    VkRenderPass m_keep_contents_render_pass = VK_NULL_HANDLE;
+    bool m_dynamic_rendering_supported = false;
+    bool m_dynamic_rendering = false;
 
     // Command objects
-    VkCommandPool m_command_pool;
-    std::vector<VkCommandBuffer> m_command_buffers;
+    // Buffers are allocated on demand and handed out again after the pool is reset
+    struct FrameCommandPool {
+        VkCommandPool pool = VK_NULL_HANDLE;
+        VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        std::vector<VkCommandBuffer> buffers;
+        uint32_t used = 0;
+    };
+    void create_frame_command_pool(FrameCommandPool &pool, VkCommandBufferLevel level);
+    void reset_frame_command_pool(FrameCommandPool &pool);
+    VkCommandBuffer next_command_buffer(FrameCommandPool &pool);
+
+    VkCommandPool m_command_pool;       // single time commands
+    FrameCommandPool m_frame_pools[MAX_FRAMES_IN_FLIGHT];
+    CommandRecorder m_recorder;
+
+    // [frame * slot_count + slot]
+    std::vector<FrameCommandPool> m_secondary_pools;
+    uint32_t m_secondary_slot_count = 1;
+    std::vector<VkFramebuffer> m_shadow_framebuffers;
+    std::vector<VkCommandBuffer> m_shadow_secondaries;
+    std::vector<VkCommandBuffer> m_shadow_cache_secondaries;
+    std::vector<uint32_t> m_active_shadow_lights;
+    std::vector<uint32_t> m_skipped_shadow_lights;
+    std::vector<uint32_t> m_active_shadow_layers;
+    std::vector<uint32_t> m_stale_shadow_layers;
+    std::vector<uint32_t> m_shadow_copy_layers;
+    std::vector<VkImageMemoryBarrier> m_shadow_barriers;
+    std::vector<VkImageCopy> m_shadow_copies;
 
     // Descriptor objects
     VkDescriptorPool m_descriptor_pool;
@@ -222,6 +394,7 @@ private:
     std::vector<TextureImageArray> m_texture_arrays;
     
     std::vector<Pipeline*> m_pipelines;
+    std::vector<ComputePipeline*> m_compute_pipelines;
 
     // Window object
     Window m_window;
@@ -235,15 +408,55 @@ private:
 
     // depth resources
     DepthImage m_depth;
+    VkFormat m_depth_format = VK_FORMAT_UNDEFINED;
+    DepthPyramid m_depth_pyramid;
+    DepthPrepassPipeline m_depth_prepass_pipeline;
+    bool m_depth_prepass = false;
+
+    // One pipeline statistics query per frame in flight
+    bool m_pipeline_statistics = false;
+    VkQueryPool m_statistics_query_pool = VK_NULL_HANDLE;
+    bool m_statistics_active = false;
+    bool m_statistics_recorded[MAX_FRAMES_IN_FLIGHT] = {};
+    bool m_statistics_prepass[MAX_FRAMES_IN_FLIGHT] = {};
+    FragmentStats m_fragment_stats;
 
     // for msaa
     VkSampleCountFlagBits m_msaa_samples = VK_SAMPLE_COUNT_1_BIT;
     ColorImage m_color_image;
 
+    // scene geometry and indirect draws
+    size_t m_vertex_buffer_idx = 0, m_index_buffer_idx = 0;
+    size_t m_indirect_buffer_idx = 0, m_indirect_count_buffer_idx = 0;
+    uint32_t m_indirect_section_count = 0;
+    uint32_t m_indirect_section_size = 0;
+    std::vector<uint32_t> m_indirect_draw_counts;   // [frame * section_count + section]
+    bool m_multi_draw_indirect = false;
+    bool m_draw_indirect_count = false;
+    std::map<size_t, void*> m_mapped_buffers;
+
     // for lights
     Pipeline* m_shadow_pipeline;
     VkRenderPass m_shadow_render_pass = VK_NULL_HANDLE;
+    VkRenderPass m_shadow_keep_render_pass = VK_NULL_HANDLE;
+    bool m_depth_clamp = false;
     ShadowMapImage m_shadow_map_image;
+    VkFormat m_shadow_format = VK_FORMAT_D32_SFLOAT;
+    // Atlas layers in use, each is drawn by one pass for all of its lights
+    struct ShadowLayer {
+        VkImageView image_view = VK_NULL_HANDLE, cache_image_view = VK_NULL_HANDLE;
+        VkFramebuffer framebuffer = VK_NULL_HANDLE, cache_framebuffer = VK_NULL_HANDLE;
+        std::vector<uint32_t> lights;
+    };
+    std::vector<ShadowLayer> m_shadow_layers;
+    // Multiview shadows: one view over the light layers and one over their caches, the light
+    // matrices are in a uniform at binding 6
+    bool m_multiview = false;
+    Pipeline* m_shadow_multiview_pipeline = nullptr;
+    VkRenderPass m_shadow_multiview_keep_render_pass = VK_NULL_HANDLE;
+    VkImageView m_shadow_layers_view = VK_NULL_HANDLE, m_shadow_cache_layers_view = VK_NULL_HANDLE;
+    VkFramebuffer m_shadow_layers_framebuffer = VK_NULL_HANDLE, m_shadow_cache_layers_framebuffer = VK_NULL_HANDLE;
+    size_t m_shadow_view_group = 0;
     std::vector<Light> m_lights;
 };
 }
\ No newline at end of file
@@ -1,21 +1,51 @@
 #pragma once
 
 #include <engine/models.h>
+#include <engine/bvh.h>
+#include <engine/gpu_culler.h>
+#include <engine/light_clusters.h>
+#include <engine/occlusion_rasterizer.h>
+#include <engine/sort_keys.h>
+#include <engine/dirty_ranges.h>
+#include <engine/scene_graph.h>
 #include <pugixml.hpp>
 
-const int MAX_VERTICES_IN_BUFFER = 4194304; // 2^21
-
 namespace Engine {
 
+struct PickResult {
+    bool hit = false;
+    bool opaque = true;
+    size_t model_idx = 0;           // into m_opaque_models or m_transparent_models
+    float distance = 0.f;           // along the ray direction
+};
+
 class Scene {
 public:
     Scene(float ar): m_aspect_ratio(ar) {}
 
+    // CPU only (xml, mesh import, texture decode), does not need the renderer so it
+    // can run while Vulkan is being initialized. Meshes and textures load in parallel.
     void load_scene_from_xml(std::string filename);
 
-    void render_opaque_models(Renderer &renderer, VkCommandBuffer &command_buffer);
-    void render_transparent_models(Renderer &renderer, VkCommandBuffer &command_buffer);
+    // Fills the indirect sections for this frame (compute cull or CPU), call before any render pass
+    void record_draw_commands(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame);
+    // The main pass is split in two, both filled with secondaries recorded on the thread pool and begun
+    // with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS. The first draws the opaque models that were
+    // visible last frame (with CPU culling, every visible opaque model)
+    void render_early_models(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame, uint32_t image_index);
+    // Between the two main passes: depth pyramid of the first one, and the occlusion test of the rest
+    void record_occlusion_culling(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame);
+    // Second main pass, begun with keep_contents: the opaque models that just passed the occlusion test, then the transparents
+    void render_models(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame, uint32_t image_index);
+    // Opaque and shadow draws go through the renderer's per-frame indirect buffer. Binds its own
+    // pipelines, with the depth pre-pass on the section is drawn twice
+    void render_opaque_models(Renderer &renderer, CommandRecorder &recorder, int current_frame, uint32_t section);
+    // Draws visible transparents [first, first + count) in back to front order
+    void render_transparent_models(Renderer &renderer, CommandRecorder &recorder, uint32_t first, uint32_t count);
+    void render_shadow_maps(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame);
 
+    // Must be set before create_buffers
+    void set_gpu_culling(bool enabled) { m_gpu_culling = enabled; }
     void create_buffers(Renderer &renderer);
 
     void add_light(glm::vec3 light_color, glm::vec3 light_pos, glm::mat4 light_matrix);
@@ -25,28 +55,88 @@ public:
     void set_orthographic_camera(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float near_plane=0.1f, float far_plane=10.f);
 
     void add_orthographic_light(glm::vec3 color, glm::vec3 position, glm::vec3 look_at, glm::vec3 up, float near_plane, float far_plane, float ortho_half_size);
+    // Directional light whose shadow is split into cascade_count slices of the camera view, each
+    // with its own layer, refitted on every update. Casters up to caster_distance in front of a
+    // slice (towards the light) still shadow it
+    void add_cascaded_light(glm::vec3 color, glm::vec3 position, glm::vec3 look_at, glm::vec3 up, uint32_t cascade_count, float caster_distance);
+    // Side of the light's square in the shadow atlas, a power of two up to SHADOW_MAP_SIZE, and whether
+    // D16 is enough for it. Must be set before create_buffers
+    void set_light_shadow(uint32_t light, uint32_t resolution, bool low_precision);
+
+    // Unshadowed point and spot lights, shaded through the light clusters, up to MAX_LOCAL_LIGHTS.
+    // Return the index for update_local_light
+    uint32_t add_point_light(glm::vec3 color, glm::vec3 position, float range, float intensity=1.f);
+    uint32_t add_spot_light(glm::vec3 color, glm::vec3 position, glm::vec3 direction, float range, float inner_degrees, float outer_degrees, float intensity=1.f);
+    void update_local_light(uint32_t light, glm::vec3 position, glm::vec3 direction);
 
     ModelInfo add_model(std::string filename, std::vector<std::string> texture_filename, bool opaque=true, bool updating=false);
 
     void update_opaque_model_transform(ModelInfo &mi, glm::mat4 transform, bool replace=false);
     void update_transparent_model_transform(ModelInfo &mi, glm::mat4 transform, bool replace=false);
 
+    // Opaque models only. Hides what is behind the model when culling on the CPU, meant for a few
+    // large simple things (walls, buildings). An occluder must never be larger than the model it
+    // stands for, or visible objects get culled. The full mesh is rasterized unless proxy_filename
+    // gives an authored mesh that lies inside it. Simplified LODs are not used, they can bulge out
+    void set_occluder(const ModelInfo &mi, const std::string &proxy_filename="");
+
+    // Transform hierarchy ===========================================================================
+    // Nodes are positioned through get_graph(), world matrices are refreshed in update
+    NodeId add_node(NodeId parent=NO_NODE) { return m_graph.create_node(parent); }
+    SceneGraph& get_graph() { return m_graph; }
+    // The model follows the node from now on, its current matrix is kept as an offset from the node.
+    // Has to be added with updating set
+    void attach_model(const ModelInfo &mi, NodeId node, bool opaque=true);
+
     void update_camera_view(glm::mat4 view) { m_push_constants.view = view; }
     void update_camera_proj(glm::mat4 proj) { m_push_constants.proj = proj; }
 
     int num_textures() { return (int)m_textures.size(); }
 
+    // Bumped whenever anything in the static partition moves, so per-frame work on static
+    // objects can be skipped while it stays the same
+    uint32_t get_static_version() const { return m_static_version; }
+
+    // Results of the culling done in the last update
+    CullStats get_opaque_cull_stats() const { return m_opaque_cull_stats; }
+    CullStats get_transparent_cull_stats() const { return m_transparent_cull_stats; }
+    // Opaque model indices inside each light's frustum, same order as the lights
+    const std::vector<std::vector<uint32_t>>& get_shadow_casters() const { return m_shadow_casters; }
+
+    // Camera (and light) culling against the BVHs, called by update
+    void cull_models();
+    // Detail level of every model from its size on screen, called by update
+    void select_lods();
+
+    // Closest model hit by the ray (triangle exact), or by a ray through a point in NDC
+    PickResult pick(const glm::vec3 &origin, const glm::vec3 &dir);
+    PickResult pick_screen(float ndc_x, float ndc_y);
+
     void update(float delta_time, float aspect_ratio);
 
     std::vector<Engine::Model> m_opaque_models;
     std::vector<Engine::Model> m_transparent_models;
 private:
+    struct PendingMesh {
+        std::string filename;
+        std::vector<std::string> textures;
+        glm::mat4 transform;
+        bool updated_transform;
+        bool opaque;
+        bool updating;
+        bool occluder;
+        std::string occluder_proxy;
+    };
+
     float get_or_add_texture(std::string texture_filename);
-    void load_obj_model(Engine::Model &output_model, std::string filename, float base_texture=0.f);
-    void load_obj_model_with_material(Engine::Model &output_model, std::string filename, float base_texture=0.f, std::string base_dir="");
-    
-    ModelInfo add_obj_model(std::string filename, std::vector<std::string> texture_filename, bool opaque=true, bool updating=false);
-    ModelInfo add_gltf_model(std::string filename, std::vector<std::string> texture_filename, bool opaque=true, bool updating=false);
+
+    // These only touch their arguments, so they are safe to run on worker threads
+    static Mesh load_mesh_file(const std::string &filename);
+    static Mesh load_obj_mesh(const std::string &filename);
+    static Mesh load_gltf_mesh(const std::string &filename);
+
+    ModelInfo commit_model(uint32_t mesh_idx, float base_texture, size_t transform_idx, bool opaque, bool updating);
+    void load_pending_meshes();
 
     // helpers for XML parse
     std::vector<float> parse_floats(const std::string& str);
@@ -55,20 +145,160 @@ private:
     void process_node(const pugi::xml_node& node);
     void process_camera(const pugi::xml_node& node);
     void process_light(const pugi::xml_node& node);
+
+    // Fits each cascade's orthographic projection around its slice of the camera frustum
+    void update_shadow_cascades();
     void process_transform(const pugi::xml_node& node, glm::mat4 &out);
     void process_mesh(const pugi::xml_node& node);
 
-    size_t m_last_non_updating_opaque_model;
-    size_t m_last_non_updating_transparent_model;
-    
+    // Indexed by load order until create_buffers splits them into the static and dynamic partitions
     std::vector<glm::mat4> m_model_transform_matrices;
+    // Loaded once per file, models referencing the same file are instances of it
+    std::vector<Mesh> m_meshes;
+    std::unordered_map<std::string, uint32_t> m_mesh_lookup;
     std::vector<Light> m_lights;
+    // The cascades of the cascaded light are the lights [m_cascade_first_light, + m_cascade_count)
+    uint32_t m_cascade_count = 0;
+    uint32_t m_cascade_first_light = 0;
+    glm::vec3 m_cascade_direction = glm::vec3(0.f, 0.f, -1.f);
+    glm::vec3 m_cascade_up = glm::vec3(0.f, 1.f, 0.f);
+    float m_cascade_caster_distance = 0.f;
+    float m_cascade_split_lambda = 0.75f;      // 0 uniform splits, 1 logarithmic
+    ShadowCascades m_shadow_cascades;
+    size_t m_shadow_cascade_group = 0;
     std::vector<std::string> m_textures;
+    std::vector<DecodedImage> m_decoded_textures;
+    std::vector<PendingMesh> m_pending_meshes;
     PushConstants m_push_constants;
 
+    // BVH ids are opaque model indices, or transparent model indices with this bit set
+    static constexpr uint32_t TRANSPARENT_OBJECT_BIT = 1u << 31;
+
+    // Sections of the renderer's indirect buffer. Opaque is drawn in the first main pass, opaque late
+    // (GPU culling only) in the second. Light l has FIRST_LIGHT + 2l for its static casters and the
+    // next one for its dynamic casters
+    static constexpr uint32_t DRAW_SECTION_OPAQUE = 0;
+    static constexpr uint32_t DRAW_SECTION_OPAQUE_LATE = 1;
+    static constexpr uint32_t DRAW_SECTION_FIRST_LIGHT = 2;
+    // Below this a secondary costs more than recording the draws inline would
+    static constexpr uint32_t MIN_TRANSPARENT_DRAWS_PER_SECONDARY = 64;
+
+    void create_geometry_buffers(Renderer &renderer);
+    void create_draw_batches();
+    // Opaque models only, one instanced draw per batch. Depth is measured from depth_plane
+    void write_draw_commands(Renderer &renderer, int current_frame, uint32_t section, const std::vector<uint32_t> &visible, const glm::vec4 &depth_plane);
+    void sort_transparent_models(const glm::vec4 &depth_plane);
+
+    void mark_moved(const Model &model);
+    // Moves attached models whose node changed in the graph update
+    void update_graph();
+    void partition_transforms();
+    // Writes model_matrix to wherever the model's transform currently lives
+    void write_model_transform(const Model &model);
+    void mark_transform_dirty(uint32_t transform_idx);
+    // Copies this frame's dirty transforms into its mapped SSBO
+    void upload_transforms(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame);
+    void gather_bounds(const std::vector<uint32_t> &objects, std::vector<AABB> &boxes) const;
+    void update_bvh();
+    void query_frustum(const Frustum &frustum, std::vector<uint32_t> &opaque, std::vector<uint32_t> *transparent=nullptr);
+    // Drops the visible models hidden behind the occluders, CPU culling only
+    void cull_occluded_models(const Frustum &frustum, const glm::mat4 &view_proj);
+
+    // Static models get a SAH build, updating ones a tree that is refit when they move
+    BVH m_static_bvh;
+    BVH m_dynamic_bvh;
+    std::vector<uint32_t> m_dynamic_objects;
+    std::vector<uint32_t> m_query_scratch;
+    bool m_bvh_dirty = true;
+    bool m_dynamic_bvh_moved = false;
+
+    std::vector<uint32_t> m_visible_opaque;
+    std::vector<uint32_t> m_visible_transparent;
+    CullStats m_opaque_cull_stats;
+    CullStats m_transparent_cull_stats;
+    std::vector<std::vector<uint32_t>> m_shadow_casters;
+
+    // Per light, from cull_models. Casters are what is inside the light volume, which is open
+    // towards the light when the shadow passes clamp depth
+    struct LightCull {
+        bool visible = false;       // the light volume reaches into the camera frustum
+        Frustum casters;
+        Frustum dynamic_casters;    // cropped to what can shadow the camera frustum
+    };
+    void cull_light(const Light &light, const glm::vec3 (&camera_corners)[8], LightCull &out) const;
+    std::vector<LightCull> m_light_culls;
+    bool m_shadow_depth_clamp = false;
+    // One light's casters (every light's with multiview shadows) split for the renderer's shadow
+    // cache, scratch for record_draw_commands
+    std::vector<uint32_t> m_static_casters;
+    std::vector<uint32_t> m_dynamic_casters;
+    // Appends to both, dynamic casters only if they can shadow the camera's view
+    void collect_light_casters(uint32_t light);
+    // All lights share one shadow pass, see Renderer::use_multiview_shadows
+    bool m_multiview_shadows = false;
+
+    // Occluder geometry is shared by models of the same mesh
+    struct Occluder {
+        uint32_t model_idx;
+        uint32_t mesh;          // in the rasterizer
+    };
+    OcclusionRasterizer m_occlusion_rasterizer;
+    std::vector<Occluder> m_occluders;
+    std::unordered_map<uint32_t, uint32_t> m_occluder_meshes;
+    std::unordered_map<std::string, uint32_t> m_occluder_proxies;
+
+    // Opaque and shadow culling on the GPU, the BVH still handles transparents and picking
+    bool m_gpu_culling = true;
+    GpuCuller m_gpu_culler;
+    std::vector<Frustum> m_light_frustums;
+    std::vector<ShadowCullJob> m_light_jobs;
+
+    // Point and spot lights, assigned to the camera's froxels every frame
+    LightClusters m_light_clusters;
+    std::vector<LocalLight> m_local_lights;
+
+    // Models placed by a graph node, offset is their matrix relative to the node
+    struct NodeAttachment {
+        NodeId node;
+        uint32_t model_idx;
+        bool opaque;
+        glm::mat4 offset;
+    };
+    SceneGraph m_graph;
+    std::vector<NodeAttachment> m_node_attachments;
+
+    // Static partition: device local, written once (and again only if a static model is moved).
+    // Dynamic partition: the models marked updating, one host visible copy per frame in flight.
+    // A model's transform_idx has DYNAMIC_TRANSFORM_BIT set when it is in the dynamic one
+    static constexpr uint32_t DYNAMIC_TRANSFORM_BIT = 1u << 31;
+    bool m_transforms_partitioned = false;
+    std::vector<glm::mat4> m_static_transforms;
+    std::vector<glm::mat4> m_dynamic_transforms;
+    size_t m_static_transform_group = 0;
+    size_t m_dynamic_transform_group = 0;
+    bool m_static_transforms_dirty = false;
+    uint32_t m_static_version = 0;
+    // Dynamic transforms changed since each frame's copy was last written
+    DirtyRanges m_dirty_transforms[MAX_FRAMES_IN_FLIGHT];
+    // Clean gap (in matrices) still worth copying to save a memcpy
+    static constexpr uint32_t TRANSFORM_MERGE_GAP = 4;
+
+    // Per-instance data, indexed with gl_InstanceIndex
+    std::vector<DrawBatch> m_opaque_batches;
+    std::vector<SortItem> m_sort_items;
+    std::vector<SortItem> m_sort_scratch;
+    glm::vec4 m_camera_near_plane = glm::vec4(0.f);
+    size_t m_instance_group = 0;
+    uint32_t m_instance_section_size = 0;
+    uint32_t m_transparent_first_instance = 0;
+
+    // Main pass secondaries, kept around to not reallocate every frame
+    std::vector<VkFramebuffer> m_pass_framebuffers;
+    std::vector<VkCommandBuffer> m_pass_secondaries;
+
     bool perspective = true;
     float m_aspect_ratio;
-    float m_fov, m_near_plane, m_far_plane;
+    float m_fov = 45.f, m_near_plane = 0.1f, m_far_plane = 10.f;
 
     float total_time = 0.f;
 };
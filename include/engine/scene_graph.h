@@ -0,0 +1,70 @@
+#pragma once
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace Engine {
+
+using NodeId = uint32_t;
+constexpr NodeId NO_NODE = UINT32_MAX;
+
+// Transform hierarchy as structure of arrays in depth-first order: every parent comes before its
+// children and a subtree is one contiguous range. World matrices are cached, update is a linear
+// sweep that only recomputes the ranges under dirty nodes. NodeIds stay valid when the order is
+// rebuilt, positions do not
+class SceneGraph {
+public:
+    NodeId create_node(NodeId parent=NO_NODE);
+    // Keeps the local transform, so the node jumps if the new parent is somewhere else
+    void set_parent(NodeId node, NodeId parent);
+    NodeId get_parent(NodeId node) const { return m_parent_ids[node]; }
+
+    void set_local(NodeId node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale);
+    void set_translation(NodeId node, const glm::vec3 &translation);
+    void set_rotation(NodeId node, const glm::quat &rotation);
+    void set_scale(NodeId node, const glm::vec3 &scale);
+
+    // Recomputes the node's subtree in the next update without changing it
+    void mark_dirty(NodeId node) { m_dirty[m_position_of[node]] = 1; }
+
+    glm::vec3 get_translation(NodeId node) const { return m_translation[m_position_of[node]]; }
+    glm::quat get_rotation(NodeId node) const { return m_rotation[m_position_of[node]]; }
+    glm::vec3 get_scale(NodeId node) const { return m_scale[m_position_of[node]]; }
+    // As of the last update
+    const glm::mat4& get_world(NodeId node) const { return m_world[m_position_of[node]]; }
+
+    // Restores depth-first order if nodes were added or moved, then refreshes dirty world matrices
+    void update();
+    // Nodes whose world matrix was recomputed by the last update
+    const std::vector<NodeId>& get_changed() const { return m_changed; }
+    bool changed(NodeId node) const { return m_changed_flags[node] != 0; }
+
+    size_t size() const { return m_parent_ids.size(); }
+
+private:
+    void rebuild_order();
+
+    // By position, the hot data for the sweep
+    std::vector<uint32_t> m_parent;         // position of the parent, always smaller than our own
+    std::vector<uint32_t> m_subtree_size;   // including the node itself
+    std::vector<glm::vec3> m_translation;
+    std::vector<glm::quat> m_rotation;
+    std::vector<glm::vec3> m_scale;
+    std::vector<glm::mat4> m_world;
+    std::vector<uint8_t> m_dirty;
+    std::vector<NodeId> m_node_of;
+
+    // By id
+    std::vector<uint32_t> m_position_of;
+    std::vector<NodeId> m_parent_ids;
+    std::vector<uint8_t> m_changed_flags;
+
+    std::vector<NodeId> m_changed;
+    bool m_order_dirty = false;
+};
+
+}
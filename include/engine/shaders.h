@@ -17,7 +17,7 @@ public:
 private:
     static std::vector<char> read_file(const std::string& filename);
 
-    VkShaderModule m_shader_module;
+    VkShaderModule m_shader_module = VK_NULL_HANDLE;
     VkPipelineShaderStageCreateInfo m_shader_stage_create_info;
 };
 
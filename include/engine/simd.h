@@ -0,0 +1,13 @@
+#pragma once
+
+// Picks the widest x86 SIMD set the compiler was told it may use.
+// Code paths guarded by these fall back to scalar loops everywhere else (e.g. ARM).
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define ENGINE_SIMD_AVX 1
+    #define ENGINE_SIMD_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define ENGINE_SIMD_SSE 1
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace Engine {
+
+// A draw (or anything else) to be ordered by a 64-bit key, value is usually a model index
+struct SortItem {
+    uint64_t key;
+    uint32_t value;
+};
+
+// Opaque:      [63..60 pipeline][59..44 mesh batch][43..32 material][31..0 depth, front to back]
+// Transparent: [63..60 pipeline][59..28 depth, back to front]
+// Materials are layers of one texture array so switching them is free, they only sit above depth
+// to keep draws of the same material together within a batch
+namespace SortKey {
+    // Float bits flipped so that unsigned compares match float compares, negatives included
+    inline uint32_t depth_bits(float depth) {
+        uint32_t bits;
+        std::memcpy(&bits, &depth, sizeof(bits));
+        return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+    }
+
+    inline uint64_t opaque(uint32_t pipeline, uint32_t batch, uint32_t material, float depth) {
+        return (uint64_t(pipeline & 0xFu) << 60) | (uint64_t(batch & 0xFFFFu) << 44) |
+               (uint64_t(material & 0xFFFu) << 32) | uint64_t(depth_bits(depth));
+    }
+
+    inline uint64_t transparent(uint32_t pipeline, float depth) {
+        return (uint64_t(pipeline & 0xFu) << 60) | (uint64_t(~depth_bits(depth)) << 28);
+    }
+}
+
+// Stable LSD radix sort on the key, 8 bits per pass. Byte positions where every key
+// is the same are skipped, so unused key fields cost nothing
+void radix_sort(std::vector<SortItem> &items, std::vector<SortItem> &scratch);
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace Engine {
+
+// Fixed set of worker threads fed from a single FIFO queue.
+// Tasks must not block on other tasks submitted to the same pool.
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread, minus the main thread
+    explicit ThreadPool(size_t num_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Shared engine-wide pool
+    static ThreadPool& get();
+
+    size_t size() const { return m_workers.size(); }
+
+    template<typename F>
+    auto submit(F &&task) -> std::future<decltype(task())> {
+        using Ret = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<Ret()>>(std::forward<F>(task));
+        std::future<Ret> ret = packaged->get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace([packaged]() { (*packaged)(); });
+        }
+        m_condition.notify_one();
+
+        return ret;
+    }
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stop = false;
+};
+
+}
@@ -26,12 +26,15 @@ public:
     void get_framebuffer_size(int &width, int &height);
     
     bool window_should_close();
+    // Went down during the last poll_events, key repeats do not count
+    bool was_key_pressed(SDL_Keycode key) const;
     std::vector<const char*> get_required_instance_extensions() const;
 
 private:
     SDL_Window* m_window = nullptr;
 
     bool m_should_close = false;
+    std::vector<SDL_Keycode> m_pressed_keys;
 };
 
 }
\ No newline at end of file
@@ -6,7 +6,14 @@
 namespace Game {
 
 class DefaultPipeline: public Engine::Pipeline {
+public:
+    // after_depth_prepass: depth is already there, only the fragments that wrote it are shaded
+    explicit DefaultPipeline(bool after_depth_prepass=false): m_after_depth_prepass(after_depth_prepass) {}
+
     void create_pipeline(Engine::Renderer &device, VkFormat image_format, VkRenderPass render_pass=VK_NULL_HANDLE) override;
+
+private:
+    bool m_after_depth_prepass;
 };
 
 }
@@ -0,0 +1,48 @@
+#version 450
+
+// Only the position, the rest of the vertex is skipped over by the stride
+layout(location = 0) in vec3 inPosition;
+
+// Has to match shader.vert bit for bit, the main pass tests with EQUAL against this depth
+invariant gl_Position;
+
+layout(set = 0, binding = 1) readonly buffer ModelMatrices {
+    mat4 model_matrices[];
+} ubo;
+
+layout(set = 0, binding = 4) readonly buffer DynamicModelMatrices {
+    mat4 model_matrices[];
+} dynamic_ubo;
+
+// High bit set: the model moves and its matrix is in the per-frame buffer
+mat4 model_matrix(uint idx) {
+    if ((idx & 0x80000000u) != 0u)
+        return dynamic_ubo.model_matrices[idx & 0x7FFFFFFFu];
+    return ubo.model_matrices[idx];
+}
+
+struct InstanceData {
+    uint transform_idx;
+    float base_texture;
+    uint padding0;
+    uint padding1;
+};
+
+layout(set = 0, binding = 3) readonly buffer Instances {
+    InstanceData instances[];
+};
+
+layout(push_constant) uniform Constants {
+    mat4 proj;
+    mat4 view;
+    mat4 light_pv;
+    vec4 light_pos;
+    vec4 light_color;
+} pc;
+
+void main() {
+    mat4 model = model_matrix(instances[gl_InstanceIndex].transform_idx);
+
+    mat4 modelViewProj = pc.proj * pc.view * model;
+    gl_Position = modelViewProj * vec4(inPosition, 1.0);
+}
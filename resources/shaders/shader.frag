@@ -4,10 +4,63 @@ layout(binding = 0) uniform sampler2DArrayShadow shadowMapSampler;
 layout(binding = 2) uniform sampler2DArray texSampler;
 
 layout(location = 0) in vec3 texCoord;
-layout(location = 1) in vec4 shadowCoord;
+layout(location = 1) in vec3 worldPos;
 layout(location = 2) in vec3 fragNormal;
 layout(location = 3) in vec3 lightPos;
 layout(location = 4) in vec3 lightColor;
+layout(location = 5) in float viewDepth;
+
+// A light without cascades is one cascade that reaches infinitely far
+layout(binding = 5) uniform ShadowCascades {
+    mat4 light_pv[4];
+    vec4 split_depths;
+    vec4 atlas_rects[4];    // uv offset, uv scale, layer of each cascade's square in the atlas
+    uint count;
+    uint first_light;
+} cascades;
+
+struct LocalLight {
+    vec3 position;
+    float range;
+    vec3 color;
+    float intensity;
+    vec3 direction;
+    float cos_outer;        // -1 or less for a point light
+    float cos_inner;
+    float padding0;
+    float padding1;
+    float padding2;
+};
+
+// Point and spot lights, assigned to the froxels of the camera by light_clusters.comp
+layout(binding = 7) readonly buffer ClusterLights {
+    mat4 view;
+    mat4 proj;
+    mat4 inverse_proj;
+    vec4 screen;            // width, height, tile width, tile height in pixels
+    float slice_scale;
+    float slice_bias;
+    uint light_count;
+    uint index_count;
+    uint index_capacity;
+    uint padding0;
+    uint padding1;
+    uint padding2;
+    LocalLight lights[];
+} clusters;
+
+layout(binding = 8) readonly buffer ClusterRanges {
+    uvec2 cluster_ranges[];
+};
+
+layout(binding = 9) readonly buffer ClusterIndices {
+    uint cluster_indices[];
+};
+
+// CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES
+const uint CLUSTER_TILES_X = 16u;
+const uint CLUSTER_TILES_Y = 9u;
+const uint CLUSTER_SLICES = 24u;
 
 layout(location = 0) out vec4 outColor;
 
@@ -18,7 +71,38 @@ const vec2 pcf_filter_kernel[16] = vec2[](
     vec2(0.8151, 0.8786),   vec2(0.797, 0.4556),    vec2(0.6322, 0.3194),   vec2(0.2957, 0.9349)
 );
 
-float shadow_pcf(vec3 projCoords, float z_depth, float layer) {
+// Only the lights of this fragment's cluster
+vec3 local_lights(vec3 normal, vec3 albedo) {
+    if (clusters.light_count == 0u)
+        return vec3(0.0);
+
+    uvec2 tile = min(uvec2(gl_FragCoord.xy / clusters.screen.zw), uvec2(CLUSTER_TILES_X - 1u, CLUSTER_TILES_Y - 1u));
+    float slice = log(max(viewDepth, 1e-4)) * clusters.slice_scale + clusters.slice_bias;
+    uint z = uint(clamp(slice, 0.0, float(CLUSTER_SLICES - 1u)));
+    uvec2 range = cluster_ranges[(z * CLUSTER_TILES_Y + tile.y) * CLUSTER_TILES_X + tile.x];
+
+    vec3 color = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++) {
+        LocalLight light = clusters.lights[cluster_indices[range.x + i]];
+        vec3 to_light = light.position - worldPos;
+        float distance = length(to_light);
+        if (distance >= light.range)
+            continue;
+        vec3 L = to_light / max(distance, 1e-4);
+
+        // Smooth falloff to zero at the range
+        float ratio = distance / light.range;
+        float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+        float attenuation = window * window / (distance * distance + 1.0);
+        float spot = light.cos_outer > -1.0 ? smoothstep(light.cos_outer, light.cos_inner, dot(-L, light.direction)) : 1.0;
+
+        color += albedo * light.color * light.intensity * max(dot(normal, L), 0.0) * attenuation * spot;
+    }
+    return color;
+}
+
+// projCoords are in the light's square, samples stay inside it so they do not read a neighbour's
+float shadow_pcf(vec3 projCoords, float z_depth, vec4 atlas_rect) {
     float shadow = 0.0;
     float texelSize = 1.0 / textureSize(shadowMapSampler, 0).x;
     float kernel_radius = 4.0;
@@ -26,10 +110,14 @@ float shadow_pcf(vec3 projCoords, float z_depth, float layer) {
     float bias = 0.003;
     float biased_z = z_depth - bias;
 
+    vec2 uv = atlas_rect.xy + projCoords.xy * atlas_rect.z;
+    vec2 uv_min = atlas_rect.xy + 0.5 * texelSize;
+    vec2 uv_max = atlas_rect.xy + atlas_rect.z - 0.5 * texelSize;
+
     for (int i = 0; i < 16; ++i) {
         vec2 offset = (pcf_filter_kernel[i] * 2.0 - 1.0) * kernel_radius * texelSize;
 
-        shadow += texture(shadowMapSampler, vec4(projCoords.xy + offset, layer, biased_z));
+        shadow += texture(shadowMapSampler, vec4(clamp(uv + offset, uv_min, uv_max), atlas_rect.w, biased_z));
     }
 
     return shadow / 16.0;
@@ -39,19 +127,27 @@ void main() {
     // Base texture color
     vec4 baseColor = texture(texSampler, texCoord);
 
-    // Convert from clip space to [0, 1]
-    vec3 projCoords = shadowCoord.xyz / shadowCoord.w;
-    float z_depth = projCoords.z;
-    projCoords = projCoords * 0.5 + 0.5;
+    // First cascade that reaches this far, the last one covers the rest
+    uint cascade = 0u;
+    while (cascade + 1u < cascades.count && viewDepth > cascades.split_depths[cascade])
+        cascade++;
 
-    // Early discard for out-of-bounds coords
     float shadowFactor = 1.0;
-    if (projCoords.x >= 0.0 && projCoords.x <= 1.0 &&
-        projCoords.y >= 0.0 && projCoords.y <= 1.0 &&
-        projCoords.z >= 0.0 && projCoords.z <= 1.0) {
-        
-        float shadowSample = shadow_pcf(projCoords, z_depth, 0.0);
-        shadowFactor = mix(0.3, 1.0, shadowSample); // shadowed vs lit blend
+    if (cascades.count > 0u) {
+        // Convert from clip space to [0, 1]
+        vec4 shadowCoord = cascades.light_pv[cascade] * vec4(worldPos, 1.0);
+        vec3 projCoords = shadowCoord.xyz / shadowCoord.w;
+        float z_depth = projCoords.z;
+        projCoords = projCoords * 0.5 + 0.5;
+
+        // Early discard for out-of-bounds coords
+        if (projCoords.x >= 0.0 && projCoords.x <= 1.0 &&
+            projCoords.y >= 0.0 && projCoords.y <= 1.0 &&
+            projCoords.z >= 0.0 && projCoords.z <= 1.0) {
+
+            float shadowSample = shadow_pcf(projCoords, z_depth, cascades.atlas_rects[cascade]);
+            shadowFactor = mix(0.3, 1.0, shadowSample); // shadowed vs lit blend
+        }
     }
 
     // Lighting based on normal
@@ -61,6 +157,6 @@ void main() {
     float NdotL = max(dot(normal, -lightDir), 0.0);  // Directional light
     float diffuse = mix(0.3, 1.0, NdotL);            // Optional ambient
 
-    vec3 temp = lightColor * baseColor.rgb * diffuse * shadowFactor;
+    vec3 temp = lightColor * baseColor.rgb * diffuse * shadowFactor + local_lights(normal, baseColor.rgb);
     outColor = vec4(temp, baseColor.a);
 }
\ No newline at end of file
@@ -8,15 +8,41 @@
     layout(location = 5) in float inMaterialID;
 
     layout(location = 0) out vec3 outTexCoord;
-    layout(location = 1) out vec4 outShadowCoord;
+    layout(location = 1) out vec3 outWorldPos;
     layout(location = 2) out vec3 outFragNormal;
     layout(location = 3) out vec3 outLightPos;
     layout(location = 4) out vec3 outLightColor;
+    layout(location = 5) out float outViewDepth;
+
+    // The depth pre-pass computes the same position, the EQUAL depth test needs it bit for bit
+    invariant gl_Position;
 
     layout(set = 0, binding = 1) readonly buffer ModelMatrices {
         mat4 model_matrices[];
     } ubo;
 
+    layout(set = 0, binding = 4) readonly buffer DynamicModelMatrices {
+        mat4 model_matrices[];
+    } dynamic_ubo;
+
+    // High bit set: the model moves and its matrix is in the per-frame buffer
+    mat4 model_matrix(uint idx) {
+        if ((idx & 0x80000000u) != 0u)
+            return dynamic_ubo.model_matrices[idx & 0x7FFFFFFFu];
+        return ubo.model_matrices[idx];
+    }
+
+    struct InstanceData {
+        uint transform_idx;
+        float base_texture;
+        uint padding0;
+        uint padding1;
+    };
+
+    layout(set = 0, binding = 3) readonly buffer Instances {
+        InstanceData instances[];
+    };
+
     layout(push_constant) uniform Constants {
         mat4 proj;
         mat4 view;
@@ -26,16 +52,19 @@
     } pc;
 
     void main() {
-        int model_matrix_idx = int(inColor.b);
-        mat4 model = ubo.model_matrices[model_matrix_idx];
+        InstanceData instance = instances[gl_InstanceIndex];
+        mat4 model = model_matrix(instance.transform_idx);
 
         mat4 modelViewProj = pc.proj * pc.view * model;
-        mat4 lightMatrix = pc.light_pv * model;
 
         gl_Position = modelViewProj * vec4(inPosition, 1.0);
-        outShadowCoord = lightMatrix * vec4(inPosition, 1.0);
 
-        outTexCoord = vec3(u, v, inMaterialID);  // Use extracted v here
+        // The fragment shader picks the shadow cascade by view depth
+        vec4 worldPos = model * vec4(inPosition, 1.0);
+        outWorldPos = worldPos.xyz;
+        outViewDepth = -(pc.view * worldPos).z;
+
+        outTexCoord = vec3(u, v, instance.base_texture + inMaterialID);  // Use extracted v here
         outFragNormal = mat3(model) * inNormal;
         outLightPos = pc.light_pos.xyz;
         outLightColor = pc.light_color.rgb;
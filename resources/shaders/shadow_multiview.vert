@@ -0,0 +1,56 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in float u;
+layout(location = 2) in vec3 inColor;
+layout(location = 3) in float v;
+layout(location = 4) in vec3 normal;
+layout(location = 5) in float material_id;
+
+layout(set = 0, binding = 1) readonly buffer ModelMatrices {
+    mat4 model_matrices[];
+} ubo;
+
+layout(set = 0, binding = 4) readonly buffer DynamicModelMatrices {
+    mat4 model_matrices[];
+} dynamic_ubo;
+
+// High bit set: the model moves and its matrix is in the per-frame buffer
+mat4 model_matrix(uint idx) {
+    if ((idx & 0x80000000u) != 0u)
+        return dynamic_ubo.model_matrices[idx & 0x7FFFFFFFu];
+    return ubo.model_matrices[idx];
+}
+
+struct InstanceData {
+    uint transform_idx;
+    float base_texture;
+    uint padding0;
+    uint padding1;
+};
+
+layout(set = 0, binding = 3) readonly buffer Instances {
+    InstanceData instances[];
+};
+
+// One light per view, MAX_MULTIVIEW_SHADOW_LIGHTS
+layout(set = 0, binding = 6) uniform ShadowViews {
+    mat4 light_pv[6];
+} views;
+
+layout( push_constant ) uniform constants {
+	uint enabled_views;
+} pc;
+
+void main() {
+    // Lights skipped this frame keep what is in their layer. A point outside the clip volume on x
+    // (z could be clamped) makes the whole triangle degenerate and off screen
+    if ((pc.enabled_views & (1u << gl_ViewIndex)) == 0u) {
+        gl_Position = vec4(2.0, 2.0, 0.0, 1.0);
+        return;
+    }
+
+    mat4 model = model_matrix(instances[gl_InstanceIndex].transform_idx);
+    gl_Position = views.light_pv[gl_ViewIndex] * model * vec4(inPosition, 1.0);
+}
@@ -7,12 +7,38 @@ layout(location = 3) in float v;
 layout(location = 4) in vec3 normal;
 layout(location = 5) in float material_id;
 
+layout(set = 0, binding = 1) readonly buffer ModelMatrices {
+    mat4 model_matrices[];
+} ubo;
+
+layout(set = 0, binding = 4) readonly buffer DynamicModelMatrices {
+    mat4 model_matrices[];
+} dynamic_ubo;
+
+// High bit set: the model moves and its matrix is in the per-frame buffer
+mat4 model_matrix(uint idx) {
+    if ((idx & 0x80000000u) != 0u)
+        return dynamic_ubo.model_matrices[idx & 0x7FFFFFFFu];
+    return ubo.model_matrices[idx];
+}
+
+struct InstanceData {
+    uint transform_idx;
+    float base_texture;
+    uint padding0;
+    uint padding1;
+};
+
+layout(set = 0, binding = 3) readonly buffer Instances {
+    InstanceData instances[];
+};
+
 layout( push_constant ) uniform constants {
-	mat4 MVP;
-	mat4 model;
+	mat4 light_pv;
 } pc;
 
 void main() {
-    gl_Position = pc.MVP * pc.model * vec4(inPosition, 1.0); 
+    mat4 model = model_matrix(instances[gl_InstanceIndex].transform_idx);
+    gl_Position = pc.light_pv * model * vec4(inPosition, 1.0); 
 	// gl_Position = vec4(0.5, 0.5, 0.5, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,340 @@
+#include <engine/bvh.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace Engine {
+
+namespace {
+
+constexpr int SAH_BINS = 12;
+constexpr uint32_t MIN_LEAF_PRIMS = 2;     // never split below this
+constexpr uint32_t MAX_LEAF_PRIMS = 8;     // always split above this (if the centroids allow it)
+
+bool ray_box(const AABB &box, const glm::vec3 &origin, const glm::vec3 &inv_dir, float t_max, float &t_enter) {
+    glm::vec3 t1 = (box.min - origin) * inv_dir;
+    glm::vec3 t2 = (box.max - origin) * inv_dir;
+    glm::vec3 t_near = glm::min(t1, t2);
+    glm::vec3 t_far = glm::max(t1, t2);
+
+    float enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, 0.f));
+    float exit = std::min(std::min(t_far.x, t_far.y), t_far.z);
+
+    t_enter = enter;
+    return enter <= exit && enter < t_max;
+}
+
+}
+
+void BVH::clear() {
+    m_nodes.clear();
+    m_prims.clear();
+    m_boxes.clear();
+    m_ids.clear();
+    m_leaf_boxes.clear();
+}
+
+void BVH::build(const std::vector<AABB> &boxes, const std::vector<uint32_t> &ids) {
+    clear();
+    if (boxes.empty())
+        return;
+
+    m_boxes = boxes;
+    m_ids = ids;
+
+    uint32_t prim_count = static_cast<uint32_t>(boxes.size());
+    m_prims.resize(prim_count);
+    for (uint32_t i = 0; i < prim_count; i++)
+        m_prims[i] = i;
+
+    // A binary tree with n leaves at most has 2n - 1 nodes, reserving keeps indices and refs stable
+    m_nodes.reserve(2 * prim_count - 1);
+
+    BVHNode root{};
+    root.left_or_first = 0;
+    root.count = prim_count;
+    m_nodes.push_back(root);
+
+    update_leaf_bounds(0);
+    subdivide(0);
+
+    m_leaf_boxes.resize(prim_count);
+    for (uint32_t i = 0; i < prim_count; i++)
+        m_leaf_boxes.set_box(i, m_boxes[m_prims[i]]);
+}
+
+void BVH::update_leaf_bounds(uint32_t node_idx) {
+    BVHNode &node = m_nodes[node_idx];
+    node.bounds = AABB{};
+    for (uint32_t i = 0; i < node.count; i++)
+        node.bounds.expand(m_boxes[m_prims[node.left_or_first + i]]);
+}
+
+void BVH::subdivide(uint32_t node_idx) {
+    uint32_t first = m_nodes[node_idx].left_or_first;
+    uint32_t count = m_nodes[node_idx].count;
+
+    if (count <= MIN_LEAF_PRIMS)
+        return;
+
+    AABB centroid_bounds;
+    for (uint32_t i = 0; i < count; i++)
+        centroid_bounds.expand(m_boxes[m_prims[first + i]].center());
+
+    struct Bin {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    // Find the cheapest bin boundary over all three axes ==============================================
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = std::numeric_limits<float>::max();
+
+    for (int axis = 0; axis < 3; axis++) {
+        float axis_min = centroid_bounds.min[axis];
+        float axis_extent = centroid_bounds.max[axis] - axis_min;
+        if (axis_extent <= 1e-6f)
+            continue;
+
+        Bin bins[SAH_BINS];
+        float scale = SAH_BINS / axis_extent;
+        for (uint32_t i = 0; i < count; i++) {
+            const AABB &box = m_boxes[m_prims[first + i]];
+            int b = std::min(SAH_BINS - 1, static_cast<int>((box.center()[axis] - axis_min) * scale));
+            bins[b].bounds.expand(box);
+            bins[b].count++;
+        }
+
+        // Sweep from both sides so every split costs O(1)
+        float left_area[SAH_BINS - 1], right_area[SAH_BINS - 1];
+        uint32_t left_count[SAH_BINS - 1], right_count[SAH_BINS - 1];
+        AABB left_box, right_box;
+        uint32_t left_sum = 0, right_sum = 0;
+        for (int i = 0; i < SAH_BINS - 1; i++) {
+            left_sum += bins[i].count;
+            left_box.expand(bins[i].bounds);
+            left_count[i] = left_sum;
+            left_area[i] = left_box.surface_area();
+
+            right_sum += bins[SAH_BINS - 1 - i].count;
+            right_box.expand(bins[SAH_BINS - 1 - i].bounds);
+            right_count[SAH_BINS - 2 - i] = right_sum;
+            right_area[SAH_BINS - 2 - i] = right_box.surface_area();
+        }
+
+        for (int i = 0; i < SAH_BINS - 1; i++) {
+            if (left_count[i] == 0 || right_count[i] == 0)
+                continue;
+
+            float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    // All centroids in one spot, nothing to split on
+    if (best_axis < 0)
+        return;
+
+    // Compare against just testing everything in a leaf (traversal cost of one box test)
+    float parent_area = m_nodes[node_idx].bounds.surface_area();
+    float leaf_cost = static_cast<float>(count);
+    float split_cost = parent_area > 0.f ? 1.f + best_cost / parent_area : 1.f;
+    if (split_cost >= leaf_cost && count <= MAX_LEAF_PRIMS)
+        return;
+
+    // Partition the primitive range in place =========================================================
+    float axis_min = centroid_bounds.min[best_axis];
+    float scale = SAH_BINS / (centroid_bounds.max[best_axis] - axis_min);
+    auto middle = std::partition(m_prims.begin() + first, m_prims.begin() + first + count, [&](uint32_t prim) {
+        int b = std::min(SAH_BINS - 1, static_cast<int>((m_boxes[prim].center()[best_axis] - axis_min) * scale));
+        return b <= best_split;
+    });
+
+    uint32_t left_count = static_cast<uint32_t>(middle - (m_prims.begin() + first));
+    if (left_count == 0 || left_count == count)
+        return;
+
+    uint32_t left_idx = static_cast<uint32_t>(m_nodes.size());
+    BVHNode left{};
+    left.left_or_first = first;
+    left.count = left_count;
+    BVHNode right{};
+    right.left_or_first = first + left_count;
+    right.count = count - left_count;
+    m_nodes.push_back(left);
+    m_nodes.push_back(right);
+
+    m_nodes[node_idx].left_or_first = left_idx;
+    m_nodes[node_idx].count = 0;
+
+    update_leaf_bounds(left_idx);
+    update_leaf_bounds(left_idx + 1);
+    subdivide(left_idx);
+    subdivide(left_idx + 1);
+}
+
+void BVH::refit(const std::vector<AABB> &boxes) {
+    if (m_nodes.empty())
+        return;
+
+    m_boxes = boxes;
+    for (size_t i = 0; i < m_prims.size(); i++)
+        m_leaf_boxes.set_box(i, m_boxes[m_prims[i]]);
+
+    // Children always come after their parent
+    for (size_t i = m_nodes.size(); i-- > 0;) {
+        BVHNode &node = m_nodes[i];
+        if (node.is_leaf()) {
+            update_leaf_bounds(static_cast<uint32_t>(i));
+        } else {
+            node.bounds = m_nodes[node.left_or_first].bounds;
+            node.bounds.expand(m_nodes[node.left_or_first + 1].bounds);
+        }
+    }
+}
+
+void BVH::collect(uint32_t node_idx, std::vector<uint32_t> &out) const {
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.is_leaf()) {
+        for (uint32_t i = 0; i < node.count; i++)
+            out.push_back(m_ids[m_prims[node.left_or_first + i]]);
+        return;
+    }
+
+    collect(node.left_or_first, out);
+    collect(node.left_or_first + 1, out);
+}
+
+void BVH::query_frustum(const Frustum &frustum, std::vector<uint32_t> &out) {
+    if (m_nodes.empty())
+        return;
+
+    query_node(frustum, 0, 0x3F, out);
+}
+
+void BVH::query_node(const Frustum &frustum, uint32_t node_idx, uint32_t plane_mask, std::vector<uint32_t> &out) {
+    // Each entry carries the planes the node still straddles, planes a parent is fully inside of are skipped
+    struct Entry {
+        uint32_t node;
+        uint32_t plane_mask;
+    };
+
+    Entry stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = {node_idx, plane_mask};
+
+    while (stack_size > 0) {
+        Entry entry = stack[--stack_size];
+        const BVHNode &node = m_nodes[entry.node];
+
+        glm::vec3 c = node.bounds.center();
+        glm::vec3 e = node.bounds.extent();
+
+        bool outside = false;
+        uint32_t mask = entry.plane_mask;
+        for (int p = 0; p < 6 && !outside; p++) {
+            if (!(mask & (1u << p)))
+                continue;
+
+            const glm::vec4 &plane = frustum.planes[p];
+            float d = glm::dot(glm::vec3(plane), c) + plane.w;
+            float r = glm::dot(glm::abs(glm::vec3(plane)), e);
+            if (d + r < 0.f)
+                outside = true;
+            else if (d - r >= 0.f)
+                mask &= ~(1u << p);
+        }
+
+        if (outside)
+            continue;
+
+        // Whole subtree visible, no more tests needed
+        if (mask == 0) {
+            collect(entry.node, out);
+            continue;
+        }
+
+        if (node.is_leaf()) {
+            m_leaf_hits.clear();
+            m_leaf_boxes.cull(frustum, m_leaf_hits, node.left_or_first, node.count);
+            for (uint32_t i : m_leaf_hits)
+                out.push_back(m_ids[m_prims[i]]);
+            continue;
+        }
+
+        // SAH trees are shallow, but fall back to recursion instead of overflowing. The children
+        // start from the planes this node still straddles, like they would on the stack
+        if (stack_size + 2 > 64) {
+            query_node(frustum, node.left_or_first, mask, out);
+            query_node(frustum, node.left_or_first + 1, mask, out);
+            continue;
+        }
+
+        stack[stack_size++] = {node.left_or_first + 1, mask};
+        stack[stack_size++] = {node.left_or_first, mask};
+    }
+}
+
+bool BVH::raycast(const glm::vec3 &origin, const glm::vec3 &dir, float &t_hit, uint32_t &id_hit,
+                  const std::function<float(uint32_t)> &hit_test) const {
+    if (m_nodes.empty())
+        return false;
+
+    glm::vec3 inv_dir = 1.f / dir;
+    float closest = std::numeric_limits<float>::max();
+    bool hit = false;
+
+    std::vector<uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+
+    while (!stack.empty()) {
+        const BVHNode &node = m_nodes[stack.back()];
+        stack.pop_back();
+
+        float t_enter;
+        if (!ray_box(node.bounds, origin, inv_dir, closest, t_enter))
+            continue;
+
+        if (node.is_leaf()) {
+            for (uint32_t i = 0; i < node.count; i++) {
+                uint32_t prim = m_prims[node.left_or_first + i];
+                if (!ray_box(m_boxes[prim], origin, inv_dir, closest, t_enter))
+                    continue;
+
+                float t = hit_test ? hit_test(m_ids[prim]) : t_enter;
+                if (t >= 0.f && t < closest) {
+                    closest = t;
+                    id_hit = m_ids[prim];
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the far one is more likely to be rejected
+        uint32_t near_child = node.left_or_first;
+        uint32_t far_child = node.left_or_first + 1;
+        float t_left, t_right;
+        bool hit_left = ray_box(m_nodes[near_child].bounds, origin, inv_dir, closest, t_left);
+        bool hit_right = ray_box(m_nodes[far_child].bounds, origin, inv_dir, closest, t_right);
+        if (hit_left && hit_right && t_right < t_left)
+            std::swap(near_child, far_child);
+
+        if (hit_left || hit_right) {
+            stack.push_back(far_child);
+            stack.push_back(near_child);
+        }
+    }
+
+    if (hit)
+        t_hit = closest;
+    return hit;
+}
+
+}
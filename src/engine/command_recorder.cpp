@@ -0,0 +1,126 @@
+#include <engine/command_recorder.h>
+
+#include <cstring>
+
+namespace Engine {
+
+static int bind_point_index(VkPipelineBindPoint bind_point) {
+    return bind_point == VK_PIPELINE_BIND_POINT_COMPUTE ? 1 : 0;
+}
+
+void CommandRecorder::begin(VkCommandBuffer command_buffer) {
+    m_command_buffer = command_buffer;
+    m_last_stats = m_stats;
+    m_stats = RecorderStats{};
+    invalidate();
+}
+
+void CommandRecorder::invalidate() {
+    for (BindPointState &state : m_bind_points)
+        state = BindPointState{};
+
+    m_vertex_buffer = VK_NULL_HANDLE;
+    m_index_buffer = VK_NULL_HANDLE;
+    m_push_layout = VK_NULL_HANDLE;
+    m_push_size = 0;
+}
+
+void CommandRecorder::bind_pipeline(VkPipelineBindPoint bind_point, VkPipeline pipeline) {
+    BindPointState &state = m_bind_points[bind_point_index(bind_point)];
+    if (state.pipeline == pipeline) {
+        m_stats.skipped++;
+        return;
+    }
+
+    m_dispatch->cmdBindPipeline(m_command_buffer, bind_point, pipeline);
+    state.pipeline = pipeline;
+    m_stats.issued++;
+
+    // A pipeline with another layout can disturb push constants, be conservative
+    m_push_layout = VK_NULL_HANDLE;
+}
+
+void CommandRecorder::bind_descriptor_set(VkPipelineBindPoint bind_point, VkPipelineLayout layout, uint32_t set, VkDescriptorSet descriptor_set) {
+    BindPointState &state = m_bind_points[bind_point_index(bind_point)];
+    bool tracked = set < MAX_TRACKED_SETS;
+    if (tracked && state.sets[set] == descriptor_set && state.set_layouts[set] == layout) {
+        m_stats.skipped++;
+        return;
+    }
+
+    m_dispatch->cmdBindDescriptorSets(m_command_buffer, bind_point, layout, set, 1, &descriptor_set, 0, nullptr);
+    m_stats.issued++;
+
+    if (tracked) {
+        state.sets[set] = descriptor_set;
+        state.set_layouts[set] = layout;
+    }
+}
+
+void CommandRecorder::bind_vertex_buffer(VkBuffer buffer, VkDeviceSize offset) {
+    if (m_vertex_buffer == buffer && m_vertex_offset == offset) {
+        m_stats.skipped++;
+        return;
+    }
+
+    m_dispatch->cmdBindVertexBuffers(m_command_buffer, 0, 1, &buffer, &offset);
+    m_vertex_buffer = buffer;
+    m_vertex_offset = offset;
+    m_stats.issued++;
+}
+
+void CommandRecorder::bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType index_type) {
+    if (m_index_buffer == buffer && m_index_offset == offset && m_index_type == index_type) {
+        m_stats.skipped++;
+        return;
+    }
+
+    m_dispatch->cmdBindIndexBuffer(m_command_buffer, buffer, offset, index_type);
+    m_index_buffer = buffer;
+    m_index_offset = offset;
+    m_index_type = index_type;
+    m_stats.issued++;
+}
+
+void CommandRecorder::push_constants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size, const void *data) {
+    bool same_range = m_push_layout == layout && m_push_stages == stages && m_push_offset == offset && m_push_size == size;
+    if (same_range && std::memcmp(m_push_data, data, size) == 0) {
+        m_stats.skipped++;
+        return;
+    }
+
+    m_dispatch->cmdPushConstants(m_command_buffer, layout, stages, offset, size, data);
+    m_stats.issued++;
+
+    if (size <= MAX_PUSH_CONSTANT_BYTES) {
+        m_push_layout = layout;
+        m_push_stages = stages;
+        m_push_offset = offset;
+        m_push_size = size;
+        std::memcpy(m_push_data, data, size);
+    } else {
+        m_push_layout = VK_NULL_HANDLE;
+    }
+}
+
+void CommandRecorder::draw_indexed(uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance) {
+    m_dispatch->cmdDrawIndexed(m_command_buffer, index_count, instance_count, first_index, vertex_offset, first_instance);
+    m_stats.issued++;
+}
+
+void CommandRecorder::draw_indexed_indirect(VkBuffer buffer, VkDeviceSize offset, uint32_t draw_count, uint32_t stride) {
+    m_dispatch->cmdDrawIndexedIndirect(m_command_buffer, buffer, offset, draw_count, stride);
+    m_stats.issued++;
+}
+
+void CommandRecorder::draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer count_buffer, VkDeviceSize count_offset, uint32_t max_draw_count, uint32_t stride) {
+    m_dispatch->cmdDrawIndexedIndirectCount(m_command_buffer, buffer, offset, count_buffer, count_offset, max_draw_count, stride);
+    m_stats.issued++;
+}
+
+void CommandRecorder::dispatch(uint32_t x, uint32_t y, uint32_t z) {
+    m_dispatch->cmdDispatch(m_command_buffer, x, y, z);
+    m_stats.issued++;
+}
+
+}
@@ -0,0 +1,97 @@
+#include <engine/compute_pipeline.h>
+#include <engine/renderer.h>
+
+#include <map>
+
+namespace Engine {
+
+void ComputePipeline::destroy_pipeline(vkb::DispatchTable &dispatch_table) {
+    m_data.comp_shader.destroy_shader(dispatch_table);
+    if (m_descriptor_pool != VK_NULL_HANDLE)
+        dispatch_table.destroyDescriptorPool(m_descriptor_pool, nullptr);
+    dispatch_table.destroyDescriptorSetLayout(m_data.descriptor_set_layout, nullptr);
+    dispatch_table.destroyPipelineLayout(m_data.pipeline_layout, nullptr);
+    dispatch_table.destroyPipeline(m_data.pipeline, nullptr);
+}
+
+void ComputePipeline::create_descriptor_sets(Renderer &device) {
+    create_descriptor_sets(device, MAX_FRAMES_IN_FLIGHT);
+}
+
+void ComputePipeline::create_descriptor_sets(Renderer &device, uint32_t set_count) {
+    // The old sets go with their pool
+    if (m_descriptor_pool != VK_NULL_HANDLE)
+        device.m_dispatch.destroyDescriptorPool(m_descriptor_pool, nullptr);
+
+    std::map<VkDescriptorType, uint32_t> counts;
+    for (const VkDescriptorSetLayoutBinding &binding : m_data.bindings)
+        counts[binding.descriptorType] += binding.descriptorCount * set_count;
+
+    std::vector<VkDescriptorPoolSize> pool_sizes;
+    for (const auto &[type, count] : counts)
+        pool_sizes.push_back(VkDescriptorPoolSize{type, count});
+
+    VkDescriptorPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_info.pPoolSizes = pool_sizes.data();
+    pool_info.maxSets = set_count;
+
+    if (device.m_dispatch.createDescriptorPool(&pool_info, nullptr, &m_descriptor_pool) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create a compute descriptor pool!");
+
+    std::vector<VkDescriptorSetLayout> layouts(set_count, m_data.descriptor_set_layout);
+
+    VkDescriptorSetAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = m_descriptor_pool;
+    alloc_info.descriptorSetCount = set_count;
+    alloc_info.pSetLayouts = layouts.data();
+
+    m_descriptor_sets.resize(set_count);
+    if (device.m_dispatch.allocateDescriptorSets(&alloc_info, m_descriptor_sets.data()) != VK_SUCCESS)
+        throw std::runtime_error("Failed to allocate compute descriptor sets!");
+}
+
+void ComputePipeline::write_storage_buffer(Renderer &device, int set, uint32_t binding, VkBuffer buffer, VkDeviceSize range) {
+    VkDescriptorBufferInfo buffer_info{};
+    buffer_info.buffer = buffer;
+    buffer_info.offset = 0;
+    buffer_info.range = range;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = m_descriptor_sets[set];
+    write.dstBinding = binding;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &buffer_info;
+
+    device.m_dispatch.updateDescriptorSets(1, &write, 0, nullptr);
+}
+
+void ComputePipeline::write_image(Renderer &device, int set, uint32_t binding, VkDescriptorType type, VkImageView view, VkImageLayout layout, VkSampler sampler) {
+    VkDescriptorImageInfo image_info{};
+    image_info.imageView = view;
+    image_info.imageLayout = layout;
+    image_info.sampler = sampler;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = m_descriptor_sets[set];
+    write.dstBinding = binding;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pImageInfo = &image_info;
+
+    device.m_dispatch.updateDescriptorSets(1, &write, 0, nullptr);
+}
+
+void ComputePipeline::bind(Renderer &device, int set) {
+    device.get_recorder().bind_pipeline(VK_PIPELINE_BIND_POINT_COMPUTE, m_data.pipeline);
+    device.get_recorder().bind_descriptor_set(VK_PIPELINE_BIND_POINT_COMPUTE, m_data.pipeline_layout, 0, m_descriptor_sets[set]);
+}
+
+}
@@ -0,0 +1,82 @@
+#include <engine/compute_pipeline_builder.h>
+#include <engine/renderer.h>
+#include <engine/profiler.h>
+
+namespace Engine {
+
+void ComputePipelineBuilder::set_shader(Renderer &device, const std::string &comp_shader_filename) {
+    PROFILE_SCOPE("load_shaders");
+    m_comp_shader.create_shader(device.m_dispatch, comp_shader_filename, VK_SHADER_STAGE_COMPUTE_BIT);
+}
+
+void ComputePipelineBuilder::add_push_constants(uint32_t pc_size, uint32_t offset) {
+    VkPushConstantRange push_constant;
+    push_constant.offset = offset;
+    push_constant.size = pc_size;
+    push_constant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    m_push_constant_ranges.push_back(push_constant);
+}
+
+void ComputePipelineBuilder::add_storage_buffer(uint32_t binding) {
+    add_binding(binding, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+}
+
+void ComputePipelineBuilder::add_storage_image(uint32_t binding) {
+    add_binding(binding, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+}
+
+void ComputePipelineBuilder::add_combined_image_sampler(uint32_t binding) {
+    add_binding(binding, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+}
+
+void ComputePipelineBuilder::add_binding(uint32_t binding, VkDescriptorType type) {
+    VkDescriptorSetLayoutBinding layout_binding{};
+    layout_binding.binding = binding;
+    layout_binding.descriptorType = type;
+    layout_binding.descriptorCount = 1;
+    layout_binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    layout_binding.pImmutableSamplers = nullptr;
+
+    m_bindings.push_back(layout_binding);
+}
+
+ComputePipelineData ComputePipelineBuilder::build(Renderer &device) {
+    ComputePipelineData ret{};
+
+    VkDescriptorSetLayoutCreateInfo layout_info{};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = static_cast<uint32_t>(m_bindings.size());
+    layout_info.pBindings = m_bindings.data();
+
+    if (device.m_dispatch.createDescriptorSetLayout(&layout_info, nullptr, &ret.descriptor_set_layout) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create compute descriptor set layout!");
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info{};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &ret.descriptor_set_layout;
+    pipeline_layout_info.pushConstantRangeCount = static_cast<uint32_t>(m_push_constant_ranges.size());
+    pipeline_layout_info.pPushConstantRanges = m_push_constant_ranges.data();
+
+    if (device.m_dispatch.createPipelineLayout(&pipeline_layout_info, nullptr, &ret.pipeline_layout) != VK_SUCCESS)
+        throw std::runtime_error("Could not create compute pipeline layout");
+
+    VkComputePipelineCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    create_info.stage = m_comp_shader.get_shader_stage_create_info();
+    create_info.layout = ret.pipeline_layout;
+    create_info.basePipelineHandle = VK_NULL_HANDLE;
+    create_info.basePipelineIndex = -1;
+
+    PROFILE_SCOPE("createComputePipelines");
+    if (device.m_dispatch.createComputePipelines(VK_NULL_HANDLE, 1, &create_info, nullptr, &ret.pipeline) != VK_SUCCESS)
+        throw std::runtime_error("Could not create compute pipeline!");
+
+    ret.bindings = m_bindings;
+    ret.comp_shader = m_comp_shader;
+
+    return ret;
+}
+
+}
@@ -0,0 +1,28 @@
+#include <engine/compute_pipeline.h>
+#include <engine/gpu_culler.h>
+
+namespace Engine {
+
+void CullPipeline::create_pipeline(Engine::Renderer &device) {
+    Engine::ComputePipelineBuilder builder;
+
+    builder.add_push_constants(sizeof(CullPushConstants));
+
+    // objects, static model matrices, indirect commands, instances, dynamic model matrices, LODs,
+    // depth pyramid, visibility flags, occlusion view, light frustums
+    builder.add_storage_buffer(0);
+    builder.add_storage_buffer(1);
+    builder.add_storage_buffer(2);
+    builder.add_storage_buffer(3);
+    builder.add_storage_buffer(4);
+    builder.add_storage_buffer(5);
+    builder.add_combined_image_sampler(6);
+    builder.add_storage_buffer(7);
+    builder.add_storage_buffer(8);
+    builder.add_storage_buffer(9);
+
+    builder.set_shader(device, "shaders/cull.comp.spv");
+
+    m_data = builder.build(device);
+}
+}
@@ -0,0 +1,210 @@
+#include <engine/culling.h>
+#include <engine/simd.h>
+
+#include <cmath>
+
+namespace Engine {
+
+float AABB::surface_area() const {
+    if (!valid())
+        return 0.f;
+
+    glm::vec3 d = max - min;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB AABB::transformed(const glm::mat4 &matrix) const {
+    if (!valid())
+        return *this;
+
+    glm::vec3 c = glm::vec3(matrix * glm::vec4(center(), 1.f));
+    glm::vec3 e = extent();
+
+    glm::vec3 new_extent(
+        std::abs(matrix[0][0]) * e.x + std::abs(matrix[1][0]) * e.y + std::abs(matrix[2][0]) * e.z,
+        std::abs(matrix[0][1]) * e.x + std::abs(matrix[1][1]) * e.y + std::abs(matrix[2][1]) * e.z,
+        std::abs(matrix[0][2]) * e.x + std::abs(matrix[1][2]) * e.y + std::abs(matrix[2][2]) * e.z
+    );
+
+    AABB ret;
+    ret.min = c - new_extent;
+    ret.max = c + new_extent;
+    return ret;
+}
+
+Frustum Frustum::from_matrix(const glm::mat4 &m) {
+    // glm is column major, m[col][row]
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    Frustum ret;
+    ret.planes[0] = row3 + row0;    // left
+    ret.planes[1] = row3 - row0;    // right
+    ret.planes[2] = row3 + row1;    // bottom (top when y is flipped)
+    ret.planes[3] = row3 - row1;    // top
+    ret.planes[4] = row2;           // near, depth is [0, 1]
+    ret.planes[5] = row3 - row2;    // far
+
+    for (glm::vec4 &plane : ret.planes) {
+        float length = glm::length(glm::vec3(plane));
+        if (length > 0.f)
+            plane /= length;
+    }
+
+    return ret;
+}
+
+bool Frustum::intersects_sphere(const glm::vec3 &center, float radius) const {
+    for (const glm::vec4 &plane : planes)
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+            return false;
+
+    return true;
+}
+
+bool Frustum::intersects_aabb(const AABB &box) const {
+    glm::vec3 c = box.center();
+    glm::vec3 e = box.extent();
+
+    for (const glm::vec4 &plane : planes) {
+        float d = glm::dot(glm::vec3(plane), c) + plane.w;
+        float r = glm::dot(glm::abs(glm::vec3(plane)), e);
+        if (d + r < 0.f)
+            return false;
+    }
+
+    return true;
+}
+
+void FrustumCuller::clear() {
+    resize(0);
+}
+
+void FrustumCuller::resize(size_t count) {
+    m_center_x.resize(count, 0.f);
+    m_center_y.resize(count, 0.f);
+    m_center_z.resize(count, 0.f);
+    m_extent_x.resize(count, 0.f);
+    m_extent_y.resize(count, 0.f);
+    m_extent_z.resize(count, 0.f);
+}
+
+void FrustumCuller::set_box(size_t idx, const AABB &box) {
+    glm::vec3 c = box.valid() ? box.center() : glm::vec3(0.f);
+    glm::vec3 e = box.valid() ? box.extent() : glm::vec3(0.f);
+
+    m_center_x[idx] = c.x;
+    m_center_y[idx] = c.y;
+    m_center_z[idx] = c.z;
+    m_extent_x[idx] = e.x;
+    m_extent_y[idx] = e.y;
+    m_extent_z[idx] = e.z;
+}
+
+void FrustumCuller::add_box(const AABB &box) {
+    resize(size() + 1);
+    set_box(size() - 1, box);
+}
+
+CullStats FrustumCuller::cull(const Frustum &frustum, std::vector<uint32_t> &visible, size_t first, size_t count) const {
+    const size_t end = first + count;
+    size_t first_visible = visible.size();
+    size_t i = first;
+
+#if ENGINE_SIMD_AVX
+    __m256 plane_n[6][3], plane_abs_n[6][3], plane_w[6];
+    for (int p = 0; p < 6; p++) {
+        for (int axis = 0; axis < 3; axis++) {
+            plane_n[p][axis] = _mm256_set1_ps(frustum.planes[p][axis]);
+            plane_abs_n[p][axis] = _mm256_set1_ps(std::abs(frustum.planes[p][axis]));
+        }
+        plane_w[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= end; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&m_center_x[i]);
+        __m256 cy = _mm256_loadu_ps(&m_center_y[i]);
+        __m256 cz = _mm256_loadu_ps(&m_center_z[i]);
+        __m256 ex = _mm256_loadu_ps(&m_extent_x[i]);
+        __m256 ey = _mm256_loadu_ps(&m_extent_y[i]);
+        __m256 ez = _mm256_loadu_ps(&m_extent_z[i]);
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++) {
+            __m256 d = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(plane_n[p][0], cx), _mm256_mul_ps(plane_n[p][1], cy)),
+                _mm256_add_ps(_mm256_mul_ps(plane_n[p][2], cz), plane_w[p]));
+            __m256 r = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(plane_abs_n[p][0], ex), _mm256_mul_ps(plane_abs_n[p][1], ey)),
+                _mm256_mul_ps(plane_abs_n[p][2], ez));
+
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(d, r), zero, _CMP_GE_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        for (int bit = 0; bit < 8; bit++)
+            if (mask & (1 << bit))
+                visible.push_back(static_cast<uint32_t>(i + bit));
+    }
+#elif ENGINE_SIMD_SSE
+    __m128 plane_n[6][3], plane_abs_n[6][3], plane_w[6];
+    for (int p = 0; p < 6; p++) {
+        for (int axis = 0; axis < 3; axis++) {
+            plane_n[p][axis] = _mm_set1_ps(frustum.planes[p][axis]);
+            plane_abs_n[p][axis] = _mm_set1_ps(std::abs(frustum.planes[p][axis]));
+        }
+        plane_w[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= end; i += 4) {
+        __m128 cx = _mm_loadu_ps(&m_center_x[i]);
+        __m128 cy = _mm_loadu_ps(&m_center_y[i]);
+        __m128 cz = _mm_loadu_ps(&m_center_z[i]);
+        __m128 ex = _mm_loadu_ps(&m_extent_x[i]);
+        __m128 ey = _mm_loadu_ps(&m_extent_y[i]);
+        __m128 ez = _mm_loadu_ps(&m_extent_z[i]);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++) {
+            __m128 d = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(plane_n[p][0], cx), _mm_mul_ps(plane_n[p][1], cy)),
+                _mm_add_ps(_mm_mul_ps(plane_n[p][2], cz), plane_w[p]));
+            __m128 r = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(plane_abs_n[p][0], ex), _mm_mul_ps(plane_abs_n[p][1], ey)),
+                _mm_mul_ps(plane_abs_n[p][2], ez));
+
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int bit = 0; bit < 4; bit++)
+            if (mask & (1 << bit))
+                visible.push_back(static_cast<uint32_t>(i + bit));
+    }
+#endif
+
+    // Scalar tail (or everything when there is no SIMD)
+    for (; i < end; i++) {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            const glm::vec4 &plane = frustum.planes[p];
+            float d = plane.x * m_center_x[i] + plane.y * m_center_y[i] + plane.z * m_center_z[i] + plane.w;
+            float r = std::abs(plane.x) * m_extent_x[i] + std::abs(plane.y) * m_extent_y[i] + std::abs(plane.z) * m_extent_z[i];
+            inside = d + r >= 0.f;
+        }
+
+        if (inside)
+            visible.push_back(static_cast<uint32_t>(i));
+    }
+
+    CullStats stats{};
+    stats.visible = static_cast<uint32_t>(visible.size() - first_visible);
+    stats.culled = static_cast<uint32_t>(count) - stats.visible;
+    return stats;
+}
+
+}
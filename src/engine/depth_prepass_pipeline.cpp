@@ -0,0 +1,36 @@
+#include <engine/pipeline.h>
+#include <engine/models.h>
+
+namespace Engine {
+
+void DepthPrepassPipeline::create_pipeline(Engine::Renderer &device, VkFormat image_format, VkRenderPass render_pass) {
+    (void)image_format;
+
+    Engine::PipelineBuilder builder;
+    std::vector<VkDescriptorSetLayout> layout = {device.get_descriptor_set_layout()};
+
+    // Same push constants as the main pipelines, only proj and view are read
+    builder.add_push_constants(sizeof(Engine::PushConstants));
+    builder.disable_color_write();
+
+    builder.create_pipeline_layout(device, layout);
+
+    // Shares the main render pass, so it is not destroyed with the pipeline
+    builder.create_render_pass(device, device.get_swapchain(), render_pass);
+
+    builder.set_vertex_shader(device, "shaders/depth_prepass.vert.spv");
+    builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+    builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+    builder.enable_culling(VK_CULL_MODE_BACK_BIT);
+    builder.disable_blending();
+    builder.enable_depth_test();
+    builder.enable_depth_write();
+
+    auto bind_desc = Engine::Vertex::get_binding_description();
+    auto attr_desc = Engine::Vertex::get_position_attribute_description();
+
+    builder.set_vertex_binding_and_attrs(bind_desc, attr_desc);
+
+    m_data = builder.build(device);
+}
+}
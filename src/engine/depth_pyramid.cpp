@@ -0,0 +1,105 @@
+#include <engine/depth_pyramid.h>
+#include <engine/renderer.h>
+
+#include <algorithm>
+
+namespace Engine {
+
+static uint32_t previous_power_of_two(uint32_t value) {
+    uint32_t result = 1;
+    while (result * 2 <= value)
+        result *= 2;
+    return result;
+}
+
+void DepthPyramid::create_pipeline(Renderer &renderer) {
+    m_pipeline.create_pipeline(renderer);
+    renderer.add_compute_pipeline(&m_pipeline);
+}
+
+void DepthPyramid::create_images(Renderer &renderer, VkImageView depth_view, uint32_t width, uint32_t height) {
+    m_depth_width = width;
+    m_depth_height = height;
+
+    // Power of two levels halve exactly, only level 0 has to cover more than 2x2 pixels
+    m_width = previous_power_of_two(width);
+    m_height = previous_power_of_two(height);
+    m_mip_count = 1;
+    while ((std::max(m_width, m_height) >> m_mip_count) > 0)
+        m_mip_count++;
+
+    m_image = Image::create_depth_pyramid_image(renderer, m_width, m_height, m_mip_count);
+    m_has_images = true;
+    m_version++;
+
+    // Set l writes level l. Level 0 never reads the level above, it still needs a valid image there
+    m_pipeline.create_descriptor_sets(renderer, m_mip_count);
+    for (uint32_t level = 0; level < m_mip_count; level++) {
+        VkImageView src_view = m_image.m_level_views[level > 0 ? level - 1 : 0];
+        m_pipeline.write_image(renderer, level, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, depth_view, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, m_image.m_sampler);
+        m_pipeline.write_image(renderer, level, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, src_view, VK_IMAGE_LAYOUT_GENERAL);
+        m_pipeline.write_image(renderer, level, 2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_image.m_level_views[level], VK_IMAGE_LAYOUT_GENERAL);
+    }
+}
+
+void DepthPyramid::destroy_images(vkb::DispatchTable &dispatch) {
+    if (!m_has_images)
+        return;
+    m_image.cleanup(dispatch);
+    m_has_images = false;
+}
+
+void DepthPyramid::build(Renderer &renderer, VkCommandBuffer command_buffer, VkImage depth_image) {
+    // Depth written by the first pass becomes readable. The compute stage is in the source scope so the
+    // previous occlusion test is done reading the pyramid before it is overwritten
+    VkImageMemoryBarrier depth_barrier{};
+    depth_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    depth_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depth_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depth_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depth_barrier.image = depth_image;
+    depth_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    depth_barrier.subresourceRange.baseMipLevel = 0;
+    depth_barrier.subresourceRange.levelCount = 1;
+    depth_barrier.subresourceRange.baseArrayLayer = 0;
+    depth_barrier.subresourceRange.layerCount = 1;
+    depth_barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depth_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &depth_barrier);
+
+    // Each level reads the one written just before it
+    VkMemoryBarrier level_barrier{};
+    level_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    level_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    level_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    DepthPyramidPushConstants constants{};
+    constants.sample_count = static_cast<uint32_t>(renderer.get_msaa_sample_count());
+
+    for (uint32_t level = 0; level < m_mip_count; level++) {
+        constants.level = level;
+        constants.dst_size = glm::uvec2(std::max(m_width >> level, 1u), std::max(m_height >> level, 1u));
+        constants.src_size = level == 0 ? glm::uvec2(m_depth_width, m_depth_height)
+                                        : glm::uvec2(std::max(m_width >> (level - 1), 1u), std::max(m_height >> (level - 1), 1u));
+
+        m_pipeline.bind(renderer, level);
+        renderer.get_recorder().push_constants(m_pipeline.get_pipeline_layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        renderer.get_recorder().dispatch((constants.dst_size.x + 7) / 8, (constants.dst_size.y + 7) / 8, 1);
+
+        renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &level_barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Back to an attachment for the second pass, only the reads have to finish
+    depth_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_barrier.srcAccessMask = 0;
+    depth_barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &depth_barrier);
+}
+
+}
@@ -0,0 +1,25 @@
+#include <engine/compute_pipeline.h>
+#include <engine/depth_pyramid.h>
+#include <engine/renderer.h>
+
+namespace Engine {
+
+void DepthPyramidPipeline::create_pipeline(Engine::Renderer &device) {
+    Engine::ComputePipelineBuilder builder;
+
+    builder.add_push_constants(sizeof(DepthPyramidPushConstants));
+
+    // depth buffer, level above, level being written
+    builder.add_combined_image_sampler(0);
+    builder.add_storage_image(1);
+    builder.add_storage_image(2);
+
+    // A single sampled depth buffer cannot sit behind a sampler2DMS
+    if (device.get_msaa_sample_count() == VK_SAMPLE_COUNT_1_BIT)
+        builder.set_shader(device, "shaders/depth_pyramid_single.comp.spv");
+    else
+        builder.set_shader(device, "shaders/depth_pyramid.comp.spv");
+
+    m_data = builder.build(device);
+}
+}
@@ -0,0 +1,50 @@
+#include <engine/dirty_ranges.h>
+
+#include <algorithm>
+
+namespace Engine {
+
+void DirtyRanges::resize(uint32_t size) {
+    m_flags.assign(size, 0);
+    m_indices.clear();
+    m_ranges.clear();
+}
+
+void DirtyRanges::mark(uint32_t idx) {
+    if (idx >= m_flags.size() || m_flags[idx])
+        return;
+
+    m_flags[idx] = 1;
+    m_indices.push_back(idx);
+}
+
+void DirtyRanges::clear() {
+    for (uint32_t idx : m_indices)
+        m_flags[idx] = 0;
+    m_indices.clear();
+    m_ranges.clear();
+}
+
+const std::vector<DirtyRange>& DirtyRanges::build_ranges(uint32_t merge_gap) {
+    m_ranges.clear();
+    if (m_indices.empty())
+        return m_ranges;
+
+    std::sort(m_indices.begin(), m_indices.end());
+
+    DirtyRange range{m_indices[0], 1};
+    for (size_t i = 1; i < m_indices.size(); i++) {
+        uint32_t idx = m_indices[i];
+        if (idx - (range.first + range.count) <= merge_gap) {
+            range.count = idx - range.first + 1;
+        } else {
+            m_ranges.push_back(range);
+            range = DirtyRange{idx, 1};
+        }
+    }
+    m_ranges.push_back(range);
+
+    return m_ranges;
+}
+
+}
@@ -0,0 +1,206 @@
+#include <engine/gpu_culler.h>
+#include <engine/renderer.h>
+#include <engine/culling.h>
+
+#include <cstring>
+
+namespace Engine {
+
+void GpuCuller::initialize(Renderer &renderer, const std::vector<Model> &models, const std::vector<Mesh> &meshes, const std::vector<DrawBatch> &batches,
+                           size_t static_transform_group, size_t dynamic_transform_group, size_t instance_group, uint32_t instance_section_size) {
+    m_object_count = static_cast<uint32_t>(models.size());
+    m_instance_section_size = instance_section_size;
+
+    std::vector<GpuCullObject> objects(models.size());
+    for (size_t i = 0; i < models.size(); i++) {
+        const Model &model = models[i];
+        objects[i].center = glm::vec4(model.local_bounds.center(), model.local_sphere.w);
+        objects[i].extent = glm::vec4(model.local_bounds.extent(), 0.f);
+        objects[i].transform_idx = model.transform_idx;
+        objects[i].batch_idx = model.batch_idx;
+        objects[i].batch_first_instance = batches[model.batch_idx].first_instance;
+        objects[i].base_texture = model.base_texture;
+        objects[i].lod_instance_stride = batches[model.batch_idx].instance_count;
+        objects[i].lod_count = meshes[model.mesh_idx].lod_count;
+    }
+    // Vulkan does not allow zero sized buffers
+    if (objects.empty())
+        objects.push_back(GpuCullObject{});
+
+    m_batch_commands.resize(batches.size());
+    for (size_t b = 0; b < batches.size(); b++) {
+        const Mesh &mesh = meshes[batches[b].mesh_idx];
+        const MeshLod &lod = mesh.lods[batches[b].lod];
+        m_batch_commands[b].indexCount = lod.index_count;
+        m_batch_commands[b].instanceCount = 0;
+        m_batch_commands[b].firstIndex = mesh.first_index + lod.first_index;
+        m_batch_commands[b].vertexOffset = mesh.vertex_offset;
+        m_batch_commands[b].firstInstance = batches[b].first_instance;
+    }
+
+    size_t objects_size = sizeof(GpuCullObject) * objects.size();
+    m_object_buffer_idx = renderer.create_buffer(objects_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    renderer.update_buffer(m_object_buffer_idx, objects.data(), objects_size);
+
+    // The early phase steps from whatever the loader picked
+    std::vector<uint32_t> lods(objects.size(), 0);
+    for (size_t i = 0; i < models.size(); i++)
+        lods[i] = models[i].lod;
+    size_t lods_size = sizeof(uint32_t) * lods.size();
+    m_lod_buffer_idx = renderer.create_device_local_buffer(lods_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    renderer.upload_buffer(m_lod_buffer_idx, lods.data(), lods_size);
+
+    // Nothing counts as visible at first, so the first frame draws everything in the late phase
+    std::vector<uint32_t> visibility(objects.size(), 0);
+    size_t visibility_size = sizeof(uint32_t) * visibility.size();
+    m_visibility_buffer_idx = renderer.create_device_local_buffer(visibility_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    renderer.upload_buffer(m_visibility_buffer_idx, visibility.data(), visibility_size);
+
+    m_occlusion_view_buffer_idx = renderer.create_buffer(sizeof(GpuOcclusionView), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
+    m_frustum_buffer_idx = renderer.create_buffer(sizeof(GpuCullFrustums), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
+
+    m_pipeline.create_pipeline(renderer);
+    m_pipeline.create_descriptor_sets(renderer);
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+        m_pipeline.write_storage_buffer(renderer, frame, 0, renderer.get_buffer(m_object_buffer_idx));
+        m_pipeline.write_storage_buffer(renderer, frame, 1, renderer.get_uniform_buffer(static_transform_group, frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 2, renderer.get_indirect_buffer(frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 3, renderer.get_uniform_buffer(instance_group, frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 4, renderer.get_uniform_buffer(dynamic_transform_group, frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 5, renderer.get_buffer(m_lod_buffer_idx));
+        m_pipeline.write_storage_buffer(renderer, frame, 7, renderer.get_buffer(m_visibility_buffer_idx));
+        m_pipeline.write_storage_buffer(renderer, frame, 8, renderer.get_buffer(m_occlusion_view_buffer_idx + frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 9, renderer.get_buffer(m_frustum_buffer_idx + frame));
+    }
+    // The depth pyramid (binding 6) does not exist until the renderer is initialized, it is written on the first record
+    renderer.add_compute_pipeline(&m_pipeline);
+
+    m_initialized = true;
+}
+
+void GpuCuller::set_lod_view(const glm::vec3 &eye, float proj_scale, bool perspective, float near_plane) {
+    m_view.lod_eye = glm::vec4(eye, proj_scale);
+    m_view.lod_params = glm::vec4(near_plane, perspective ? 1.f : 0.f, LOD_HYSTERESIS, 0.f);
+    m_view.lod_sizes = glm::vec4(LOD_SCREEN_SIZES[0], LOD_SCREEN_SIZES[1], LOD_SCREEN_SIZES[2], 0.f);
+}
+
+void GpuCuller::write_pyramid_descriptors(Renderer &renderer) {
+    // Only after a resize, when nothing is in flight
+    const DepthPyramid &pyramid = renderer.get_depth_pyramid();
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+        m_pipeline.write_image(renderer, frame, 6, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, pyramid.get_view(), VK_IMAGE_LAYOUT_GENERAL, pyramid.get_sampler());
+    m_pyramid_version = pyramid.get_version();
+}
+
+void GpuCuller::reset_section(Renderer &renderer, int current_frame, uint32_t section) {
+    // Batches with nothing visible stay as instanceCount 0 draws, so the draw count is known on
+    // the CPU and drawIndirectCount is not needed. Host writes are visible to the submit
+    uint32_t batch_count = static_cast<uint32_t>(m_batch_commands.size());
+    VkDrawIndexedIndirectCommand *commands = renderer.get_indirect_commands(current_frame, section);
+    for (uint32_t b = 0; b < batch_count; b++) {
+        commands[b] = m_batch_commands[b];
+        commands[b].firstInstance += section * m_instance_section_size;
+    }
+    renderer.set_indirect_draw_count(current_frame, section, batch_count);
+}
+
+void GpuCuller::dispatch(Renderer &renderer, const Frustum &frustum, uint32_t section, uint32_t phase) {
+    CullPushConstants constants{};
+    for (int p = 0; p < 6; p++)
+        constants.planes[p] = frustum.planes[p];
+
+    constants.object_count = m_object_count;
+    constants.first_command = section * renderer.get_indirect_section_size();
+    constants.first_instance = section * m_instance_section_size;
+    constants.phase = phase;
+
+    renderer.get_recorder().push_constants(m_pipeline.get_pipeline_layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    renderer.get_recorder().dispatch((m_object_count + 63) / 64, 1, 1);
+}
+
+void GpuCuller::dispatch(Renderer &renderer, const std::vector<Frustum> &frustums, const ShadowCullJob &job) {
+    if (job.frustum_count == 1) {
+        dispatch(renderer, frustums[job.first_frustum], job.section, job.phase);
+        return;
+    }
+
+    // The frustums were written to this frame's buffer in record
+    CullPushConstants constants{};
+    constants.object_count = m_object_count;
+    constants.first_command = job.section * renderer.get_indirect_section_size();
+    constants.first_instance = job.section * m_instance_section_size;
+    constants.phase = job.phase;
+    constants.first_frustum = job.first_frustum;
+    constants.frustum_count = job.frustum_count;
+
+    renderer.get_recorder().push_constants(m_pipeline.get_pipeline_layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    renderer.get_recorder().dispatch((m_object_count + 63) / 64, 1, 1);
+}
+
+void GpuCuller::record(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, const glm::mat4 &camera_view_proj, uint32_t camera_section,
+                       const std::vector<Frustum> &light_frustums, const std::vector<ShadowCullJob> &light_jobs) {
+    if (m_pyramid_version != renderer.get_depth_pyramid().get_version())
+        write_pyramid_descriptors(renderer);
+
+    reset_section(renderer, current_frame, camera_section);
+    for (const ShadowCullJob &job : light_jobs)
+        reset_section(renderer, current_frame, job.section);
+
+    if (light_frustums.size() > MAX_CULL_FRUSTUMS)
+        throw std::runtime_error("Too many light frustums for the cull pass!");
+    GpuCullFrustums *frustums = static_cast<GpuCullFrustums*>(renderer.map_buffer(m_frustum_buffer_idx + current_frame));
+    for (size_t f = 0; f < light_frustums.size(); f++)
+        memcpy(frustums->planes[f], light_frustums[f].planes, sizeof(frustums->planes[f]));
+
+    // Pyramid size is filled in by record_late
+    m_view.view_proj = camera_view_proj;
+    memcpy(renderer.map_buffer(m_occlusion_view_buffer_idx + current_frame), &m_view, sizeof(m_view));
+    if (m_object_count == 0)
+        return;
+
+    m_pipeline.bind(renderer, current_frame);
+    dispatch(renderer, Frustum::from_matrix(camera_view_proj), camera_section, CULL_PHASE_EARLY);
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    if (!light_jobs.empty()) {
+        // The casters are drawn at the LODs the early phase just picked
+        renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        for (const ShadowCullJob &job : light_jobs)
+            dispatch(renderer, light_frustums, job);
+    }
+
+    // Commands are read by the draws and instances by the vertex shaders in this frame's passes, the LODs by the late phase
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void GpuCuller::record_late(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, uint32_t late_section) {
+    reset_section(renderer, current_frame, late_section);
+    if (m_object_count == 0)
+        return;
+
+    // The frame is not submitted yet, so this still lands before the early phase reads the buffer
+    const DepthPyramid &pyramid = renderer.get_depth_pyramid();
+    m_view.pyramid_size = glm::vec4(static_cast<float>(pyramid.get_width()), static_cast<float>(pyramid.get_height()), static_cast<float>(pyramid.get_mip_count()), 0.f);
+    memcpy(renderer.map_buffer(m_occlusion_view_buffer_idx + current_frame), &m_view, sizeof(m_view));
+
+    // The early dispatch is done reading the visibility flags, the pyramid build waited on it
+    m_pipeline.bind(renderer, current_frame);
+    dispatch(renderer, Frustum::from_matrix(m_view.view_proj), late_section, CULL_PHASE_LATE);
+
+    // Besides this frame's draws, the next frame's early dispatch reads the visibility flags
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+}
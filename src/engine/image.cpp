@@ -3,8 +3,11 @@
 
 #include <engine/image.h>
 #include <engine/renderer.h>
+#include <engine/profiler.h>
 #include <iostream>
 
+#include <fmt/format.h>
+
 namespace Engine {
 
 void TextureImage::cleanup(vkb::DispatchTable &dispatch_table) {
@@ -34,6 +37,16 @@ void DepthImage::cleanup(vkb::DispatchTable &dispatch_table) {
     dispatch_table.freeMemory(m_image_memory, nullptr);
 }
 
+void DepthPyramidImage::cleanup(vkb::DispatchTable &dispatch_table) {
+    dispatch_table.destroySampler(m_sampler, nullptr);
+    for (VkImageView view : m_level_views)
+        dispatch_table.destroyImageView(view, nullptr);
+    m_level_views.clear();
+    dispatch_table.destroyImageView(m_image_view, nullptr);
+    dispatch_table.destroyImage(m_image, nullptr);
+    dispatch_table.freeMemory(m_image_memory, nullptr);
+}
+
 void ColorImage::cleanup(vkb::DispatchTable &dispatch_table) {
     dispatch_table.destroyImageView(m_image_view, nullptr);
     dispatch_table.destroyImage(m_image, nullptr);
@@ -46,12 +59,13 @@ TextureImage Image::create_texture_image(std::string filename) {
     return ret; 
 }
 
-TextureImageArray Image::create_texture_image_array(std::vector<std::string> filenames, uint32_t width, uint32_t height, uint32_t layer_count) {
+TextureImageArray Image::create_texture_image_array(std::vector<std::string> filenames, uint32_t width, uint32_t height, uint32_t layer_count, std::vector<DecodedImage> decoded) {
     TextureImageArray ret{};
     ret.m_filenames = filenames;
     ret.m_width = width;
     ret.m_height = height;
     ret.layer_count = layer_count;
+    ret.m_decoded = std::move(decoded);
 
     return ret;
 }
@@ -62,7 +76,8 @@ DepthImage Image::create_depth_image(Renderer &renderer, uint32_t width, uint32_
     VkDeviceMemory depth_image_memory;
     VkImageView depth_image_view;
 
-    create_image(renderer, width, height, depth_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, renderer.get_msaa_sample_count(),  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image, depth_image_memory);
+    // Sampled by the depth pyramid build
+    create_image(renderer, width, height, depth_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, renderer.get_msaa_sample_count(),  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image, depth_image_memory);
 
     depth_image_view = create_image_view(renderer, depth_image, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT);
 
@@ -83,7 +98,8 @@ ShadowMapImage Image::create_shadow_map_image(Renderer &renderer, uint32_t width
 
     create_image(renderer, width, height, depth_format,
         VK_IMAGE_TILING_OPTIMAL, 
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
+        // Transfers copy the cached static casters into the lights' layers
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 
         VK_SAMPLE_COUNT_1_BIT, 
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
         depth_image, depth_image_memory, layer_count, 0);
@@ -105,6 +121,68 @@ ShadowMapImage Image::create_shadow_map_image(Renderer &renderer, uint32_t width
     return ret;
 }
 
+DepthPyramidImage Image::create_depth_pyramid_image(Renderer &renderer, uint32_t width, uint32_t height, uint32_t mip_count) {
+    DepthPyramidImage ret{};
+    create_image(renderer, width, height, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_SAMPLE_COUNT_1_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, ret.m_image, ret.m_image_memory, 1, 0, VK_IMAGE_LAYOUT_UNDEFINED, mip_count);
+
+    VkImageViewCreateInfo view_info{};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = ret.m_image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = VK_FORMAT_R32_SFLOAT;
+    view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    view_info.subresourceRange.baseMipLevel = 0;
+    view_info.subresourceRange.levelCount = mip_count;
+    view_info.subresourceRange.baseArrayLayer = 0;
+    view_info.subresourceRange.layerCount = 1;
+
+    if (renderer.m_dispatch.createImageView(&view_info, nullptr, &ret.m_image_view) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create depth pyramid view!");
+
+    ret.m_level_views.resize(mip_count);
+    for (uint32_t level = 0; level < mip_count; level++) {
+        view_info.subresourceRange.baseMipLevel = level;
+        view_info.subresourceRange.levelCount = 1;
+        if (renderer.m_dispatch.createImageView(&view_info, nullptr, &ret.m_level_views[level]) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create depth pyramid level view!");
+    }
+
+    // Read with texelFetch, the sampler only has to exist
+    VkSamplerCreateInfo sampler_info{};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.minLod = 0.f;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+
+    if (renderer.m_dispatch.createSampler(&sampler_info, nullptr, &ret.m_sampler) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create depth pyramid sampler!");
+
+    // Every level at once, transition_image_layout only does the first
+    VkCommandBuffer command_buffer = renderer.begin_single_time_command();
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = ret.m_image;
+    barrier.subresourceRange = view_info.subresourceRange;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = mip_count;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    renderer.end_single_time_command(command_buffer);
+
+    return ret;
+}
+
 ColorImage Image::create_color_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkSampleCountFlagBits num_samples) {
     VkImage image;
     VkDeviceMemory image_memory;
@@ -122,10 +200,34 @@ ColorImage Image::create_color_image(Renderer &renderer, uint32_t width, uint32_
     return ret;
 }
 
+DecodedImage Image::decode_image(const std::string &filename) {
+    PROFILE_SCOPE(fmt::format("decode_image: {}", filename));
+    int tex_width, tex_height, tex_channels;
+
+    stbi_uc* pixels = stbi_load(filename.c_str(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
+    if(!pixels)
+        throw std::runtime_error(fmt::format("Failed to load image: {}", filename));
+
+    DecodedImage ret{};
+    ret.m_filename = filename;
+    ret.m_width = tex_width;
+    ret.m_height = tex_height;
+    ret.m_pixels.assign(pixels, pixels + static_cast<size_t>(tex_width) * tex_height * 4);
+
+    stbi_image_free(pixels);
+
+    return ret;
+}
+
 void Image::initialize_texture_image(Renderer &renderer, TextureImage &tex) {
+    PROFILE_SCOPE(fmt::format("texture: {}", tex.m_filename));
     int tex_width, tex_height, tex_channels;
 
-    stbi_uc* pixels = stbi_load(tex.m_filename.c_str(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
+    stbi_uc* pixels = nullptr;
+    {
+        PROFILE_SCOPE("stbi_load");
+        pixels = stbi_load(tex.m_filename.c_str(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
+    }
 
     VkDeviceSize image_size = tex_width * tex_height * 4;
 
@@ -174,30 +276,26 @@ void Image::initialize_texture_image_array(Renderer &renderer, TextureImageArray
 
     transition_image_layout(renderer, tex.m_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, tex.layer_count);
 
-    uint32_t cur_layer = 0;
-    for(std::string &filename: tex.m_filenames) {
-        int tex_width, tex_height, tex_channels;
+    bool predecoded = tex.m_decoded.size() == tex.m_filenames.size();
 
-        stbi_uc* pixels = stbi_load(filename.c_str(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
+    for(uint32_t cur_layer = 0; cur_layer < tex.m_filenames.size(); cur_layer++) {
+        const std::string &filename = tex.m_filenames[cur_layer];
+        PROFILE_SCOPE(fmt::format("texture: {}", filename));
 
-        if (static_cast<uint32_t>(tex_width) != tex.m_width && static_cast<uint32_t>(tex_height) != tex.m_height)
-            throw std::runtime_error("All images in an image array must be the same size!");
+        DecodedImage decoded = predecoded ? std::move(tex.m_decoded[cur_layer]) : decode_image(filename);
 
-        VkDeviceSize image_size = tex_width * tex_height * 4;
+        if (static_cast<uint32_t>(decoded.m_width) != tex.m_width && static_cast<uint32_t>(decoded.m_height) != tex.m_height)
+            throw std::runtime_error("All images in an image array must be the same size!");
 
-        if(!pixels)
-            throw std::runtime_error("Failed to load Image image!");
+        VkDeviceSize image_size = decoded.m_pixels.size();
 
         size_t staging_buffer_idx = renderer.create_buffer(image_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-        renderer.update_buffer(staging_buffer_idx, pixels, static_cast<size_t>(image_size));
-
-        stbi_image_free(pixels);
-
-        renderer.copy_buffer_to_image(staging_buffer_idx, tex.m_image, static_cast<uint32_t>(tex_width), static_cast<uint32_t>(tex_height), cur_layer);
+        renderer.update_buffer(staging_buffer_idx, decoded.m_pixels.data(), static_cast<size_t>(image_size));
 
-        cur_layer++;
+        renderer.copy_buffer_to_image(staging_buffer_idx, tex.m_image, static_cast<uint32_t>(decoded.m_width), static_cast<uint32_t>(decoded.m_height), cur_layer);
     }
+    tex.m_decoded.clear();
 
     transition_image_layout(renderer, tex.m_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, tex.layer_count);
 
@@ -249,15 +347,14 @@ VkImageView Image::create_image_array_view(Renderer &renderer, VkImage image, Vk
     return imageView;
 }
 
-void Image::create_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits num_samples, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, uint32_t layer_count, VkImageCreateFlags flags, VkImageLayout layout) {
+void Image::create_image(Renderer &renderer, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits num_samples, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, uint32_t layer_count, VkImageCreateFlags flags, VkImageLayout layout, uint32_t mip_levels) {
     VkImageCreateInfo image_info{};
     image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     image_info.imageType = VK_IMAGE_TYPE_2D;
     image_info.extent.width = static_cast<uint32_t>(width);
     image_info.extent.height = static_cast<uint32_t>(height);
-    // no mipmapping rn
     image_info.extent.depth = 1;
-    image_info.mipLevels = 1;
+    image_info.mipLevels = mip_levels;
     image_info.arrayLayers = layer_count;
 
     image_info.format = format;
@@ -0,0 +1,18 @@
+#include <engine/compute_pipeline.h>
+#include <engine/light_clusters.h>
+
+namespace Engine {
+
+void LightClusterPipeline::create_pipeline(Engine::Renderer &device) {
+    Engine::ComputePipelineBuilder builder;
+
+    // params and lights, cluster ranges, light indices
+    builder.add_storage_buffer(0);
+    builder.add_storage_buffer(1);
+    builder.add_storage_buffer(2);
+
+    builder.set_shader(device, "shaders/light_clusters.comp.spv");
+
+    m_data = builder.build(device);
+}
+}
@@ -0,0 +1,78 @@
+#include <engine/light_clusters.h>
+#include <engine/renderer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace Engine {
+
+void LightClusters::initialize(Renderer &renderer, uint32_t lights_binding) {
+    // Read by the fragment shaders through the main set, written by the pass through its own
+    size_t lights_size = sizeof(LightClusterParams) + sizeof(LocalLight) * MAX_LOCAL_LIGHTS;
+    m_light_group = renderer.create_uniform_group(lights_binding, static_cast<uint32_t>(lights_size), VK_SHADER_STAGE_FRAGMENT_BIT, true);
+    m_range_group = renderer.create_uniform_group(lights_binding + 1, sizeof(glm::uvec2) * CLUSTER_COUNT, VK_SHADER_STAGE_FRAGMENT_BIT, true);
+    m_index_group = renderer.create_uniform_group(lights_binding + 2, sizeof(uint32_t) * CLUSTER_COUNT * CLUSTER_AVERAGE_LIGHTS, VK_SHADER_STAGE_FRAGMENT_BIT, true);
+
+    // Nothing is lit until the first record
+    LightClusterParams params{};
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+        memcpy(renderer.map_uniform_group(m_light_group, frame), &params, sizeof(params));
+        memset(renderer.map_uniform_group(m_range_group, frame), 0, sizeof(glm::uvec2) * CLUSTER_COUNT);
+    }
+
+    m_pipeline.create_pipeline(renderer);
+    m_pipeline.create_descriptor_sets(renderer);
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+        m_pipeline.write_storage_buffer(renderer, frame, 0, renderer.get_uniform_buffer(m_light_group, frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 1, renderer.get_uniform_buffer(m_range_group, frame));
+        m_pipeline.write_storage_buffer(renderer, frame, 2, renderer.get_uniform_buffer(m_index_group, frame));
+    }
+    renderer.add_compute_pipeline(&m_pipeline);
+}
+
+void LightClusters::record(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame, const std::vector<LocalLight> &lights,
+                           const glm::mat4 &view, const glm::mat4 &proj, float near_plane, float far_plane) {
+    if (lights.size() > MAX_LOCAL_LIGHTS)
+        throw std::runtime_error("Too many local lights for the light clusters!");
+
+    VkExtent2D extent = renderer.get_swapchain_extent();
+    float width = static_cast<float>(extent.width);
+    float height = static_cast<float>(extent.height);
+
+    LightClusterParams params{};
+    params.view = view;
+    params.proj = proj;
+    params.inverse_proj = glm::inverse(proj);
+    params.screen = glm::vec4(width, height, std::ceil(width / CLUSTER_TILES_X), std::ceil(height / CLUSTER_TILES_Y));
+
+    // Slices are even in log depth, so the near ones stay thin
+    near_plane = std::max(near_plane, 0.01f);
+    far_plane = std::max(far_plane, near_plane * 2.f);
+    float log_range = std::log(far_plane / near_plane);
+    params.slice_scale = static_cast<float>(CLUSTER_SLICES) / log_range;
+    params.slice_bias = -static_cast<float>(CLUSTER_SLICES) * std::log(near_plane) / log_range;
+
+    params.light_count = static_cast<uint32_t>(lights.size());
+    params.index_count = 0;
+    params.index_capacity = CLUSTER_COUNT * CLUSTER_AVERAGE_LIGHTS;
+
+    // Host writes are visible to the submit
+    char *mapped = static_cast<char*>(renderer.map_uniform_group(m_light_group, current_frame));
+    memcpy(mapped, &params, sizeof(params));
+    if (!lights.empty())
+        memcpy(mapped + sizeof(params), lights.data(), sizeof(LocalLight) * lights.size());
+
+    m_pipeline.bind(renderer, current_frame);
+    renderer.get_recorder().dispatch((CLUSTER_COUNT + 63) / 64, 1, 1);
+
+    // Ranges and indices are read by the fragment shaders of this frame's passes
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    renderer.m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+}
@@ -0,0 +1,231 @@
+#include <engine/mesh_simplify.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace Engine {
+
+namespace {
+
+// Symmetric 4x4, upper triangle: xx xy xz xw yy yz yw zz zw ww
+struct Quadric {
+    double a[10] = {};
+
+    void add_plane(const glm::vec3 &n, float d) {
+        double nx = n.x, ny = n.y, nz = n.z, nd = d;
+        a[0] += nx * nx; a[1] += nx * ny; a[2] += nx * nz; a[3] += nx * nd;
+        a[4] += ny * ny; a[5] += ny * nz; a[6] += ny * nd;
+        a[7] += nz * nz; a[8] += nz * nd;
+        a[9] += nd * nd;
+    }
+
+    void add(const Quadric &other) {
+        for (int i = 0; i < 10; i++)
+            a[i] += other.a[i];
+    }
+
+    // Sum of squared distances to the accumulated planes
+    double error(const glm::vec3 &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double e = a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x
+                 + a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y
+                 + a[7] * z * z + 2.0 * a[8] * z
+                 + a[9];
+        return e > 0.0 ? e : 0.0;
+    }
+};
+
+struct Collapse {
+    uint32_t source;
+    uint32_t target;
+    double cost;
+};
+
+struct PositionHash {
+    size_t operator()(const glm::vec3 &p) const {
+        uint32_t bits[3];
+        std::memcpy(bits, &p, sizeof(bits));
+        return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+    }
+};
+
+struct PositionEqual {
+    bool operator()(const glm::vec3 &a, const glm::vec3 &b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+uint64_t edge_key(uint32_t a, uint32_t b) {
+    return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+}
+
+glm::vec3 triangle_normal(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+    return glm::cross(b - a, c - a);
+}
+
+}
+
+std::vector<uint32_t> simplify_mesh(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices,
+                                    size_t target_index_count, float max_error, float *out_error) {
+    std::vector<uint32_t> result(indices);
+    float accepted_error = 0.f;
+    size_t vertex_count = positions.size();
+
+    // Vertices sharing a position are one point on the surface. Moving only one of them would
+    // tear the seam, so those are locked along with the border
+    std::vector<uint32_t> position_id(vertex_count);
+    std::vector<uint8_t> locked(vertex_count, 0);
+    {
+        std::unordered_map<glm::vec3, uint32_t, PositionHash, PositionEqual> first_with_position;
+        std::vector<uint32_t> shared(vertex_count, 0);
+        for (uint32_t v = 0; v < vertex_count; v++) {
+            auto it = first_with_position.emplace(positions[v], v).first;
+            position_id[v] = it->second;
+            shared[it->second]++;
+        }
+        for (uint32_t v = 0; v < vertex_count; v++)
+            locked[v] = shared[position_id[v]] > 1;
+
+        std::unordered_map<uint64_t, uint32_t> edge_uses;
+        for (size_t t = 0; t + 2 < result.size(); t += 3) {
+            for (int e = 0; e < 3; e++)
+                edge_uses[edge_key(position_id[result[t + e]], position_id[result[t + (e + 1) % 3]])]++;
+        }
+        for (size_t t = 0; t + 2 < result.size(); t += 3) {
+            for (int e = 0; e < 3; e++) {
+                uint32_t a = result[t + e], b = result[t + (e + 1) % 3];
+                if (edge_uses[edge_key(position_id[a], position_id[b])] == 1)
+                    locked[a] = locked[b] = 1;
+            }
+        }
+    }
+
+    std::vector<Quadric> quadrics(vertex_count);
+    for (size_t t = 0; t + 2 < result.size(); t += 3) {
+        const glm::vec3 &p0 = positions[result[t]], &p1 = positions[result[t + 1]], &p2 = positions[result[t + 2]];
+        glm::vec3 normal = triangle_normal(p0, p1, p2);
+        float length = glm::length(normal);
+        if (length == 0.f)
+            continue;
+
+        normal = normal / length;
+        float d = -glm::dot(normal, p0);
+        for (int i = 0; i < 3; i++)
+            quadrics[result[t + i]].add_plane(normal, d);
+    }
+
+    double max_cost = double(max_error) * double(max_error);
+    std::vector<uint64_t> edges;
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> collapse_target(vertex_count);
+    std::vector<uint8_t> touched(vertex_count);
+    std::vector<uint32_t> first_triangle, vertex_triangles;
+
+    // Each pass collapses a batch of the cheapest independent edges, then rebuilds everything.
+    // Simpler than a priority queue with updates and close enough in quality
+    while (result.size() > target_index_count) {
+        size_t triangle_count = result.size() / 3;
+
+        first_triangle.assign(vertex_count + 1, 0);
+        for (uint32_t idx : result)
+            first_triangle[idx + 1]++;
+        for (size_t v = 0; v < vertex_count; v++)
+            first_triangle[v + 1] += first_triangle[v];
+        vertex_triangles.resize(result.size());
+        {
+            std::vector<uint32_t> fill(first_triangle.begin(), first_triangle.end() - 1);
+            for (size_t i = 0; i < result.size(); i++)
+                vertex_triangles[fill[result[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+
+        edges.clear();
+        for (size_t t = 0; t < triangle_count; t++) {
+            for (int e = 0; e < 3; e++)
+                edges.push_back(edge_key(result[t * 3 + e], result[t * 3 + (e + 1) % 3]));
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (uint64_t edge : edges) {
+            uint32_t a = uint32_t(edge >> 32), b = uint32_t(edge & 0xFFFFFFFFu);
+            Quadric q = quadrics[a];
+            q.add(quadrics[b]);
+
+            double cost_ab = locked[a] ? INFINITY : q.error(positions[b]);
+            double cost_ba = locked[b] ? INFINITY : q.error(positions[a]);
+            if (cost_ab == INFINITY && cost_ba == INFINITY)
+                continue;
+
+            if (cost_ab <= cost_ba)
+                collapses.push_back(Collapse{a, b, cost_ab});
+            else
+                collapses.push_back(Collapse{b, a, cost_ba});
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) { return x.cost < y.cost; });
+
+        // A collapse removes about two triangles
+        size_t collapse_budget = std::max<size_t>((result.size() - target_index_count) / 6, 1);
+        size_t collapsed = 0;
+        for (size_t v = 0; v < vertex_count; v++)
+            collapse_target[v] = static_cast<uint32_t>(v);
+        std::fill(touched.begin(), touched.end(), 0);
+
+        for (const Collapse &collapse : collapses) {
+            if (collapsed >= collapse_budget || collapse.cost > max_cost)
+                break;
+            if (touched[collapse.source] || touched[collapse.target])
+                continue;
+
+            // Triangles that keep existing must not flip
+            const glm::vec3 &moved = positions[collapse.target];
+            bool flips = false;
+            for (uint32_t i = first_triangle[collapse.source]; i < first_triangle[collapse.source + 1] && !flips; i++) {
+                const uint32_t *tri = &result[size_t(vertex_triangles[i]) * 3];
+                if (tri[0] == collapse.target || tri[1] == collapse.target || tri[2] == collapse.target)
+                    continue;
+
+                glm::vec3 p[3], q[3];
+                for (int k = 0; k < 3; k++) {
+                    p[k] = positions[tri[k]];
+                    q[k] = tri[k] == collapse.source ? moved : p[k];
+                }
+                if (glm::dot(triangle_normal(p[0], p[1], p[2]), triangle_normal(q[0], q[1], q[2])) <= 0.f)
+                    flips = true;
+            }
+            if (flips)
+                continue;
+
+            collapse_target[collapse.source] = collapse.target;
+            quadrics[collapse.target].add(quadrics[collapse.source]);
+            accepted_error = std::max(accepted_error, float(std::sqrt(collapse.cost)));
+            collapsed++;
+
+            // The whole one-ring changes shape, anything in it waits for the next pass
+            for (uint32_t i = first_triangle[collapse.source]; i < first_triangle[collapse.source + 1]; i++) {
+                const uint32_t *tri = &result[size_t(vertex_triangles[i]) * 3];
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+        }
+
+        if (collapsed == 0)
+            break;
+
+        size_t out = 0;
+        for (size_t t = 0; t < triangle_count; t++) {
+            uint32_t a = collapse_target[result[t * 3]], b = collapse_target[result[t * 3 + 1]], c = collapse_target[result[t * 3 + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+            result[out++] = a;
+            result[out++] = b;
+            result[out++] = c;
+        }
+        result.resize(out);
+    }
+
+    if (out_error)
+        *out_error = accepted_error;
+    return result;
+}
+
+}
@@ -1,21 +1,77 @@
 #include <engine/models.h>
+#include <engine/mesh_simplify.h>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <cmath>
+
 namespace Engine {
 
-void Model::create_buffers(Engine::Renderer &renderer) {
-    vertex_buffer_size = sizeof(vertices[0]) * vertices.size();
-    vertex_buffer_idx = renderer.create_vertex_buffer(vertex_buffer_size);
+void Mesh::compute_bounds() {
+    local_bounds = AABB{};
+    for (const Vertex &vertex : vertices)
+        local_bounds.expand(vertex.pos);
+
+    if (!local_bounds.valid()) {
+        local_bounds.min = local_bounds.max = glm::vec3(0.f);
+        local_sphere = glm::vec4(0.f);
+        return;
+    }
+
+    // Centered on the box, not the minimal sphere, but close enough for culling and LOD
+    glm::vec3 center = local_bounds.center();
+    float radius_sq = 0.f;
+    for (const Vertex &vertex : vertices) {
+        glm::vec3 d = vertex.pos - center;
+        radius_sq = std::max(radius_sq, glm::dot(d, d));
+    }
+
+    local_sphere = glm::vec4(center, std::sqrt(radius_sq));
+}
+
+void Mesh::generate_lods() {
+    lods[0] = MeshLod{0, static_cast<uint32_t>(indices.size()), 0.f};
+    lod_count = 1;
+    lod_indices.clear();
 
-    index_buffer_size = sizeof(indices[0]) * indices.size();
-    index_buffer_idx = renderer.create_index_buffer(index_buffer_size);
+    // Planes and other tiny meshes gain nothing
+    if (indices.size() < 3 * 256)
+        return;
 
-    renderer.update_buffer(vertex_buffer_idx, (void*)vertices.data(), vertex_buffer_size);
-    renderer.update_buffer(index_buffer_idx, (void*)indices.data(), index_buffer_size);
+    std::vector<glm::vec3> positions(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++)
+        positions[i] = vertices[i].pos;
+
+    // Fractions of level 0, each level simplifies the previous one. The error bound keeps the
+    // coarsest level recognizable, it is only seen when the mesh is a few pixels tall anyway
+    static const float ratios[MAX_MESH_LODS - 1] = {0.5f, 0.2f, 0.08f};
+    float max_error = local_sphere.w * 0.1f;
+
+    std::vector<uint32_t> previous = indices;
+    for (uint32_t l = 1; l < MAX_MESH_LODS; l++) {
+        size_t target = static_cast<size_t>(indices.size() * ratios[l - 1]) / 3 * 3;
+        float error = 0.f;
+        std::vector<uint32_t> simplified = simplify_mesh(positions, previous, target, max_error, &error);
+
+        // Stuck on locked vertices or the error bound, another level would barely help
+        if (simplified.size() > previous.size() * 4 / 5)
+            break;
+
+        lods[l].first_index = static_cast<uint32_t>(indices.size() + lod_indices.size());
+        lods[l].index_count = static_cast<uint32_t>(simplified.size());
+        lods[l].error = std::max(error, lods[l - 1].error);
+        lod_count++;
+
+        lod_indices.insert(lod_indices.end(), simplified.begin(), simplified.end());
+        previous.swap(simplified);
+    }
 }
 
-void Model::refresh_buffers(Engine::Renderer &renderer) {
-    renderer.update_buffer(vertex_buffer_idx, (void*)vertices.data(), vertex_buffer_size);
-    renderer.update_buffer(index_buffer_idx, (void*)indices.data(), index_buffer_size);
+glm::vec4 Model::world_sphere() const {
+    glm::vec3 center = glm::vec3(model_matrix * glm::vec4(glm::vec3(local_sphere), 1.f));
+    float max_scale = std::max(glm::length(glm::vec3(model_matrix[0])),
+                      std::max(glm::length(glm::vec3(model_matrix[1])), glm::length(glm::vec3(model_matrix[2]))));
+
+    return glm::vec4(center, local_sphere.w * max_scale);
 }
 }
\ No newline at end of file
@@ -0,0 +1,266 @@
+#include <engine/occlusion_rasterizer.h>
+#include <engine/simd.h>
+#include <engine/thread_pool.h>
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+
+namespace Engine {
+
+#if ENGINE_SIMD_AVX
+static constexpr int LANES = 8;
+#elif ENGINE_SIMD_SSE
+static constexpr int LANES = 4;
+#else
+static constexpr int LANES = 1;
+#endif
+
+static constexpr uint32_t TILE_PIXELS = OcclusionRasterizer::TILE_WIDTH * OcclusionRasterizer::TILE_HEIGHT;
+
+static glm::vec2 to_screen(const glm::vec3 &ndc) {
+    return glm::vec2((ndc.x * 0.5f + 0.5f) * OcclusionRasterizer::WIDTH, (ndc.y * 0.5f + 0.5f) * OcclusionRasterizer::HEIGHT);
+}
+
+uint32_t OcclusionRasterizer::add_mesh(std::vector<glm::vec3> positions, std::vector<uint32_t> indices) {
+    m_meshes.push_back(OccluderMesh{std::move(positions), std::move(indices)});
+    return static_cast<uint32_t>(m_meshes.size() - 1);
+}
+
+void OcclusionRasterizer::begin(const glm::mat4 &view_proj) {
+    m_view_proj = view_proj;
+    m_triangles.clear();
+    for (std::vector<uint32_t> &bin : m_bins)
+        bin.clear();
+}
+
+void OcclusionRasterizer::add_occluder(uint32_t mesh_id, const glm::mat4 &model_matrix) {
+    const OccluderMesh &mesh = m_meshes[mesh_id];
+    glm::mat4 mvp = m_view_proj * model_matrix;
+
+    m_projected.resize(mesh.positions.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++) {
+        glm::vec4 clip = mvp * glm::vec4(mesh.positions[i], 1.f);
+        if (clip.z < 0.f || clip.w <= 0.f) {
+            m_projected[i] = glm::vec4(0.f);
+            continue;
+        }
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        glm::vec2 screen = to_screen(ndc);
+        m_projected[i] = glm::vec4(screen.x, screen.y, ndc.z, 1.f);
+    }
+
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        glm::vec4 v0 = m_projected[mesh.indices[i]];
+        glm::vec4 v1 = m_projected[mesh.indices[i + 1]];
+        glm::vec4 v2 = m_projected[mesh.indices[i + 2]];
+
+        // Crosses the near plane. Not clipping it only loses some occlusion, never hides anything
+        if (v0.w == 0.f || v1.w == 0.f || v2.w == 0.f)
+            continue;
+        // Entirely past the far plane, nothing is behind it
+        if (std::min(v0.z, std::min(v1.z, v2.z)) >= 1.f)
+            continue;
+
+        // Walls are seen from both sides, so no backface culling, only a consistent winding
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+        if (std::abs(area) < 1e-6f)
+            continue;
+        if (area < 0.f) {
+            std::swap(v1, v2);
+            area = -area;
+        }
+
+        // Pixels whose center can be inside
+        Triangle tri;
+        tri.min_x = std::max(0, static_cast<int>(std::floor(std::min(v0.x, std::min(v1.x, v2.x)))));
+        tri.min_y = std::max(0, static_cast<int>(std::floor(std::min(v0.y, std::min(v1.y, v2.y)))));
+        tri.max_x = std::min(static_cast<int>(WIDTH) - 1, static_cast<int>(std::floor(std::max(v0.x, std::max(v1.x, v2.x)))));
+        tri.max_y = std::min(static_cast<int>(HEIGHT) - 1, static_cast<int>(std::floor(std::max(v0.y, std::max(v1.y, v2.y)))));
+        if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+            continue;
+
+        const glm::vec4 *v[3] = {&v0, &v1, &v2};
+        for (int e = 0; e < 3; e++) {
+            const glm::vec4 &a = *v[e];
+            const glm::vec4 &b = *v[(e + 1) % 3];
+            tri.edge_a[e] = a.y - b.y;
+            tri.edge_b[e] = b.x - a.x;
+            tri.edge_c[e] = -(tri.edge_a[e] * a.x + tri.edge_b[e] * a.y);
+        }
+
+        glm::vec3 d1 = glm::vec3(v1 - v0);
+        glm::vec3 d2 = glm::vec3(v2 - v0);
+        tri.z_a = (d1.z * d2.y - d2.z * d1.y) / area;
+        tri.z_b = (d2.z * d1.x - d1.z * d2.x) / area;
+        tri.z_c = v0.z - tri.z_a * v0.x - tri.z_b * v0.y;
+
+        uint32_t idx = static_cast<uint32_t>(m_triangles.size());
+        m_triangles.push_back(tri);
+        for (int ty = tri.min_y / static_cast<int>(TILE_HEIGHT); ty <= tri.max_y / static_cast<int>(TILE_HEIGHT); ty++)
+            for (int tx = tri.min_x / static_cast<int>(TILE_WIDTH); tx <= tri.max_x / static_cast<int>(TILE_WIDTH); tx++)
+                m_bins[ty * TILES_X + tx].push_back(idx);
+    }
+}
+
+void OcclusionRasterizer::rasterize() {
+    m_depth.resize(WIDTH * HEIGHT);
+
+    // Task t owns tiles t, t + task_count, ..., no two threads write the same lines
+    uint32_t task_count = std::min(TILE_COUNT, static_cast<uint32_t>(ThreadPool::get().size()));
+    std::vector<std::future<void>> tasks;
+    tasks.reserve(task_count);
+    for (uint32_t t = 0; t < task_count; t++) {
+        tasks.push_back(ThreadPool::get().submit([this, t, task_count]() {
+            for (uint32_t tile = t; tile < TILE_COUNT; tile += task_count)
+                rasterize_tile(tile);
+        }));
+    }
+
+    // Every task has to finish before the bins are touched again, even if one threw
+    std::exception_ptr error;
+    for (auto &task : tasks) {
+        try {
+            task.get();
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void OcclusionRasterizer::rasterize_tile(uint32_t tile) {
+    float *depth = &m_depth[tile * TILE_PIXELS];
+    std::fill(depth, depth + TILE_PIXELS, 1.f);
+
+    const int tile_x = static_cast<int>((tile % TILES_X) * TILE_WIDTH);
+    const int tile_y = static_cast<int>((tile / TILES_X) * TILE_HEIGHT);
+
+    for (uint32_t t : m_bins[tile]) {
+        const Triangle &tri = m_triangles[t];
+
+        // Starts on a lane boundary of the tile, the edge functions mask what is left of the triangle
+        int x0 = std::max(tri.min_x, tile_x);
+        x0 = tile_x + ((x0 - tile_x) / LANES) * LANES;
+        int x1 = std::min(tri.max_x, tile_x + static_cast<int>(TILE_WIDTH) - 1);
+        int y0 = std::max(tri.min_y, tile_y);
+        int y1 = std::min(tri.max_y, tile_y + static_cast<int>(TILE_HEIGHT) - 1);
+
+        for (int y = y0; y <= y1; y++) {
+            float py = static_cast<float>(y) + 0.5f;
+            float row_edge[3];
+            for (int e = 0; e < 3; e++)
+                row_edge[e] = tri.edge_b[e] * py + tri.edge_c[e];
+            float row_z = tri.z_b * py + tri.z_c;
+
+            float *row = depth + (y - tile_y) * static_cast<int>(TILE_WIDTH);
+            int x = x0;
+
+#if ENGINE_SIMD_AVX
+            const __m256 lane_offsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+            const __m256 zero = _mm256_setzero_ps();
+            for (; x <= x1; x += LANES) {
+                __m256 px = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), lane_offsets);
+
+                __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+                for (int e = 0; e < 3; e++) {
+                    __m256 edge = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri.edge_a[e]), px), _mm256_set1_ps(row_edge[e]));
+                    inside = _mm256_and_ps(inside, _mm256_cmp_ps(edge, zero, _CMP_GE_OQ));
+                }
+
+                __m256 z = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri.z_a), px), _mm256_set1_ps(row_z));
+                __m256 old = _mm256_loadu_ps(row + x - tile_x);
+                _mm256_storeu_ps(row + x - tile_x, _mm256_blendv_ps(old, _mm256_min_ps(old, z), inside));
+            }
+#elif ENGINE_SIMD_SSE
+            const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            const __m128 zero = _mm_setzero_ps();
+            for (; x <= x1; x += LANES) {
+                __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lane_offsets);
+
+                __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                for (int e = 0; e < 3; e++) {
+                    __m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.edge_a[e]), px), _mm_set1_ps(row_edge[e]));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(edge, zero));
+                }
+
+                // No blendv before SSE4.1
+                __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.z_a), px), _mm_set1_ps(row_z));
+                __m128 old = _mm_loadu_ps(row + x - tile_x);
+                __m128 nearer = _mm_min_ps(old, z);
+                _mm_storeu_ps(row + x - tile_x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+            }
+#endif
+
+            // Scalar (nothing left here with SIMD, the tile width is a multiple of the lane count)
+            for (; x <= x1; x++) {
+                float px = static_cast<float>(x) + 0.5f;
+                bool inside = true;
+                for (int e = 0; e < 3; e++)
+                    inside = inside && tri.edge_a[e] * px + row_edge[e] >= 0.f;
+                if (inside)
+                    row[x - tile_x] = std::min(row[x - tile_x], tri.z_a * px + row_z);
+            }
+        }
+    }
+
+    m_tile_max[tile] = *std::max_element(depth, depth + TILE_PIXELS);
+}
+
+bool OcclusionRasterizer::is_visible(const AABB &box) const {
+    if (m_triangles.empty() || !box.valid())
+        return true;
+
+    glm::vec2 screen_min(std::numeric_limits<float>::max());
+    glm::vec2 screen_max(-std::numeric_limits<float>::max());
+    float nearest = 1.f;
+    glm::vec3 c = box.center();
+    glm::vec3 e = box.extent();
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner = c + e * glm::vec3((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f);
+        glm::vec4 clip = m_view_proj * glm::vec4(corner, 1.f);
+        // Reaches in front of the near plane, the projected rect says nothing useful
+        if (clip.z < 0.f || clip.w <= 0.f)
+            return true;
+
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        glm::vec2 screen = to_screen(ndc);
+        screen_min = glm::min(screen_min, screen);
+        screen_max = glm::max(screen_max, screen);
+        nearest = std::min(nearest, ndc.z);
+    }
+
+    // Every pixel the rect touches, not only the ones with their center inside
+    int x0 = std::max(0, static_cast<int>(std::floor(screen_min.x)));
+    int y0 = std::max(0, static_cast<int>(std::floor(screen_min.y)));
+    int x1 = std::min(static_cast<int>(WIDTH) - 1, static_cast<int>(std::floor(screen_max.x)));
+    int y1 = std::min(static_cast<int>(HEIGHT) - 1, static_cast<int>(std::floor(screen_max.y)));
+    // Off screen, that is for the frustum test to decide
+    if (x0 > x1 || y0 > y1)
+        return true;
+
+    for (int ty = y0 / static_cast<int>(TILE_HEIGHT); ty <= y1 / static_cast<int>(TILE_HEIGHT); ty++) {
+        for (int tx = x0 / static_cast<int>(TILE_WIDTH); tx <= x1 / static_cast<int>(TILE_WIDTH); tx++) {
+            uint32_t tile = ty * TILES_X + tx;
+            // Everything in the tile is in front of the box
+            if (nearest > m_tile_max[tile])
+                continue;
+
+            const float *depth = &m_depth[tile * TILE_PIXELS];
+            int tile_x = tx * static_cast<int>(TILE_WIDTH);
+            int tile_y = ty * static_cast<int>(TILE_HEIGHT);
+            for (int y = std::max(y0, tile_y); y <= std::min(y1, tile_y + static_cast<int>(TILE_HEIGHT) - 1); y++) {
+                const float *row = depth + (y - tile_y) * static_cast<int>(TILE_WIDTH);
+                for (int x = std::max(x0, tile_x); x <= std::min(x1, tile_x + static_cast<int>(TILE_WIDTH) - 1); x++)
+                    if (nearest <= row[x - tile_x])
+                        return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+}
@@ -1,5 +1,6 @@
 #include <engine/pipeline_builder.h>
 #include <engine/renderer.h>
+#include <engine/profiler.h>
 
 namespace Engine {
 
@@ -9,6 +10,7 @@ PipelineData PipelineBuilder::build(Renderer &renderer) {
         m_vert_shader.get_shader_stage_create_info(),
         m_frag_shader.get_shader_stage_create_info()
     };
+    uint32_t stage_count = m_frag_shader.get_shader() != VK_NULL_HANDLE ? 2 : 1;
 
     // std::cout << "Creating dyn states\n";
     VkPipelineDynamicStateCreateInfo dynamic_states = get_dynamic_state_create_info();
@@ -17,7 +19,7 @@ PipelineData PipelineBuilder::build(Renderer &renderer) {
     // std::cout << "Creating inp assembly\n";
     VkPipelineInputAssemblyStateCreateInfo input_assembly = get_input_assembly_state_create_info();
     // std::cout << "Creating viewport state\n";
-    VkPipelineViewportStateCreateInfo viewport_state = get_viewport_state(VkExtent2D{1024, 1024}); // only for shadow maps anywats
+    VkPipelineViewportStateCreateInfo viewport_state = get_viewport_state(VkExtent2D{SHADOW_MAP_SIZE, SHADOW_MAP_SIZE}); // only without dynamic state, every pipeline sets its own now
     // std::cout << "Creating rast\n";
     VkPipelineRasterizationStateCreateInfo rasterizer = get_rasterizer_state();
     // std::cout << "Creating ms\n";
@@ -32,7 +34,7 @@ PipelineData PipelineBuilder::build(Renderer &renderer) {
     // std::cout << "Creating pci\n";
     VkGraphicsPipelineCreateInfo create_info{};
     create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    create_info.stageCount = 2;
+    create_info.stageCount = stage_count;
     create_info.pStages = shader_stages;
     create_info.pVertexInputState = &vertex_input_info;
     create_info.pInputAssemblyState = &input_assembly;
@@ -48,8 +50,16 @@ PipelineData PipelineBuilder::build(Renderer &renderer) {
     create_info.basePipelineHandle = VK_NULL_HANDLE;
     create_info.basePipelineIndex = -1;
 
+    VkPipelineRenderingCreateInfoKHR rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &m_rendering_color_format;
+    rendering_info.depthAttachmentFormat = m_rendering_depth_format;
+    if (m_dynamic_rendering)
+        create_info.pNext = &rendering_info;
+
     VkPipeline pipeline;
-    // std::cout << "Creating pipeline\n";
+    PROFILE_SCOPE("createGraphicsPipelines");
     if(renderer.m_dispatch.createGraphicsPipelines(VK_NULL_HANDLE, 1, &create_info, nullptr, &pipeline) != VK_SUCCESS)
         throw std::runtime_error("Could not create graphics pipeline!");
 
@@ -77,12 +87,18 @@ void PipelineBuilder::create_pipeline_layout(Renderer &device, std::vector<VkDes
 }
 
 void PipelineBuilder::set_shaders(Renderer &device, const std::string &vert_shader_filename, const std::string &frag_shader_filename) {
+    PROFILE_SCOPE("load_shaders");
     // std::cout << "Creating vertex shader\n";
     m_vert_shader.create_shader(device.m_dispatch, vert_shader_filename, VK_SHADER_STAGE_VERTEX_BIT);
     // std::cout << "Creating frag shader\n";
     m_frag_shader.create_shader(device.m_dispatch, frag_shader_filename, VK_SHADER_STAGE_FRAGMENT_BIT);
 }
 
+void PipelineBuilder::set_vertex_shader(Renderer &device, const std::string &vert_shader_filename) {
+    PROFILE_SCOPE("load_shaders");
+    m_vert_shader.create_shader(device.m_dispatch, vert_shader_filename, VK_SHADER_STAGE_VERTEX_BIT);
+}
+
 void PipelineBuilder::add_push_constants(uint32_t pc_size, uint32_t offset, VkShaderStageFlags shader_stage) {
     VkPushConstantRange push_constant;
 	push_constant.offset = offset;
@@ -93,7 +109,16 @@ void PipelineBuilder::add_push_constants(uint32_t pc_size, uint32_t offset, VkSh
 }
 
 
-void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swapchain, VkRenderPass old_render_pass) {
+void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swapchain, VkRenderPass old_render_pass, bool keep_contents) {
+    if (renderer.uses_dynamic_rendering()) {
+        m_dynamic_rendering = true;
+        m_rendering_color_format = swapchain.image_format;
+        m_rendering_depth_format = renderer.find_depth_format();
+        m_render_pass = VK_NULL_HANDLE;
+        m_unique_render_pass = false;
+        return;
+    }
+
     if (old_render_pass != VK_NULL_HANDLE) {
         m_render_pass = old_render_pass;
         m_unique_render_pass = false;
@@ -103,11 +128,11 @@ void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swap
     VkAttachmentDescription colorAttachment{};
     colorAttachment.format = swapchain.image_format;
     colorAttachment.samples = renderer.get_msaa_sample_count();
-    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    colorAttachment.loadOp = keep_contents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
     colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    colorAttachment.initialLayout = keep_contents ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
     colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
     VkAttachmentReference colorAttachmentRef{};
@@ -117,11 +142,12 @@ void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swap
     VkAttachmentDescription depth_attachment{};
     depth_attachment.format = renderer.find_depth_format();
     depth_attachment.samples = renderer.get_msaa_sample_count();
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    // The first pass keeps its depth for the depth pyramid and the second pass
+    depth_attachment.loadOp = keep_contents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = keep_contents ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
     depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.initialLayout = keep_contents ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
     depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     VkAttachmentReference depth_attachment_ref{};
@@ -149,13 +175,16 @@ void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swap
     subpass.pDepthStencilAttachment = &depth_attachment_ref;
     subpass.pResolveAttachments = &color_attachment_resolve_ref;
 
+    // Dependencies are part of render pass compatibility, so both variants use the one the second
+    // pass needs: wait for the attachment writes of the first
     VkSubpassDependency dependency{};
     dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
     dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
     std::vector<VkAttachmentDescription> attachments = {colorAttachment, depth_attachment, color_attachment_resolve};
 
@@ -173,17 +202,17 @@ void PipelineBuilder::create_render_pass(Renderer &renderer, vkb::Swapchain swap
     }
 }
 
-void PipelineBuilder::create_shadow_render_pass(Renderer &renderer) {
-    VkFormat depth_format = renderer.find_depth_format();
+void PipelineBuilder::create_shadow_render_pass(Renderer &renderer, bool keep_contents, uint32_t view_mask) {
+    VkFormat depth_format = renderer.get_shadow_format();
 
     VkAttachmentDescription depth_attachment{};
     depth_attachment.format = depth_format;
     depth_attachment.samples = m_enable_msaa ? renderer.get_msaa_sample_count(): VK_SAMPLE_COUNT_1_BIT;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear depth at beginning of the render pass
+    depth_attachment.loadOp = keep_contents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;	// Clear depth at beginning of the render pass
     depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;						// We will read from depth, so it's important to store the depth attachment results
     depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.initialLayout = keep_contents ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
     depth_attachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
     VkAttachmentReference depth_attachment_ref{};
@@ -225,6 +254,14 @@ void PipelineBuilder::create_shadow_render_pass(Renderer &renderer) {
     render_pass_info.dependencyCount = static_cast<uint32_t>(dependencies.size());
     render_pass_info.pDependencies = dependencies.data();
 
+    // Every view sees the same casters from a different light, nothing is correlated between them
+    VkRenderPassMultiviewCreateInfo multiview_info{};
+    multiview_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO;
+    multiview_info.subpassCount = 1;
+    multiview_info.pViewMasks = &view_mask;
+    if (view_mask != 0)
+        render_pass_info.pNext = &multiview_info;
+
     if (renderer.m_dispatch.createRenderPass(&render_pass_info, nullptr, &m_render_pass) != VK_SUCCESS) 
         throw std::runtime_error("failed to create shadow render pass!");
 } 
@@ -235,7 +272,7 @@ VkPipelineDepthStencilStateCreateInfo PipelineBuilder::get_depth_stencil_create_
     depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
     depth_stencil.depthTestEnable = m_enable_depth_test ? VK_TRUE : VK_FALSE;
     depth_stencil.depthWriteEnable = m_enable_depth_write ? VK_TRUE : VK_FALSE;
-    depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil.depthCompareOp = m_depth_compare_op;
     depth_stencil.depthBoundsTestEnable = VK_FALSE;
     depth_stencil.stencilTestEnable = VK_FALSE;
 
@@ -319,7 +356,7 @@ VkPipelineViewportStateCreateInfo PipelineBuilder::get_viewport_state(VkExtent2D
 VkPipelineRasterizationStateCreateInfo PipelineBuilder::get_rasterizer_state() {
     VkPipelineRasterizationStateCreateInfo rasterizer{};
     rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.depthClampEnable = m_enable_depth_clamp ? VK_TRUE : VK_FALSE;
     rasterizer.rasterizerDiscardEnable = VK_FALSE;
     rasterizer.polygonMode = m_polygon_mode;
     rasterizer.lineWidth = 1.f;
@@ -347,6 +384,8 @@ VkPipelineMultisampleStateCreateInfo PipelineBuilder::get_multisampling(VkSample
 VkPipelineColorBlendAttachmentState PipelineBuilder::get_color_blend_attachment() {
     VkPipelineColorBlendAttachmentState attachment{};
     attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    if (!m_enable_color_write)
+        attachment.colorWriteMask = 0;
 
     if(!m_enable_blending) {
         attachment.blendEnable = VK_FALSE;
@@ -0,0 +1,143 @@
+#include <engine/profiler.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+
+#include <fmt/format.h>
+
+namespace Engine {
+
+static thread_local uint32_t t_scope_depth = 0;
+
+Profiler& Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+
+uint32_t Profiler::current_thread_id() {
+    static std::atomic<uint32_t> next_id{0};
+    static thread_local uint32_t id = next_id++;
+    return id;
+}
+
+int64_t Profiler::now_us() {
+    auto elapsed = std::chrono::steady_clock::now() - m_session_start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void Profiler::record(std::string name, int64_t start_us, int64_t duration_us, uint32_t depth) {
+    ProfileEvent event{};
+    event.m_name = std::move(name);
+    event.m_thread_id = current_thread_id();
+    event.m_depth = depth;
+    event.m_start_us = start_us;
+    event.m_duration_us = duration_us;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(std::move(event));
+}
+
+void Profiler::record_since_start(std::string name) {
+    record(std::move(name), 0, now_us(), 0);
+}
+
+void Profiler::print_summary() {
+    std::vector<ProfileEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        events = m_events;
+    }
+
+    if (events.empty())
+        return;
+
+    // Parents start before (or with) their children, so sorting by start time gives the timeline order
+    std::stable_sort(events.begin(), events.end(), [](const ProfileEvent &a, const ProfileEvent &b) {
+        if (a.m_thread_id != b.m_thread_id)
+            return a.m_thread_id < b.m_thread_id;
+        if (a.m_start_us != b.m_start_us)
+            return a.m_start_us < b.m_start_us;
+        return a.m_depth < b.m_depth;
+    });
+
+    fmt::println("{:=<92}", "");
+    fmt::println("{:<60} {:>6} {:>12} {:>12}", "Stage", "Thread", "Start (ms)", "Time (ms)");
+    fmt::println("{:-<92}", "");
+
+    for (const ProfileEvent &event : events) {
+        std::string label = std::string(event.m_depth * 2, ' ') + event.m_name;
+        if (label.size() > 60)
+            label = label.substr(0, 57) + "...";
+
+        fmt::println("{:<60} {:>6} {:>12.3f} {:>12.3f}", label, event.m_thread_id,
+            event.m_start_us / 1000.0, event.m_duration_us / 1000.0);
+    }
+
+    fmt::println("{:=<92}", "");
+}
+
+static std::string escape_json(const std::string &str) {
+    std::string ret;
+    ret.reserve(str.size());
+
+    for (char c : str) {
+        switch (c) {
+            case '"': ret += "\\\""; break;
+            case '\\': ret += "\\\\"; break;
+            case '\n': ret += "\\n"; break;
+            case '\t': ret += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                    ret += fmt::format("\\u{:04x}", static_cast<int>(c));
+                else
+                    ret += c;
+        }
+    }
+
+    return ret;
+}
+
+void Profiler::write_chrome_trace(const std::string &filename) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        fmt::println("Could not open trace file: {}", filename);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    file << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < m_events.size(); i++) {
+        const ProfileEvent &event = m_events[i];
+        file << fmt::format("{{\"name\":\"{}\",\"cat\":\"engine\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{}}}",
+            escape_json(event.m_name), event.m_start_us, event.m_duration_us, event.m_thread_id);
+        file << (i + 1 < m_events.size() ? ",\n" : "\n");
+    }
+    file << "],\"displayTimeUnit\":\"ms\"}\n";
+
+    fmt::println("Wrote trace to {}", filename);
+}
+
+void Profiler::end_session() {
+    print_summary();
+
+    if (!m_trace_filename.empty())
+        write_chrome_trace(m_trace_filename);
+}
+
+ScopedTimer::ScopedTimer(std::string name): m_name(std::move(name)) {
+    m_depth = t_scope_depth++;
+    m_start_us = Profiler::get().now_us();
+}
+
+ScopedTimer::~ScopedTimer() {
+    Profiler &profiler = Profiler::get();
+    int64_t end_us = profiler.now_us();
+    t_scope_depth--;
+
+    profiler.record(std::move(m_name), m_start_us, end_us - m_start_us, m_depth);
+}
+
+}
@@ -4,30 +4,44 @@
 #include <engine/image.h>
 #include <engine/models.h>
 #include <engine/pipeline.h>
+#include <engine/profiler.h>
+#include <engine/thread_pool.h>
 
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 #include <fmt/format.h>
 
 namespace Engine {
 
 void Renderer::initialize_vulkan() {
-    // std::cout << "Creating window!\n";
-    m_window.init_window();
-    // std::cout << "Creating instancs!\n";
-    create_instance();
-    // std::cout << "Creating surface!\n";
-    create_surface();
-    // std::cout << "Creating phy dev!\n";
-    pick_physical_device();
-    // std::cout << "Creating log dev!\n";
-    create_logical_device();
-    // std::cout << "Creating swapchain!\n";
-    create_swapchains();
-    // create_pipeline();
-    m_shadow_pipeline = new ShadowPipeline();
-    m_shadow_pipeline->create_pipeline(*this, m_swapchain.image_format);
-
-    m_shadow_render_pass = m_shadow_pipeline->get_render_pass();
+    PROFILE_SCOPE("Renderer::initialize_vulkan");
+    {
+        PROFILE_SCOPE("init_window");
+        m_window.init_window();
+    }
+    {
+        PROFILE_SCOPE("create_instance");
+        create_instance();
+    }
+    {
+        PROFILE_SCOPE("create_surface");
+        create_surface();
+    }
+    {
+        PROFILE_SCOPE("pick_physical_device");
+        pick_physical_device();
+    }
+    {
+        PROFILE_SCOPE("create_logical_device");
+        create_logical_device();
+    }
+    {
+        PROFILE_SCOPE("create_swapchains");
+        create_swapchains();
+    }
+    // Scene buffers are uploaded through single time commands before initialize
+    create_command_pool();
 
     VkDescriptorSetLayoutBinding shadow_map_binding{};
     shadow_map_binding.binding = 0;
@@ -42,41 +56,93 @@ void Renderer::initialize_vulkan() {
 void Renderer::initialize(
     std::vector<Pipeline*> pipelines
 ) {
-    // std::cout << "setting pipelines window!\n";
+    PROFILE_SCOPE("Renderer::initialize");
     m_pipelines = pipelines;
 
-    create_command_pool();
+    create_secondary_command_pools();
 
-    create_color_resources();
-    create_depth_resources();
+    {
+        PROFILE_SCOPE("create_attachments");
+        create_color_resources();
+        create_depth_resources();
+    }
 
-    for(TextureImage &tex: m_textures)
-        Image::initialize_texture_image(*this, tex);
+    {
+        PROFILE_SCOPE("upload_textures");
+        for(TextureImage &tex: m_textures)
+            Image::initialize_texture_image(*this, tex);
 
-    for(TextureImageArray &tex: m_texture_arrays)
-        Image::initialize_texture_image_array(*this, tex);
+        for(TextureImageArray &tex: m_texture_arrays)
+            Image::initialize_texture_image_array(*this, tex);
+    }
     
-    initialize_lights();
-
-    // std::cout << "Creating desc pool!\n";
-    create_descriptor_pool();
-    // std::cout << "Creating desc set layout!\n";
-    create_descriptor_set_layout();
-    // std::cout << "Creating desc sets!\n";
-    create_descriptor_sets();
-
-    // std::cout << "Creating pipelines!\n";
-    for(Pipeline* pipeline: m_pipelines) {
-        pipeline->create_pipeline(*this, m_swapchain.image_format, m_render_pass);
+    // Light matrices of the multiview shadow pass, part of the layout like the scene's groups
+    if (use_multiview_shadows())
+        m_shadow_view_group = create_uniform_group<ShadowViews>(6, VK_SHADER_STAGE_VERTEX_BIT);
+
+    {
+        PROFILE_SCOPE("create_descriptors");
+        create_descriptor_pool();
+        create_descriptor_set_layout();
+    }
+
+    // Needs the descriptor set layout, the shadow shader reads the model matrices from the storage buffer
+    {
+        PROFILE_SCOPE("create_shadow_pipeline");
+        // D16 halves the bandwidth of the shadow passes, but every light samples the same image
+        bool low_precision = !m_lights.empty() && std::all_of(m_lights.begin(), m_lights.end(), [](const Light &light) { return light.low_precision_shadow; });
+        m_shadow_format = low_precision ? VK_FORMAT_D16_UNORM : find_depth_format();
+
+        m_shadow_pipeline = new ShadowPipeline();
+        m_shadow_pipeline->create_pipeline(*this, m_swapchain.image_format);
+        m_shadow_render_pass = m_shadow_pipeline->get_render_pass();
+
+        PipelineBuilder builder;
+        builder.create_shadow_render_pass(*this, true);
+        m_shadow_keep_render_pass = builder.get_render_pass();
+    }
+
+    {
+        PROFILE_SCOPE("initialize_lights");
+        initialize_lights();
+        if (use_multiview_shadows())
+            create_multiview_shadow_resources();
+    }
+
+    {
+        PROFILE_SCOPE("create_descriptor_sets");
+        create_descriptor_sets();
+    }
+
+    for(size_t i = 0; i < m_pipelines.size(); i++) {
+        PROFILE_SCOPE(fmt::format("create_pipeline[{}]", i));
+        m_pipelines[i]->create_pipeline(*this, m_swapchain.image_format, m_render_pass);
         m_render_pass = m_pipelines[0]->get_render_pass();
     }
 
-    // std::cout << "Creating fbs!\n";
-    create_framebuffers();
+    {
+        PROFILE_SCOPE("create_depth_prepass_pipeline");
+        m_depth_prepass_pipeline.create_pipeline(*this, m_swapchain.image_format, m_render_pass);
+    }
+
+    // Dynamic rendering gives the attachments when the pass begins
+    if (!m_dynamic_rendering) {
+        PipelineBuilder builder;
+        builder.create_render_pass(*this, m_swapchain, VK_NULL_HANDLE, true);
+        m_keep_contents_render_pass = builder.get_render_pass();
+
+        create_framebuffers();
+    }
 
-    create_command_buffer();
-    // std::cout << "Creating sos!\n";
+    {
+        PROFILE_SCOPE("create_depth_pyramid");
+        m_depth_pyramid.create_pipeline(*this);
+        m_depth_pyramid.create_images(*this, m_depth.m_image_view, m_swapchain.extent.width, m_swapchain.extent.height);
+    }
+
+    create_frame_command_pools();
     create_sync_objects();
+    create_query_pool();
 }
 
 bool Renderer::begin_frame(int &current_frame, uint32_t &image_index, VkCommandBuffer &out_buffer) {
@@ -88,6 +154,7 @@ bool Renderer::begin_frame(int &current_frame, uint32_t &image_index, VkCommandB
     
     // std::cout << "Waiting for fences\n";
     m_dispatch.waitForFences(1, &m_in_flight_fences[m_current_frame], VK_TRUE, UINT64_MAX);
+    read_pipeline_statistics(m_current_frame);
     
     // uint32_t image_idx;
     // std::cout << "acq image\n";
@@ -103,11 +170,13 @@ bool Renderer::begin_frame(int &current_frame, uint32_t &image_index, VkCommandB
 
     // std::cout << "reset fences\n";
     m_dispatch.resetFences(1, &m_in_flight_fences[m_current_frame]);
-    // std::cout << "reset cb\n";
-    m_dispatch.resetCommandBuffer(m_command_buffers[m_current_frame], 0);
+    // The fence covers everything recorded for this frame, so whole pools can go at once
+    reset_frame_command_pool(m_frame_pools[m_current_frame]);
+    for (uint32_t slot = 0; slot < m_secondary_slot_count; slot++)
+        reset_frame_command_pool(m_secondary_pools[m_current_frame * m_secondary_slot_count + slot]);
 
     // std::cout << "setting ob\n";
-    out_buffer = m_command_buffers[m_current_frame];
+    out_buffer = next_command_buffer(m_frame_pools[m_current_frame]);
     // std::cout << "current frame\n";
     current_frame = m_current_frame;
     // std::cout << "image index\n";
@@ -121,13 +190,20 @@ bool Renderer::begin_frame(int &current_frame, uint32_t &image_index, VkCommandB
     if (m_dispatch.beginCommandBuffer(out_buffer, &begin_info) != VK_SUCCESS)
         throw std::runtime_error("Failed to begin recording command buffer!");
 
+    m_recorder.begin(out_buffer);
+
     return true;
 }
 
-void Renderer::begin_render_pass(VkCommandBuffer &command_buffer, uint32_t image_index) {
+void Renderer::begin_render_pass(VkCommandBuffer &command_buffer, uint32_t image_index, VkSubpassContents contents, bool keep_contents) {
+    if (m_dynamic_rendering) {
+        begin_rendering(command_buffer, image_index, contents, keep_contents);
+        return;
+    }
+
     VkRenderPassBeginInfo render_pass_info{};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_info.renderPass = get_render_pass();
+    render_pass_info.renderPass = keep_contents ? m_keep_contents_render_pass : get_render_pass();
     render_pass_info.framebuffer = get_framebuffer(image_index);
     render_pass_info.renderArea.offset = {0, 0};
     render_pass_info.renderArea.extent = get_swapchain_extent();
@@ -139,18 +215,58 @@ void Renderer::begin_render_pass(VkCommandBuffer &command_buffer, uint32_t image
     render_pass_info.clearValueCount = static_cast<uint32_t>(clear_colors.size());
     render_pass_info.pClearValues = clear_colors.data();
 
-    m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, contents);
+}
+
+void Renderer::bind_pipeline_and_descriptors(CommandRecorder &recorder, int pipeline_idx, int current_frame) {
+    recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[pipeline_idx]->get_pipeline());
+    recorder.bind_descriptor_set(VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[pipeline_idx]->get_pipeline_layout(), 0, get_descriptor_set(current_frame));
+
+}
+
+void Renderer::bind_depth_prepass_pipeline(CommandRecorder &recorder, int current_frame) {
+    recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, m_depth_prepass_pipeline.get_pipeline());
+    recorder.bind_descriptor_set(VK_PIPELINE_BIND_POINT_GRAPHICS, m_depth_prepass_pipeline.get_pipeline_layout(), 0, get_descriptor_set(current_frame));
+}
+
+void Renderer::begin_pipeline_statistics(VkCommandBuffer command_buffer) {
+    if (!m_pipeline_statistics)
+        return;
+
+    m_dispatch.cmdResetQueryPool(command_buffer, m_statistics_query_pool, m_current_frame, 1);
+    m_dispatch.cmdBeginQuery(command_buffer, m_statistics_query_pool, m_current_frame, 0);
+    m_statistics_prepass[m_current_frame] = m_depth_prepass;
+    m_statistics_active = true;
+}
+
+void Renderer::end_pipeline_statistics(VkCommandBuffer command_buffer) {
+    if (!m_statistics_active)
+        return;
+
+    m_dispatch.cmdEndQuery(command_buffer, m_statistics_query_pool, m_current_frame);
+    m_statistics_recorded[m_current_frame] = true;
+    m_statistics_active = false;
 }
 
-void Renderer::bind_pipeline_and_descriptors(VkCommandBuffer &command_buffer, int pipeline_idx, int current_frame) {
-    m_dispatch.cmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[pipeline_idx]->get_pipeline());
+void Renderer::read_pipeline_statistics(int current_frame) {
+    if (!m_statistics_recorded[current_frame])
+        return;
+    m_statistics_recorded[current_frame] = false;
 
-    VkDescriptorSet cur_ds = get_descriptor_set(current_frame);
-    m_dispatch.cmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[pipeline_idx]->get_pipeline_layout(), 0, 1, &cur_ds, 0, nullptr);
+    // The fence was waited on, so no need to wait for the result
+    uint64_t invocations = 0;
+    if (m_dispatch.getQueryPoolResults(m_statistics_query_pool, current_frame, 1, sizeof(invocations), &invocations, sizeof(invocations), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
 
+    if (m_statistics_prepass[current_frame])
+        m_fragment_stats.with_prepass = invocations;
+    else
+        m_fragment_stats.without_prepass = invocations;
 }
 
-void Renderer::set_default_viewport_and_scissor(VkCommandBuffer &command_buffer) {
+void Renderer::set_default_viewport_and_scissor(CommandRecorder &recorder) {
+    VkCommandBuffer command_buffer = recorder.get_command_buffer();
+
     VkViewport viewport{};
     viewport.x = 0.f;
     viewport.y = 0.f;
@@ -166,8 +282,116 @@ void Renderer::set_default_viewport_and_scissor(VkCommandBuffer &command_buffer)
     m_dispatch.cmdSetScissor(command_buffer, 0, 1, &scissor);
 }
 
+void Renderer::begin_rendering(VkCommandBuffer command_buffer, uint32_t image_index, VkSubpassContents contents, bool keep_contents) {
+    VkImageView swapchain_view = m_swapchain_image_views[image_index];
+    // Render passes resolve even with one sample, dynamic rendering needs two or more
+    bool resolve = m_msaa_samples != VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    if (!keep_contents) {
+        // Everything starts out undefined like in the clearing render pass. The swapchain image
+        // stays a color attachment until the last pass of the frame ends
+        VkImageMemoryBarrier barriers[3]{};
+        uint32_t barrier_count = 0;
+        auto add_barrier = [&](VkImage image, VkImageAspectFlags aspect, VkImageLayout layout, VkAccessFlags access) {
+            VkImageMemoryBarrier &barrier = barriers[barrier_count++];
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = access & (VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+            barrier.dstAccessMask = access;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barrier.newLayout = layout;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = image;
+            barrier.subresourceRange = {aspect, 0, 1, 0, 1};
+        };
+        VkAccessFlags color_access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        VkAccessFlags depth_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        add_barrier(m_swapchain_images[image_index], VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, color_access);
+        if (resolve)
+            add_barrier(m_color_image.m_image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, color_access);
+        add_barrier(m_depth.m_image, VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, depth_access);
+
+        m_dispatch.cmdPipelineBarrier(command_buffer, stages, stages, 0, 0, nullptr, 0, nullptr, barrier_count, barriers);
+    } else {
+        // Same as the render pass dependency, wait for the attachment writes of the first pass
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        m_dispatch.cmdPipelineBarrier(command_buffer, stages, stages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    VkRenderingAttachmentInfoKHR color_attachment{};
+    color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    color_attachment.imageView = resolve ? m_color_image.m_image_view : swapchain_view;
+    color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    if (resolve) {
+        color_attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+        color_attachment.resolveImageView = swapchain_view;
+        color_attachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
+    color_attachment.loadOp = keep_contents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.clearValue.color = {{0.f, 0.f, 0.f, 1.f}};
+
+    // The first pass keeps its depth for the depth pyramid and the second pass
+    VkRenderingAttachmentInfoKHR depth_attachment{};
+    depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    depth_attachment.imageView = m_depth.m_image_view;
+    depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.loadOp = keep_contents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = keep_contents ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.clearValue.depthStencil = {1.f, 0};
+
+    VkRenderingInfoKHR rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+    if (contents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS)
+        rendering_info.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR;
+    rendering_info.renderArea.offset = {0, 0};
+    rendering_info.renderArea.extent = get_swapchain_extent();
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &color_attachment;
+    rendering_info.pDepthAttachment = &depth_attachment;
+
+    m_dispatch.cmdBeginRenderingKHR(command_buffer, &rendering_info);
+}
+
+void Renderer::end_rendering(VkCommandBuffer command_buffer, bool present) {
+    m_dispatch.cmdEndRenderingKHR(command_buffer);
+    if (!present)
+        return;
+
+    // The render pass did this with the resolve attachment's final layout
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = m_swapchain_images[m_current_image_index];
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void Renderer::end_render_pass(VkCommandBuffer command_buffer) {
+    if (m_dynamic_rendering)
+        end_rendering(command_buffer, false);
+    else
+        m_dispatch.cmdEndRenderPass(command_buffer);
+}
+
 void Renderer::end_render_pass_and_command_buffer(VkCommandBuffer command_buffer) {
-    m_dispatch.cmdEndRenderPass(command_buffer);
+    if (m_dynamic_rendering)
+        end_rendering(command_buffer, true);
+    else
+        m_dispatch.cmdEndRenderPass(command_buffer);
+    end_pipeline_statistics(command_buffer);
 
     if(m_dispatch.endCommandBuffer(command_buffer) != VK_SUCCESS)
         throw std::runtime_error("Failed to record command buffers!");
@@ -185,8 +409,10 @@ void Renderer::end_frame() {
     submit_info.pWaitSemaphores = wait_semaphores;
     submit_info.pWaitDstStageMask = wait_stages;
 
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &m_command_buffers[m_current_frame];
+    // Every primary handed out this frame, in allocation order
+    FrameCommandPool &frame_pool = m_frame_pools[m_current_frame];
+    submit_info.commandBufferCount = frame_pool.used;
+    submit_info.pCommandBuffers = frame_pool.buffers.data();
 
     VkSemaphore signal_semaphores[] = {m_render_finished_semaphores[m_current_frame]};
     submit_info.signalSemaphoreCount = 1;
@@ -223,8 +449,18 @@ void Renderer::cleanup() {
 
     m_shadow_map_image.cleanup(m_dispatch);
 
-    for(auto &light: m_lights)
-        light.cleanup(m_dispatch);
+    for (ShadowLayer &layer : m_shadow_layers) {
+        m_dispatch.destroyFramebuffer(layer.framebuffer, nullptr);
+        m_dispatch.destroyFramebuffer(layer.cache_framebuffer, nullptr);
+        m_dispatch.destroyImageView(layer.image_view, nullptr);
+        m_dispatch.destroyImageView(layer.cache_image_view, nullptr);
+    }
+    if (m_shadow_multiview_pipeline) {
+        m_dispatch.destroyFramebuffer(m_shadow_layers_framebuffer, nullptr);
+        m_dispatch.destroyFramebuffer(m_shadow_cache_layers_framebuffer, nullptr);
+        m_dispatch.destroyImageView(m_shadow_layers_view, nullptr);
+        m_dispatch.destroyImageView(m_shadow_cache_layers_view, nullptr);
+    }
     
     // std::cout << "Cleaning up swapchain!\n";
     cleanup_swapchain();
@@ -253,6 +489,10 @@ void Renderer::cleanup() {
 
     // std::cout << "Cleaning up cp\n";
     m_dispatch.destroyCommandPool(m_command_pool, nullptr);
+    for (FrameCommandPool &pool : m_frame_pools)
+        m_dispatch.destroyCommandPool(pool.pool, nullptr);
+    for (FrameCommandPool &pool : m_secondary_pools)
+        m_dispatch.destroyCommandPool(pool.pool, nullptr);
 
     // std::cout << "Cleaning up p\n";
     // destroy pipelines
@@ -260,6 +500,17 @@ void Renderer::cleanup() {
         destroy_pipeline(i);
 
     m_shadow_pipeline->destroy_pipeline(m_dispatch);
+    m_dispatch.destroyRenderPass(m_shadow_keep_render_pass, nullptr);
+    if (m_shadow_multiview_pipeline) {
+        m_shadow_multiview_pipeline->destroy_pipeline(m_dispatch);
+        m_dispatch.destroyRenderPass(m_shadow_multiview_keep_render_pass, nullptr);
+    }
+    m_depth_prepass_pipeline.destroy_pipeline(m_dispatch);
+    m_dispatch.destroyRenderPass(m_keep_contents_render_pass, nullptr);
+    if (m_statistics_query_pool != VK_NULL_HANDLE)
+        m_dispatch.destroyQueryPool(m_statistics_query_pool, nullptr);
+    for (ComputePipeline *pipeline : m_compute_pipelines)
+        pipeline->destroy_pipeline(m_dispatch);
 
     // std::cout << "Cleaning up dev\n";
     vkb::destroy_device(m_device);
@@ -339,6 +590,12 @@ size_t Renderer::create_storage_buffer(VkDeviceSize buffer_size) {
 }
 
 void Renderer::update_buffer(size_t buffer_idx, void* src_data, size_t src_data_size) {
+    auto mapped = m_mapped_buffers.find(buffer_idx);
+    if (mapped != m_mapped_buffers.end()) {
+        memcpy(mapped->second, src_data, src_data_size);
+        return;
+    }
+
     // VkBuffer &buffer = m_buffers[buffer_idx];
     VkDeviceMemory &buffer_memory = m_buffer_memories[buffer_idx];
     void* data;
@@ -348,6 +605,93 @@ void Renderer::update_buffer(size_t buffer_idx, void* src_data, size_t src_data_
     m_dispatch.unmapMemory(buffer_memory);
 }
 
+size_t Renderer::create_device_local_buffer(VkDeviceSize buffer_size, uint32_t usage) {
+    return create_buffer(buffer_size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+}
+
+void Renderer::upload_buffer(size_t buffer_idx, const void* src_data, size_t src_data_size) {
+    size_t staging_buffer_idx = create_buffer(src_data_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    update_buffer(staging_buffer_idx, const_cast<void*>(src_data), src_data_size);
+
+    m_dispatch.deviceWaitIdle();
+
+    VkCommandBuffer command_buffer = begin_single_time_command();
+    VkBufferCopy region{};
+    region.srcOffset = 0;
+    region.dstOffset = 0;
+    region.size = src_data_size;
+    m_dispatch.cmdCopyBuffer(command_buffer, m_buffers[staging_buffer_idx], m_buffers[buffer_idx], 1, &region);
+    end_single_time_command(command_buffer);
+
+    // The slot stays, only the Vulkan objects go
+    destroy_buffer(static_cast<int>(staging_buffer_idx));
+}
+
+size_t Renderer::create_static_storage_group(uint32_t binding, uint32_t size, VkShaderStageFlags stage_flags) {
+    if(binding == 0)
+        throw std::runtime_error("Binding 0 is reserved for teh shadowmap in the frag shader");
+
+    VkDescriptorSetLayoutBinding layout_binding{};
+    layout_binding.binding = binding;
+    layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layout_binding.descriptorCount = 1;
+    layout_binding.stageFlags = stage_flags;
+    layout_binding.pImmutableSamplers = nullptr;
+    add_descriptor_set_layout_binding(layout_binding, 0);
+
+    UniformBufferGroup new_ubg{};
+    new_ubg.m_base_index = create_device_local_buffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    new_ubg.m_binding = binding;
+    new_ubg.m_size = size;
+    new_ubg.m_per_frame = false;
+    new_ubg.m_staging_index = create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
+
+    m_uniforms.push_back(new_ubg);
+    return m_uniforms.size() - 1;
+}
+
+void Renderer::record_static_group_update(VkCommandBuffer command_buffer, int current_frame, size_t idx, const void* data) {
+    const UniformBufferGroup &group = m_uniforms[idx];
+    if (group.m_per_frame)
+        throw std::runtime_error("Only static groups are updated through staging");
+
+    // The frame's fence has been waited on, so its staging copy is free
+    size_t staging_idx = group.m_staging_index + current_frame;
+    memcpy(map_buffer(staging_idx), data, group.m_size);
+
+    // The other frame in flight may still read the group
+    VkPipelineStageFlags readers = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    m_dispatch.cmdPipelineBarrier(command_buffer, readers, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy region{};
+    region.size = group.m_size;
+    m_dispatch.cmdCopyBuffer(command_buffer, m_buffers[staging_idx], m_buffers[group.m_base_index], 1, &region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = m_buffers[group.m_base_index];
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, readers, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void* Renderer::map_buffer(size_t buffer_idx) {
+    auto mapped = m_mapped_buffers.find(buffer_idx);
+    if (mapped != m_mapped_buffers.end())
+        return mapped->second;
+
+    void* data;
+    if (m_dispatch.mapMemory(m_buffer_memories[buffer_idx], 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS)
+        throw std::runtime_error("Failed to map buffer memory!");
+
+    m_mapped_buffers[buffer_idx] = data;
+    return data;
+}
+
 void Renderer::destroy_buffer(int buffer_idx) {
     if(buffer_idx >= m_buffers.size())
         throw std::runtime_error("The index of the buffer is outside range of indices");
@@ -357,6 +701,11 @@ void Renderer::destroy_buffer(int buffer_idx) {
 
         m_dispatch.freeMemory(buffer_memory, nullptr);
         m_dispatch.destroyBuffer(buffer, nullptr);
+
+        // Cleanup goes over every slot again, destroying null handles is a no-op
+        buffer = VK_NULL_HANDLE;
+        buffer_memory = VK_NULL_HANDLE;
+        m_mapped_buffers.erase(buffer_idx);
 }
 
 VkCommandBuffer Renderer::begin_single_time_command() {
@@ -461,6 +810,45 @@ void Renderer::pick_physical_device() {
     m_physical_device = selector_ret.value();
     m_instance_dispatch.getPhysicalDeviceProperties(m_physical_device, &m_physical_device_properties);
 
+    // Optional, draws fall back to one indirect call per command without these
+    VkPhysicalDeviceFeatures optional_features{};
+    optional_features.multiDrawIndirect = VK_TRUE;
+    m_multi_draw_indirect = m_physical_device.enable_features_if_present(optional_features);
+
+    if (m_physical_device_properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceVulkan12Features features_12{};
+        features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        features_12.drawIndirectCount = VK_TRUE;
+        m_draw_indirect_count = m_physical_device.enable_extension_features_if_present(features_12);
+
+        // Core since 1.1, every light's shadow in one pass
+        VkPhysicalDeviceVulkan11Features features_11{};
+        features_11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+        features_11.multiview = VK_TRUE;
+        m_multiview = m_physical_device.enable_extension_features_if_present(features_11);
+
+        // Core in 1.3, the main passes go without render pass and framebuffer objects
+        VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features{};
+        dynamic_rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+        dynamic_rendering_features.dynamicRendering = VK_TRUE;
+        m_dynamic_rendering_supported = m_physical_device.enable_extension_if_present(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME) &&
+                                        m_physical_device.enable_extension_features_if_present(dynamic_rendering_features);
+        m_dynamic_rendering = m_dynamic_rendering_supported;
+    }
+
+    // Secondaries run inside the main pass query, so both are needed for the statistics
+    VkPhysicalDeviceFeatures query_features{};
+    query_features.pipelineStatisticsQuery = VK_TRUE;
+    query_features.inheritedQueries = VK_TRUE;
+    m_pipeline_statistics = m_physical_device.enable_features_if_present(query_features);
+
+    VkPhysicalDeviceFeatures clamp_features{};
+    clamp_features.depthClamp = VK_TRUE;
+    m_depth_clamp = m_physical_device.enable_features_if_present(clamp_features);
+
+    fmt::println("multiDrawIndirect: {}, drawIndirectCount: {}, pipeline statistics: {}, multiview: {}, dynamic rendering: {}",
+                 m_multi_draw_indirect, m_draw_indirect_count, m_pipeline_statistics, m_multiview, m_dynamic_rendering_supported);
+
     m_msaa_samples = get_max_usable_sample_count();
 }
 
@@ -472,6 +860,7 @@ void Renderer::create_logical_device() {
     
     m_device = builder_ret.value();
     m_dispatch = m_device.make_table();
+    m_recorder.init(&m_dispatch);
 
     auto graphics_queue_ret = m_device.get_queue(vkb::QueueType::graphics);
     if(!graphics_queue_ret)
@@ -547,24 +936,135 @@ void Renderer::create_framebuffers() {
 void Renderer::create_command_pool() {
     VkCommandPoolCreateInfo info{};
     info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
     info.queueFamilyIndex = m_graphics_queue_idx;
 
     if(m_dispatch.createCommandPool(&info, nullptr, &m_command_pool) != VK_SUCCESS) 
         throw std::runtime_error("Failed to create command pool");
 }
 
-void Renderer::create_command_buffer() {
-    m_command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+void Renderer::create_frame_command_pool(FrameCommandPool &pool, VkCommandBufferLevel level) {
+    VkCommandPoolCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    info.queueFamilyIndex = m_graphics_queue_idx;
+
+    if (m_dispatch.createCommandPool(&info, nullptr, &pool.pool) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create frame command pool");
+    pool.level = level;
+}
+
+void Renderer::reset_frame_command_pool(FrameCommandPool &pool) {
+    if (pool.used == 0)
+        return;
+    m_dispatch.resetCommandPool(pool.pool, 0);
+    pool.used = 0;
+}
+
+VkCommandBuffer Renderer::next_command_buffer(FrameCommandPool &pool) {
+    if (pool.used == pool.buffers.size()) {
+        VkCommandBufferAllocateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        info.commandPool = pool.pool;
+        info.level = pool.level;
+        info.commandBufferCount = 1;
+
+        VkCommandBuffer buffer;
+        if (m_dispatch.allocateCommandBuffers(&info, &buffer) != VK_SUCCESS)
+            throw std::runtime_error("Could not allocate command buffer");
+        pool.buffers.push_back(buffer);
+    }
+    return pool.buffers[pool.used++];
+}
+
+void Renderer::create_frame_command_pools() {
+    for (FrameCommandPool &pool : m_frame_pools)
+        create_frame_command_pool(pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+}
+
+void Renderer::create_secondary_command_pools() {
+    // Workers plus the main thread, more slots than that would never record at the same time
+    m_secondary_slot_count = static_cast<uint32_t>(ThreadPool::get().size()) + 1;
+    m_secondary_pools.resize(MAX_FRAMES_IN_FLIGHT * m_secondary_slot_count);
+
+    for (FrameCommandPool &pool : m_secondary_pools)
+        create_frame_command_pool(pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+}
 
-    VkCommandBufferAllocateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    info.commandPool = m_command_pool;
-    info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    info.commandBufferCount = static_cast<uint32_t>(m_command_buffers.size());
+VkCommandBuffer Renderer::begin_secondary(int current_frame, uint32_t slot, VkRenderPass render_pass, VkFramebuffer framebuffer, CommandRecorder &recorder) {
+    VkCommandBuffer command_buffer = next_command_buffer(m_secondary_pools[current_frame * m_secondary_slot_count + slot]);
 
-    if (m_dispatch.allocateCommandBuffers(&info, m_command_buffers.data()) != VK_SUCCESS) 
-        throw std::runtime_error("Could not allocate command buffer");
+    VkCommandBufferInheritanceInfo inheritance{};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = render_pass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = framebuffer;
+
+    // A main pass begun with dynamic rendering, the secondary only gets the attachment formats
+    VkFormat color_format = m_swapchain.image_format;
+    VkCommandBufferInheritanceRenderingInfoKHR rendering_inheritance{};
+    rendering_inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR;
+    rendering_inheritance.colorAttachmentCount = 1;
+    rendering_inheritance.pColorAttachmentFormats = &color_format;
+    rendering_inheritance.depthAttachmentFormat = m_depth_format;
+    rendering_inheritance.rasterizationSamples = m_msaa_samples;
+    if (render_pass == VK_NULL_HANDLE)
+        inheritance.pNext = &rendering_inheritance;
+    if (m_pipeline_statistics)
+        inheritance.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = &inheritance;
+
+    if (m_dispatch.beginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+        throw std::runtime_error("Failed to begin recording secondary command buffer!");
+
+    recorder.init(&m_dispatch);
+    recorder.begin(command_buffer);
+    return command_buffer;
+}
+
+void Renderer::record_secondaries(int current_frame, VkRenderPass render_pass, const std::vector<VkFramebuffer> &framebuffers,
+                                  const std::function<void(uint32_t, CommandRecorder&)> &record, std::vector<VkCommandBuffer> &out) {
+    uint32_t count = static_cast<uint32_t>(framebuffers.size());
+    out.resize(count);
+    if (count == 0)
+        return;
+
+    // Task t owns slot t, so no two threads ever touch the same pool
+    uint32_t task_count = std::min(count, m_secondary_slot_count);
+    std::vector<std::future<RecorderStats>> tasks;
+    tasks.reserve(task_count);
+    for (uint32_t t = 0; t < task_count; t++) {
+        tasks.push_back(ThreadPool::get().submit([&, t]() {
+            RecorderStats stats{};
+            for (uint32_t i = t; i < count; i += task_count) {
+                CommandRecorder recorder;
+                out[i] = begin_secondary(current_frame, t, render_pass, framebuffers[i], recorder);
+                record(i, recorder);
+
+                if (m_dispatch.endCommandBuffer(out[i]) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to record secondary command buffer!");
+                stats.issued += recorder.get_stats().issued;
+                stats.skipped += recorder.get_stats().skipped;
+            }
+            return stats;
+        }));
+    }
+
+    // Every task has to finish before anything they reference goes away, even if one threw
+    std::exception_ptr error;
+    for (auto &task : tasks) {
+        try {
+            m_recorder.add_stats(task.get());
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
 }
 
 void Renderer::copy_buffer_to_image(size_t buffer_idx, VkImage &image, uint32_t width, uint32_t height, uint32_t layer) {
@@ -613,13 +1113,18 @@ void Renderer::recreate_swap_chain() {
     create_swapchains();
     create_color_resources();
     create_depth_resources();
-    create_framebuffers();
+    // Nothing else to rebuild with dynamic rendering
+    if (!m_dynamic_rendering)
+        create_framebuffers();
+    m_depth_pyramid.create_images(*this, m_depth.m_image_view, m_swapchain.extent.width, m_swapchain.extent.height);
 }
 
 void Renderer::cleanup_swapchain() {
     for(auto framebuffer: m_swapchain_framebuffers)
         m_dispatch.destroyFramebuffer(framebuffer, nullptr);
+    m_swapchain_framebuffers.clear();
 
+    m_depth_pyramid.destroy_images(m_dispatch);
     m_depth.cleanup(m_dispatch);
     m_color_image.cleanup(m_dispatch);
     m_swapchain.destroy_image_views(m_swapchain_image_views);
@@ -683,12 +1188,12 @@ void Renderer::add_texture(std::string filename, uint32_t binding) {
     add_descriptor_set_layout_binding(texture_layout_binding, 0);
 }
 
-void Renderer::add_texture_array(std::vector<std::string> filename, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t binding) {
+void Renderer::add_texture_array(std::vector<std::string> filename, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t binding, std::vector<DecodedImage> decoded) {
     if(binding == 0)
         throw std::runtime_error("Binding 0 is reserved for teh shadowmap in the frag shader");
 
     TextureImageArray tex;
-    tex = Image::create_texture_image_array(filename, width, height, layer_count);
+    tex = Image::create_texture_image_array(filename, width, height, layer_count, std::move(decoded));
 
     m_texture_arrays.push_back(tex);
 
@@ -725,6 +1230,20 @@ void Renderer::create_sync_objects() {
     
 }
 
+void Renderer::create_query_pool() {
+    if (!m_pipeline_statistics)
+        return;
+
+    VkQueryPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    pool_info.queryCount = MAX_FRAMES_IN_FLIGHT;
+    pool_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+    if (m_dispatch.createQueryPool(&pool_info, nullptr, &m_statistics_query_pool) != VK_SUCCESS)
+        throw std::runtime_error("Could not create query pool!");
+}
+
 bool Renderer::window_should_close() {
     return m_window.window_should_close();
 }
@@ -864,6 +1383,9 @@ void Renderer::create_descriptor_sets() {
         std::vector<VkWriteDescriptorSet> descriptor_writes;
         std::vector<VkDescriptorBufferInfo> buffer_infos;
         std::vector<VkDescriptorImageInfo> image_infos;
+        // The writes point into these, so they must not reallocate
+        buffer_infos.reserve(m_descriptor_bindings.size());
+        image_infos.reserve(m_descriptor_bindings.size());
 
         size_t uniform_index = 0;
         size_t texture_index = 0;
@@ -880,7 +1402,7 @@ void Renderer::create_descriptor_sets() {
 
             if (binding.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER || binding.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
                 VkDescriptorBufferInfo buffer_info{};
-                buffer_info.buffer = m_buffers[m_uniforms[uniform_index].m_base_index + frame];
+                buffer_info.buffer = m_buffers[uniform_buffer_idx(uniform_index, static_cast<int>(frame))];
                 buffer_info.offset = 0;
                 buffer_info.range = m_uniforms[uniform_index].m_size;
 
@@ -946,11 +1468,14 @@ VkFormat Renderer::find_depth_format() {
 }
 
 void Renderer::create_depth_resources() {
-    m_depth = Image::create_depth_image(*this, m_swapchain.extent.width, m_swapchain.extent.height, find_depth_format());
+    m_depth_format = find_depth_format();
+    m_depth = Image::create_depth_image(*this, m_swapchain.extent.width, m_swapchain.extent.height, m_depth_format);
 }
 
 VkSampleCountFlagBits Renderer::get_max_usable_sample_count() {
-    VkSampleCountFlags counts = m_physical_device_properties.limits.framebufferColorSampleCounts & m_physical_device_properties.limits.framebufferDepthSampleCounts;
+    // The depth pyramid build samples the multisampled depth buffer. 4x is always in all three
+    VkSampleCountFlags counts = m_physical_device_properties.limits.framebufferColorSampleCounts & m_physical_device_properties.limits.framebufferDepthSampleCounts &
+                                m_physical_device_properties.limits.sampledImageDepthSampleCounts;
     
     if (counts & VK_SAMPLE_COUNT_64_BIT) return VK_SAMPLE_COUNT_64_BIT;
     if (counts & VK_SAMPLE_COUNT_32_BIT) return VK_SAMPLE_COUNT_32_BIT;
@@ -972,79 +1497,421 @@ void Renderer::create_color_resources() {
 // size_t Renderer::create_uniform_group(uint32_t binding, VkShaderStageFlags stage_flags)
 
 void Renderer::update_uniform_group(size_t idx, void* data) {
+    if (!m_uniforms[idx].m_per_frame) {
+        upload_buffer(m_uniforms[idx].m_base_index, data, m_uniforms[idx].m_size);
+        return;
+    }
+
     for(int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         update_buffer(m_uniforms[idx].m_base_index + i, data, m_uniforms[idx].m_size);
     }
 }
 
-int Renderer::add_light(glm::mat4 mvp, int type) {
+int Renderer::add_light(glm::mat4 mvp, int type, uint32_t shadow_resolution, bool low_precision_shadow) {
+    if (shadow_resolution < MIN_SHADOW_RESOLUTION || shadow_resolution > SHADOW_MAP_SIZE || (shadow_resolution & (shadow_resolution - 1)) != 0)
+        throw std::runtime_error("Shadow resolution has to be a power of two between 128 and 1024!");
+
     Light light{};
     light.mvp = mvp;
     light.type = type;
+    light.shadow_resolution = shadow_resolution;
+    light.low_precision_shadow = low_precision_shadow;
 
     m_lights.push_back(light);
 
     return static_cast<int>(m_lights.size()) - 1;
 }
 
+// Every other bit of a Morton code
+static uint32_t compact_bits(uint32_t v) {
+    v &= 0x55555555u;
+    v = (v | (v >> 1)) & 0x33333333u;
+    v = (v | (v >> 2)) & 0x0F0F0F0Fu;
+    v = (v | (v >> 4)) & 0x00FF00FFu;
+    v = (v | (v >> 8)) & 0x0000FFFFu;
+    return v;
+}
+
 void Renderer::initialize_lights() {
-    m_shadow_map_image = Image::create_shadow_map_image(*this, 1024, 1024, find_depth_format(), 32);
+    if (m_lights.size() > MAX_SHADOW_LIGHTS)
+        throw std::runtime_error("Too many lights for the shadow map image!");
+
+    m_shadow_map_image = Image::create_shadow_map_image(*this, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, m_shadow_format, SHADOW_MAP_LAYERS);
+
+    // Biggest squares first, each takes the next free spot of its size in Morton order. With power
+    // of two sizes that is always aligned, nothing overlaps and a layer is full before the next one
+    // is started. Multiview draws every light at the same place of its own layer
+    bool own_layers = use_multiview_shadows();
+    std::vector<uint32_t> order(m_lights.size());
+    for (uint32_t l = 0; l < order.size(); l++)
+        order[l] = l;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return m_lights[a].shadow_resolution > m_lights[b].shadow_resolution; });
+
+    const uint64_t layer_area = uint64_t(SHADOW_MAP_SIZE) * SHADOW_MAP_SIZE;
+    uint64_t cursor = 0;    // in texels, Morton order over the layers one after another
+    for (uint32_t l : order) {
+        Light &light = m_lights[l];
+        uint64_t area = uint64_t(light.shadow_resolution) * light.shadow_resolution;
+        uint64_t align = own_layers ? layer_area : area;
+        cursor = (cursor + align - 1) / align * align;
+
+        light.atlas_layer = static_cast<uint32_t>(cursor / layer_area);
+        uint32_t morton = static_cast<uint32_t>(cursor % layer_area);
+        light.atlas_offset = {static_cast<int32_t>(compact_bits(morton)), static_cast<int32_t>(compact_bits(morton >> 1))};
+        cursor += area;
+
+        if (light.atlas_layer >= m_shadow_layers.size())
+            m_shadow_layers.resize(light.atlas_layer + 1);
+        m_shadow_layers[light.atlas_layer].lights.push_back(l);
+    }
 
-    for (uint32_t i = 0; i < m_lights.size(); ++i) {
+    auto create_layer = [&](uint32_t layer, VkImageView &image_view, VkFramebuffer &framebuffer) {
         VkImageViewCreateInfo view_info{};
         view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         view_info.image = m_shadow_map_image.m_image;
         view_info.viewType = VK_IMAGE_VIEW_TYPE_2D; // single layer view
-        view_info.format = find_depth_format();
+        view_info.format = m_shadow_format;
         view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
         view_info.subresourceRange.baseMipLevel = 0;
         view_info.subresourceRange.levelCount = 1;
-        view_info.subresourceRange.baseArrayLayer = i;  // one layer at a time
+        view_info.subresourceRange.baseArrayLayer = layer;  // one layer at a time
         view_info.subresourceRange.layerCount = 1;
 
-        if (m_dispatch.createImageView(&view_info, nullptr, &m_lights[i].image_view) != VK_SUCCESS)
+        if (m_dispatch.createImageView(&view_info, nullptr, &image_view) != VK_SUCCESS)
             throw std::runtime_error("Failed to create per-layer image view!");
 
-        // m_lights[i].image_view = m_shadow_map_image.m_image_view;
-
-    // for(int i = 0; i < m_lights.size(); i++) {
         std::vector<VkImageView> attachments = {
-            m_lights[i].image_view
+            image_view
         };
-        
+
+        // Both shadow render passes are compatible, one framebuffer works with either
         VkFramebufferCreateInfo info{};
         info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
         info.renderPass = m_shadow_pipeline->get_render_pass();
         info.attachmentCount = static_cast<uint32_t>(attachments.size());
         info.pAttachments = attachments.data();
-        info.width = 1024;
-        info.height = 1024;
+        info.width = SHADOW_MAP_SIZE;
+        info.height = SHADOW_MAP_SIZE;
         info.layers = 1;
-        
-        if(m_dispatch.createFramebuffer(&info, nullptr, &m_lights[i].framebuffer) != VK_SUCCESS)
-            throw std::runtime_error("Failed to create a framebuffer!");        
+
+        if(m_dispatch.createFramebuffer(&info, nullptr, &framebuffer) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create a framebuffer!");
+    };
+
+    for (uint32_t i = 0; i < m_shadow_layers.size(); ++i) {
+        create_layer(i, m_shadow_layers[i].image_view, m_shadow_layers[i].framebuffer);
+        create_layer(MAX_SHADOW_LIGHTS + i, m_shadow_layers[i].cache_image_view, m_shadow_layers[i].cache_framebuffer);
     }
 }
 
-void Renderer::render_shadow_maps(VkCommandBuffer command_buffer, std::vector<Engine::Model> &models) {
-    if (m_lights.empty()) return;
+glm::vec4 Renderer::get_shadow_atlas_rect(uint32_t light) const {
+    const Light &l = m_lights[light];
+    float size = static_cast<float>(SHADOW_MAP_SIZE);
+    return glm::vec4(l.atlas_offset.x / size, l.atlas_offset.y / size, l.shadow_resolution / size, static_cast<float>(l.atlas_layer));
+}
+
+bool Renderer::use_multiview_shadows() const {
+    if (!m_multiview || m_lights.empty() || m_lights.size() > MAX_MULTIVIEW_SHADOW_LIGHTS)
+        return false;
+
+    // The views share one viewport, every light has its own layer and the square at the same place
+    for (const Light &light : m_lights)
+        if (light.shadow_resolution != m_lights[0].shadow_resolution)
+            return false;
+    return true;
+}
+
+void Renderer::create_multiview_shadow_resources() {
+    uint32_t light_count = static_cast<uint32_t>(m_lights.size());
+    uint32_t view_mask = (1u << light_count) - 1;
+
+    m_shadow_multiview_pipeline = new ShadowPipeline(view_mask);
+    m_shadow_multiview_pipeline->create_pipeline(*this, m_swapchain.image_format);
+
+    PipelineBuilder builder;
+    builder.create_shadow_render_pass(*this, true, view_mask);
+    m_shadow_multiview_keep_render_pass = builder.get_render_pass();
+
+    // View i of the pass draws into layer i of the attachment, so the lights and the caches are
+    // each one array view
+    auto create_layers = [&](uint32_t first_layer, VkImageView &image_view, VkFramebuffer &framebuffer) {
+        VkImageViewCreateInfo view_info{};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = m_shadow_map_image.m_image;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+        view_info.format = m_shadow_format;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = first_layer;
+        view_info.subresourceRange.layerCount = light_count;
 
-    // VkFormat depth_format = find_depth_format();
+        if (m_dispatch.createImageView(&view_info, nullptr, &image_view) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create the multiview shadow image view!");
 
-    // Image::transition_image_layout(*this, m_shadow_map_image.m_image, depth_format, 
-    //     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL , VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1, command_buffer);
+        // Multiview framebuffers have a single layer, the views pick theirs
+        VkFramebufferCreateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        info.renderPass = m_shadow_multiview_pipeline->get_render_pass();
+        info.attachmentCount = 1;
+        info.pAttachments = &image_view;
+        info.width = SHADOW_MAP_SIZE;
+        info.height = SHADOW_MAP_SIZE;
+        info.layers = 1;
 
-    struct LightModel {
-        glm::mat4 mvp;
-        glm::mat4 model;
+        if(m_dispatch.createFramebuffer(&info, nullptr, &framebuffer) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create the multiview shadow framebuffer!");
     };
 
+    create_layers(0, m_shadow_layers_view, m_shadow_layers_framebuffer);
+    create_layers(MAX_SHADOW_LIGHTS, m_shadow_cache_layers_view, m_shadow_cache_layers_framebuffer);
+}
+
+void Renderer::bind_geometry_buffers(CommandRecorder &recorder) {
+    recorder.bind_vertex_buffer(get_buffer(m_vertex_buffer_idx));
+    recorder.bind_index_buffer(get_buffer(m_index_buffer_idx), 0, VK_INDEX_TYPE_UINT32);
+}
+
+void Renderer::create_indirect_buffers(uint32_t section_count, uint32_t max_draws) {
+    m_indirect_section_count = section_count;
+    m_indirect_section_size = max_draws > 0 ? max_draws : 1;
+    m_indirect_draw_counts.assign(section_count * MAX_FRAMES_IN_FLIGHT, 0);
+
+    uint32_t usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    uint32_t memory_props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    VkDeviceSize commands_size = sizeof(VkDrawIndexedIndirectCommand) * m_indirect_section_size * section_count;
+    m_indirect_buffer_idx = create_buffer(commands_size, usage, memory_props, true);
+    m_indirect_count_buffer_idx = create_buffer(sizeof(uint32_t) * section_count, usage, memory_props, true);
+
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+        map_buffer(m_indirect_buffer_idx + frame);
+        memset(map_buffer(m_indirect_count_buffer_idx + frame), 0, sizeof(uint32_t) * section_count);
+    }
+}
+
+VkDrawIndexedIndirectCommand* Renderer::get_indirect_commands(int current_frame, uint32_t section) {
+    auto *commands = static_cast<VkDrawIndexedIndirectCommand*>(map_buffer(m_indirect_buffer_idx + current_frame));
+    return commands + section * m_indirect_section_size;
+}
+
+void Renderer::set_indirect_draw_count(int current_frame, uint32_t section, uint32_t count) {
+    if (count > m_indirect_section_size)
+        throw std::runtime_error("Too many draws for the indirect buffer section!");
+
+    m_indirect_draw_counts[current_frame * m_indirect_section_count + section] = count;
+    static_cast<uint32_t*>(map_buffer(m_indirect_count_buffer_idx + current_frame))[section] = count;
+}
+
+void Renderer::draw_indirect(CommandRecorder &recorder, int current_frame, uint32_t section) {
+    uint32_t count = m_indirect_draw_counts[current_frame * m_indirect_section_count + section];
+    if (count == 0)
+        return;
+
+    VkBuffer buffer = get_buffer(m_indirect_buffer_idx + current_frame);
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    VkDeviceSize offset = VkDeviceSize(section) * m_indirect_section_size * stride;
+
+    if (m_draw_indirect_count) {
+        VkBuffer count_buffer = get_buffer(m_indirect_count_buffer_idx + current_frame);
+        recorder.draw_indexed_indirect_count(buffer, offset, count_buffer, sizeof(uint32_t) * section, m_indirect_section_size, stride);
+    } else if (m_multi_draw_indirect) {
+        // drawCount is capped by maxDrawIndirectCount
+        uint32_t max_count = m_physical_device_properties.limits.maxDrawIndirectCount;
+        for (uint32_t first = 0; first < count; first += max_count) {
+            uint32_t batch = std::min(max_count, count - first);
+            recorder.draw_indexed_indirect(buffer, offset + VkDeviceSize(first) * stride, batch, stride);
+        }
+    } else {
+        for (uint32_t i = 0; i < count; i++)
+            recorder.draw_indexed_indirect(buffer, offset + VkDeviceSize(i) * stride, 1, stride);
+    }
+}
+
+bool Renderer::light_cache_valid(uint32_t light, uint32_t static_version) const {
+    const Light &l = m_lights[light];
+    return l.cache_valid && l.cached_static_version == static_version && l.cached_mvp == l.mvp;
+}
+
+bool Renderer::shadow_cache_valid(uint32_t light, uint32_t static_version) const {
+    // The whole cache layer is cleared when it is redrawn, skipped lights are just dropped from it
+    for (uint32_t l : m_shadow_layers[m_lights[light].atlas_layer].lights) {
+        if (l != light && m_lights[l].skip_shadow_pass)
+            continue;
+        if (!light_cache_valid(l, static_version))
+            return false;
+    }
+    return true;
+}
+
+bool Renderer::shadow_caches_valid(uint32_t static_version) const {
+    for (uint32_t l = 0; l < m_lights.size(); l++)
+        if (!m_lights[l].skip_shadow_pass && !light_cache_valid(l, static_version))
+            return false;
+    return true;
+}
+
+void Renderer::set_shadow_viewport(CommandRecorder &recorder, const Light &light) {
+    VkViewport viewport{};
+    viewport.x = static_cast<float>(light.atlas_offset.x);
+    viewport.y = static_cast<float>(light.atlas_offset.y);
+    viewport.width = static_cast<float>(light.shadow_resolution);
+    viewport.height = static_cast<float>(light.shadow_resolution);
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+    m_dispatch.cmdSetViewport(recorder.get_command_buffer(), 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.offset = light.atlas_offset;
+    scissor.extent = VkExtent2D{light.shadow_resolution, light.shadow_resolution};
+    m_dispatch.cmdSetScissor(recorder.get_command_buffer(), 0, 1, &scissor);
+}
+
+void Renderer::record_shadow_pass(CommandRecorder &recorder, int current_frame, uint32_t light, uint32_t section) {
+    recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_pipeline->get_pipeline());
+    recorder.bind_descriptor_set(VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_pipeline->get_pipeline_layout(), 0, get_descriptor_set(current_frame));
+    bind_geometry_buffers(recorder);
+    set_shadow_viewport(recorder, m_lights[light]);
+
+    recorder.push_constants(m_shadow_pipeline->get_pipeline_layout(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &m_lights[light].mvp);
+    draw_indirect(recorder, current_frame, section);
+}
+
+void Renderer::copy_shadow_caches(VkCommandBuffer command_buffer, const std::vector<uint32_t> &lights) {
+    if (lights.empty())
+        return;
+
+    // Lights can share a layer, each layer is transitioned once and each light copies its square
+    m_shadow_copy_layers.clear();
+    for (uint32_t l : lights)
+        m_shadow_copy_layers.push_back(m_lights[l].atlas_layer);
+    std::sort(m_shadow_copy_layers.begin(), m_shadow_copy_layers.end());
+    m_shadow_copy_layers.erase(std::unique(m_shadow_copy_layers.begin(), m_shadow_copy_layers.end()), m_shadow_copy_layers.end());
+
+    // Cache layers were written by a shadow pass (maybe this frame), the light layers were sampled
+    // by the last main pass. Squares of skipped lights in the same layer have to stay
+    m_shadow_barriers.resize(2 * m_shadow_copy_layers.size());
+    for (size_t i = 0; i < m_shadow_copy_layers.size(); i++) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = m_shadow_map_image.m_image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.layerCount = 1;
+
+        barrier.subresourceRange.baseArrayLayer = MAX_SHADOW_LIGHTS + m_shadow_copy_layers[i];
+        barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        m_shadow_barriers[2 * i] = barrier;
+
+        barrier.subresourceRange.baseArrayLayer = m_shadow_copy_layers[i];
+        barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        m_shadow_barriers[2 * i + 1] = barrier;
+    }
+
+    m_shadow_copies.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        const Light &light = m_lights[lights[i]];
+        VkImageCopy &region = m_shadow_copies[i];
+        region = VkImageCopy{};
+        region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        region.srcSubresource.mipLevel = 0;
+        region.srcSubresource.baseArrayLayer = MAX_SHADOW_LIGHTS + light.atlas_layer;
+        region.srcSubresource.layerCount = 1;
+        region.dstSubresource = region.srcSubresource;
+        region.dstSubresource.baseArrayLayer = light.atlas_layer;
+        region.srcOffset = {light.atlas_offset.x, light.atlas_offset.y, 0};
+        region.dstOffset = region.srcOffset;
+        region.extent = {light.shadow_resolution, light.shadow_resolution, 1};
+    }
+    uint32_t barrier_count = static_cast<uint32_t>(m_shadow_barriers.size());
+    m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                  0, 0, nullptr, 0, nullptr, barrier_count, m_shadow_barriers.data());
+
+    m_dispatch.cmdCopyImage(command_buffer, m_shadow_map_image.m_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                            m_shadow_map_image.m_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(m_shadow_copies.size()), m_shadow_copies.data());
+
+    // Caches go back to where a shadow pass leaves them, the light layers get the dynamic casters on top
+    for (size_t i = 0; i < m_shadow_copy_layers.size(); i++) {
+        VkImageMemoryBarrier &cache = m_shadow_barriers[2 * i];
+        cache.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        cache.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        cache.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        cache.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+        VkImageMemoryBarrier &layer = m_shadow_barriers[2 * i + 1];
+        layer.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        layer.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        layer.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        layer.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    }
+    m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                  0, 0, nullptr, 0, nullptr, barrier_count, m_shadow_barriers.data());
+}
+
+void Renderer::render_shadow_maps(VkCommandBuffer command_buffer, int current_frame, uint32_t first_section, uint32_t static_version) {
+    if (m_lights.empty()) return;
+
+    if (use_multiview_shadows()) {
+        render_multiview_shadow_maps(command_buffer, current_frame, first_section, static_version);
+        return;
+    }
+
+    // One pass per atlas layer draws all of its lights, each into its own viewport. A layer whose
+    // cache is stale for any light redraws the static casters of all of them, skipped lights wait
+    // with that until they are needed again
+    m_active_shadow_lights.clear();
+    m_active_shadow_layers.clear();
+    m_stale_shadow_layers.clear();
+    m_shadow_framebuffers.clear();
+    for (uint32_t i = 0; i < m_shadow_layers.size(); i++) {
+        bool active = false, stale = false;
+        for (uint32_t l : m_shadow_layers[i].lights) {
+            if (m_lights[l].skip_shadow_pass)
+                continue;
+            active = true;
+            stale = stale || !light_cache_valid(l, static_version);
+            m_active_shadow_lights.push_back(l);
+        }
+        if (active)
+            m_active_shadow_layers.push_back(i);
+        if (stale) {
+            m_stale_shadow_layers.push_back(i);
+            m_shadow_framebuffers.push_back(m_shadow_layers[i].cache_framebuffer);
+        }
+    }
+
+    // Each pass is its own secondary, recorded in parallel then executed in layer order
+    record_secondaries(current_frame, m_shadow_render_pass, m_shadow_framebuffers, [&](uint32_t i, CommandRecorder &recorder) {
+        for (uint32_t l : m_shadow_layers[m_stale_shadow_layers[i]].lights)
+            if (!m_lights[l].skip_shadow_pass)
+                record_shadow_pass(recorder, current_frame, l, first_section + 2 * l);
+    }, m_shadow_cache_secondaries);
+
+    m_shadow_framebuffers.resize(m_active_shadow_layers.size());
+    for (size_t i = 0; i < m_active_shadow_layers.size(); i++)
+        m_shadow_framebuffers[i] = m_shadow_layers[m_active_shadow_layers[i]].framebuffer;
+
+    record_secondaries(current_frame, m_shadow_keep_render_pass, m_shadow_framebuffers, [&](uint32_t i, CommandRecorder &recorder) {
+        for (uint32_t l : m_shadow_layers[m_active_shadow_layers[i]].lights)
+            if (!m_lights[l].skip_shadow_pass)
+                record_shadow_pass(recorder, current_frame, l, first_section + 2 * l + 1);
+    }, m_shadow_secondaries);
+
     VkRenderPassBeginInfo render_pass_info{};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_info.renderPass = m_shadow_render_pass;
     render_pass_info.framebuffer = VK_NULL_HANDLE;
     render_pass_info.renderArea.offset = {0, 0};
-    render_pass_info.renderArea.extent = VkExtent2D{1024, 1024};
+    render_pass_info.renderArea.extent = VkExtent2D{SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
 
     std::vector<VkClearValue> clear_colors(1);
     clear_colors[0].depthStencil = {1.f, 0};
@@ -1052,39 +1919,144 @@ void Renderer::render_shadow_maps(VkCommandBuffer command_buffer, std::vector<En
     render_pass_info.clearValueCount = static_cast<uint32_t>(clear_colors.size());
     render_pass_info.pClearValues = clear_colors.data();
 
-    for (Light& light : m_lights) {
-        render_pass_info.framebuffer = light.framebuffer;
+    for (uint32_t i = 0; i < m_stale_shadow_layers.size(); i++) {
+        ShadowLayer &layer = m_shadow_layers[m_stale_shadow_layers[i]];
+        render_pass_info.framebuffer = layer.cache_framebuffer;
 
-        m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-        m_dispatch.cmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_pipeline->get_pipeline());        
-        
-        LightModel lm{};
-        lm.mvp = light.mvp;
-
-        for (const Engine::Model &model : models) {
-            // Retreive vertex and index buffers =============================================================
-            VkBuffer vertex_buffers[] = {get_buffer(model.vertex_buffer_idx)};
-            VkDeviceSize offsets[] = {0};
-            VkBuffer index_buffer = get_buffer(model.index_buffer_idx);
-            
-            // Bind vertex and index buffers
-            m_dispatch.cmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
-            m_dispatch.cmdBindIndexBuffer(command_buffer, index_buffer, 0, VK_INDEX_TYPE_UINT32);
-
-            // Set push constants ============================================================================
-            lm.model = model.model_matrix;
-            m_dispatch.cmdPushConstants(command_buffer, m_shadow_pipeline->get_pipeline_layout(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(LightModel), &lm);
-            
-            // draw call
-            m_dispatch.cmdDrawIndexed(command_buffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+        m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        m_dispatch.cmdExecuteCommands(command_buffer, 1, &m_shadow_cache_secondaries[i]);
+        m_dispatch.cmdEndRenderPass(command_buffer);
+
+        for (uint32_t l : layer.lights) {
+            Light &light = m_lights[l];
+            light.cache_valid = !light.skip_shadow_pass;
+            light.cached_mvp = light.mvp;
+            light.cached_static_version = static_version;
         }
+    }
+
+    copy_shadow_caches(command_buffer, m_active_shadow_lights);
 
+    // Dynamic casters on top of the copies
+    render_pass_info.renderPass = m_shadow_keep_render_pass;
+    render_pass_info.clearValueCount = 0;
+    render_pass_info.pClearValues = nullptr;
+    for (uint32_t i = 0; i < m_active_shadow_layers.size(); i++) {
+        render_pass_info.framebuffer = m_shadow_layers[m_active_shadow_layers[i]].framebuffer;
+
+        m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        m_dispatch.cmdExecuteCommands(command_buffer, 1, &m_shadow_secondaries[i]);
         m_dispatch.cmdEndRenderPass(command_buffer);
     }
+}
+
+void Renderer::render_multiview_shadow_maps(VkCommandBuffer command_buffer, int current_frame, uint32_t first_section, uint32_t static_version) {
+    // Skipped lights are views that draw nothing, see shadow_multiview.vert
+    ShadowViews views{};
+    uint32_t active_views = 0;
+    m_active_shadow_lights.clear();
+    m_skipped_shadow_lights.clear();
+    for (uint32_t l = 0; l < m_lights.size(); l++) {
+        views.light_pv[l] = m_lights[l].mvp;
+        if (m_lights[l].skip_shadow_pass) {
+            m_skipped_shadow_lights.push_back(l);
+            continue;
+        }
+        active_views |= 1u << l;
+        m_active_shadow_lights.push_back(l);
+    }
+    if (active_views == 0)
+        return;
+
+    memcpy(map_uniform_group(m_shadow_view_group, current_frame), &views, sizeof(views));
+    bool redraw_caches = !shadow_caches_valid(static_version);
+
+    auto record_pass = [&](CommandRecorder &recorder, uint32_t section) {
+        VkPipelineLayout layout = m_shadow_multiview_pipeline->get_pipeline_layout();
+        recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_multiview_pipeline->get_pipeline());
+        recorder.bind_descriptor_set(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, get_descriptor_set(current_frame));
+        bind_geometry_buffers(recorder);
+        // Every light's square is at the same place of its layer
+        set_shadow_viewport(recorder, m_lights[0]);
+
+        recorder.push_constants(layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(uint32_t), &active_views);
+        draw_indirect(recorder, current_frame, section);
+    };
 
-    // std::cout << "trans image from VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL to  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL\n";
-    // Image::transition_image_layout(*this, m_shadow_map_image.m_image, depth_format, 
-    //     VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1, command_buffer);
+    m_shadow_framebuffers.clear();
+    if (redraw_caches)
+        m_shadow_framebuffers.push_back(m_shadow_cache_layers_framebuffer);
+    record_secondaries(current_frame, m_shadow_multiview_pipeline->get_render_pass(), m_shadow_framebuffers, [&](uint32_t, CommandRecorder &recorder) {
+        record_pass(recorder, first_section);
+    }, m_shadow_cache_secondaries);
+
+    m_shadow_framebuffers.assign(1, m_shadow_layers_framebuffer);
+    record_secondaries(current_frame, m_shadow_multiview_keep_render_pass, m_shadow_framebuffers, [&](uint32_t, CommandRecorder &recorder) {
+        record_pass(recorder, first_section + 1);
+    }, m_shadow_secondaries);
+
+    VkClearValue clear_value{};
+    clear_value.depthStencil = {1.f, 0};
+
+    VkRenderPassBeginInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderArea.offset = {0, 0};
+    render_pass_info.renderArea.extent = VkExtent2D{SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
+
+    if (redraw_caches) {
+        render_pass_info.renderPass = m_shadow_multiview_pipeline->get_render_pass();
+        render_pass_info.framebuffer = m_shadow_cache_layers_framebuffer;
+        render_pass_info.clearValueCount = 1;
+        render_pass_info.pClearValues = &clear_value;
+
+        m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        m_dispatch.cmdExecuteCommands(command_buffer, 1, &m_shadow_cache_secondaries[0]);
+        m_dispatch.cmdEndRenderPass(command_buffer);
+
+        // The clear reached every view, the caches of skipped lights are empty now
+        for (uint32_t l : m_active_shadow_lights) {
+            m_lights[l].cached_mvp = m_lights[l].mvp;
+            m_lights[l].cached_static_version = static_version;
+            m_lights[l].cache_valid = true;
+        }
+        for (uint32_t l : m_skipped_shadow_lights)
+            m_lights[l].cache_valid = false;
+    }
+
+    // The keep pass loads every view, layers of skipped lights only change layout and keep their contents
+    if (!m_skipped_shadow_lights.empty()) {
+        m_shadow_barriers.resize(m_skipped_shadow_lights.size());
+        for (size_t i = 0; i < m_skipped_shadow_lights.size(); i++) {
+            VkImageMemoryBarrier &barrier = m_shadow_barriers[i];
+            barrier = VkImageMemoryBarrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = m_shadow_map_image.m_image;
+            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.baseArrayLayer = m_lights[m_skipped_shadow_lights[i]].atlas_layer;
+            barrier.subresourceRange.layerCount = 1;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        }
+        m_dispatch.cmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                      0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(m_shadow_barriers.size()), m_shadow_barriers.data());
+    }
+    copy_shadow_caches(command_buffer, m_active_shadow_lights);
+
+    // Dynamic casters of every light in one pass
+    render_pass_info.renderPass = m_shadow_multiview_keep_render_pass;
+    render_pass_info.framebuffer = m_shadow_layers_framebuffer;
+    render_pass_info.clearValueCount = 0;
+    render_pass_info.pClearValues = nullptr;
+
+    m_dispatch.cmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    m_dispatch.cmdExecuteCommands(command_buffer, 1, &m_shadow_secondaries[0]);
+    m_dispatch.cmdEndRenderPass(command_buffer);
 }
 
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
 #include <engine/scene.h>
+#include <engine/profiler.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -6,6 +7,13 @@
 
 #include <fmt/format.h>
 
+#include <engine/thread_pool.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
 #include <pugixml.hpp>
 #include <sstream>
 
@@ -17,12 +25,23 @@ bool ends_with(const std::string& value, const std::string& suffix) {
 }
 
 ModelInfo Scene::add_model(std::string filename, std::vector<std::string> texture_filename, bool opaque, bool updating) {
-    if(ends_with(filename, ".obj"))
-        return add_obj_model(filename, texture_filename, opaque, updating);
-    else if(ends_with(filename, ".glb") || ends_with(filename, ".gltf"))
-        return add_gltf_model(filename, texture_filename, opaque, updating);
-    else
-        throw std::runtime_error("Unsupported model format!");
+    float base_texture = (float)m_textures.size();
+    m_textures.insert(m_textures.end(), texture_filename.begin(), texture_filename.end());
+
+    size_t transform_idx = m_model_transform_matrices.size();
+    m_model_transform_matrices.push_back(glm::mat4(1.f));
+
+    auto cached = m_mesh_lookup.find(filename);
+    uint32_t mesh_idx;
+    if (cached != m_mesh_lookup.end()) {
+        mesh_idx = cached->second;
+    } else {
+        mesh_idx = static_cast<uint32_t>(m_meshes.size());
+        m_meshes.push_back(load_mesh_file(filename));
+        m_mesh_lookup[filename] = mesh_idx;
+    }
+
+    return commit_model(mesh_idx, base_texture, transform_idx, opaque, updating);
 }
 
 /*
@@ -116,16 +135,26 @@ ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> te
 }
 */
 
-ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> texture_filename, bool opaque, bool updating) {
-    if(updating)
-        std::cout << "Updating\n";
-    
-    float base_texture = (float)m_textures.size();
+Mesh Scene::load_mesh_file(const std::string &filename) {
+    Mesh mesh;
+    if(ends_with(filename, ".obj"))
+        mesh = load_obj_mesh(filename);
+    else if(ends_with(filename, ".glb") || ends_with(filename, ".gltf"))
+        mesh = load_gltf_mesh(filename);
+    else
+        throw std::runtime_error("Unsupported model format!");
 
-    m_textures.insert(m_textures.end(), texture_filename.begin(), texture_filename.end());
+    {
+        PROFILE_SCOPE(fmt::format("generate_lods: {}", filename));
+        mesh.generate_lods();
+    }
+    return mesh;
+}
 
-    Model model{};
-    model.base_texture = base_texture;
+Mesh Scene::load_obj_mesh(const std::string &filename) {
+    PROFILE_SCOPE(fmt::format("load_obj: {}", filename));
+
+    Mesh model{};
 
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -134,9 +163,13 @@ ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> te
 
     std::string base_dir = filename.substr(0, filename.find_last_of("/\\") + 1);
 
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str(), base_dir.c_str()))
-        throw std::runtime_error(warn + err);
+    {
+        PROFILE_SCOPE("tinyobj::LoadObj");
+        if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str(), base_dir.c_str()))
+            throw std::runtime_error(warn + err);
+    }
 
+    PROFILE_SCOPE("build_vertices");
     std::unordered_map<Vertex, uint32_t> unique_vertices{};
 
     for (const auto &shape : shapes) {
@@ -167,7 +200,7 @@ ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> te
                 vertex.v += 0.0f;
             }
 
-            vertex.color = {1.f, 1.f, (float)m_model_transform_matrices.size()};
+            vertex.color = {1.f, 1.f, 1.f};
 
             if (index.normal_index >= 0) {
                 vertex.normal = {
@@ -179,7 +212,7 @@ ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> te
                 vertex.normal = {0.f, 0.f, 0.f};
             }
 
-            vertex.material_idx = mat_id >= 0 ? base_texture + static_cast<float>(mat_id) : base_texture;
+            vertex.material_idx = mat_id >= 0 ? static_cast<float>(mat_id) : 0.f;  // base_texture comes per instance
 
             if (unique_vertices.count(vertex) == 0) {
                 unique_vertices[vertex] = static_cast<uint32_t>(model.vertices.size());
@@ -190,58 +223,38 @@ ModelInfo Scene::add_obj_model(std::string filename, std::vector<std::string> te
         }
     }
 
-    model.model_matrix = glm::rotate(glm::mat4(1.f), glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-    ModelInfo model_info{};
-    if (opaque) {
-        m_opaque_models.push_back(model);
-
-        model_info.model_idx = m_opaque_models.size() - 1;
-        model_info.model_sub_idx = 0;
-        model_info.model_transform_idx = m_model_transform_matrices.size() - 1;
-    }
-    else {
-        m_transparent_models.push_back(model);
-
-        model_info.model_idx = m_transparent_models.size() - 1;
-        model_info.model_sub_idx = 0;
-        model_info.model_transform_idx = m_model_transform_matrices.size() - 1;
-    }
-
-    m_model_transform_matrices.push_back(model.model_matrix);
-    model_info.model_sub_idx = 0;
-    model_info.model_transform_idx = m_model_transform_matrices.size() - 1;
+    model.import_matrix = glm::rotate(glm::mat4(1.f), glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    model.compute_bounds();
 
     size_t num_faces = model.indices.size() / 3;
     fmt::println("Loaded model --> Filename: {}, Num Vertices: {}, Num Indices: {}, Num Faces: {}",
                  filename, model.vertices.size(), model.indices.size(), num_faces);
 
-    return model_info;
+    return model;
 }
 
-ModelInfo Scene::add_gltf_model(std::string filename, std::vector<std::string> texture_filename, bool opaque, bool updating) {
-    if (updating)
-        std::cout << "Updating\n";
+Mesh Scene::load_gltf_mesh(const std::string &filename) {
+    PROFILE_SCOPE(fmt::format("load_gltf: {}", filename));
 
-    float base_texture = (float)m_textures.size();
-    m_textures.insert(m_textures.end(), texture_filename.begin(), texture_filename.end());
-
-    Model model{};
-    model.base_texture = base_texture;
+    Mesh model{};
 
     tinygltf::Model gltfModel;
     tinygltf::TinyGLTF loader;
     std::string err, warn;
 
     bool ret;
-    if (ends_with(filename, ".glb"))
-        ret = loader.LoadBinaryFromFile(&gltfModel, &err, &warn, filename);
-    else 
-        ret = loader.LoadASCIIFromFile(&gltfModel, &err, &warn, filename);
+    {
+        PROFILE_SCOPE("tinygltf::Load");
+        if (ends_with(filename, ".glb"))
+            ret = loader.LoadBinaryFromFile(&gltfModel, &err, &warn, filename);
+        else 
+            ret = loader.LoadASCIIFromFile(&gltfModel, &err, &warn, filename);
+    }
 
     if (!ret)
         throw std::runtime_error("Failed to load GLTF: " + warn + err);
 
+    PROFILE_SCOPE("build_vertices");
     std::unordered_map<Vertex, uint32_t> unique_vertices{};
 
     for (const auto &gltfMesh : gltfModel.meshes) {
@@ -310,8 +323,8 @@ ModelInfo Scene::add_gltf_model(std::string filename, std::vector<std::string> t
                     vertex.v = 0.0f;
                 }
 
-                vertex.color = {1.f, 1.f, (float)m_model_transform_matrices.size()};
-                vertex.material_idx = mat_id >= 0 ? base_texture + static_cast<float>(mat_id) : base_texture;
+                vertex.color = {1.f, 1.f, 1.f};
+                vertex.material_idx = mat_id >= 0 ? static_cast<float>(mat_id) : 0.f;  // base_texture comes per instance
 
                 if (unique_vertices.count(vertex) == 0) {
                     unique_vertices[vertex] = static_cast<uint32_t>(model.vertices.size());
@@ -323,90 +336,510 @@ ModelInfo Scene::add_gltf_model(std::string filename, std::vector<std::string> t
         }
     }
 
-    model.model_matrix = glm::rotate(glm::mat4(1.f), glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    model.import_matrix = glm::rotate(glm::mat4(1.f), glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    model.compute_bounds();
+
+    size_t num_faces = model.indices.size() / 3;
+    fmt::println("Loaded model --> Filename: {}, Vertices: {}, Indices: {}, Faces: {}",
+                 filename, model.vertices.size(), model.indices.size(), num_faces);
+
+    return model;
+}
+
+ModelInfo Scene::commit_model(uint32_t mesh_idx, float base_texture, size_t transform_idx, bool opaque, bool updating) {
+    const Mesh &mesh = m_meshes[mesh_idx];
+
+    Model model{};
+    model.mesh_idx = mesh_idx;
+    model.base_texture = base_texture;
+    model.model_matrix = mesh.import_matrix;
+    model.local_bounds = mesh.local_bounds;
+    model.local_sphere = mesh.local_sphere;
+    model.updating = updating;
+    model.transform_idx = static_cast<uint32_t>(transform_idx);
+    m_bvh_dirty = true;
 
     ModelInfo model_info{};
     if (opaque) {
-        m_opaque_models.push_back(model);
+        m_opaque_models.push_back(std::move(model));
         model_info.model_idx = m_opaque_models.size() - 1;
+        m_model_transform_matrices[transform_idx] = m_opaque_models.back().model_matrix;
     } else {
-        m_transparent_models.push_back(model);
+        m_transparent_models.push_back(std::move(model));
         model_info.model_idx = m_transparent_models.size() - 1;
+        m_model_transform_matrices[transform_idx] = m_transparent_models.back().model_matrix;
     }
 
-    m_model_transform_matrices.push_back(model.model_matrix);
-    model_info.model_transform_idx = m_model_transform_matrices.size() - 1;
     model_info.model_sub_idx = 0;
-
-    size_t num_faces = model.indices.size() / 3;
-    fmt::println("Loaded model --> Filename: {}, Vertices: {}, Indices: {}, Faces: {}",
-                 filename, model.vertices.size(), model.indices.size(), num_faces);
+    model_info.model_transform_idx = transform_idx;
 
     return model_info;
 }
 
+void Scene::load_pending_meshes() {
+    PROFILE_SCOPE("load_meshes");
+    ThreadPool &pool = ThreadPool::get();
+
+    // Texture layers and transform slots are handed out in document order, so
+    // the result is the same as loading the meshes one after another.
+    // Each file is only loaded once, repeated ones become instances of the same mesh
+    std::vector<size_t> transform_indices;
+    std::vector<float> base_textures;
+    std::vector<std::future<Mesh>> meshes;
+    uint32_t next_mesh = static_cast<uint32_t>(m_meshes.size());
+    for (const PendingMesh &pending : m_pending_meshes) {
+        base_textures.push_back((float)m_textures.size());
+        m_textures.insert(m_textures.end(), pending.textures.begin(), pending.textures.end());
+
+        size_t transform_idx = m_model_transform_matrices.size();
+        m_model_transform_matrices.push_back(glm::mat4(1.f));
+        transform_indices.push_back(transform_idx);
+
+        if (m_mesh_lookup.count(pending.filename))
+            continue;
+        m_mesh_lookup[pending.filename] = next_mesh++;
+
+        std::string filename = pending.filename;
+        meshes.push_back(pool.submit([filename]() {
+            return load_mesh_file(filename);
+        }));
+    }
+
+    std::vector<std::future<DecodedImage>> textures;
+    for (const std::string &texture : m_textures)
+        textures.push_back(pool.submit([texture]() { return Image::decode_image(texture); }));
+
+    for (std::future<Mesh> &mesh : meshes)
+        m_meshes.push_back(mesh.get());
+
+    for (size_t i = 0; i < m_pending_meshes.size(); i++) {
+        const PendingMesh &pending = m_pending_meshes[i];
+
+        ModelInfo mi = commit_model(m_mesh_lookup[pending.filename], base_textures[i], transform_indices[i], pending.opaque, pending.updating);
+        if (pending.updated_transform) {
+            if (pending.opaque)
+                update_opaque_model_transform(mi, pending.transform, false);
+            else 
+                update_transparent_model_transform(mi, pending.transform, false);
+        }
+        if (pending.occluder && pending.opaque)
+            set_occluder(mi, pending.occluder_proxy);
+    }
+    m_pending_meshes.clear();
+
+    m_decoded_textures.clear();
+    for (std::future<DecodedImage> &texture : textures)
+        m_decoded_textures.push_back(texture.get());
+}
+
+
 void Scene::create_buffers(Renderer &renderer) {
+    PROFILE_SCOPE("Scene::create_buffers");
     for(Light &l: m_lights)
-        renderer.add_light(l.mvp, l.type);
+        renderer.add_light(l.mvp, l.type, l.shadow_resolution, l.low_precision_shadow);
 
-    for (Model &model: m_opaque_models)
-        model.create_buffers(renderer);
+    {
+        PROFILE_SCOPE("upload_models");
+        create_geometry_buffers(renderer);
+    }
 
-    for (Model &model: m_transparent_models)
-        model.create_buffers(renderer);
+    create_draw_batches();
+
+    // Sections: opaque, opaque late, then two per light (static and dynamic casters), multiview
+    // shadows only use the first light's two. At most one draw per batch in each
+    uint32_t section_count = DRAW_SECTION_FIRST_LIGHT + 2 * static_cast<uint32_t>(m_lights.size());
+    uint32_t max_draws = static_cast<uint32_t>(m_opaque_batches.size());
+    renderer.create_indirect_buffers(section_count, max_draws);
     
-    size_t transform_count = m_model_transform_matrices.size();
-    uint32_t buffer_size = sizeof(glm::mat4) * static_cast<uint32_t>(transform_count);
+    partition_transforms();
+    uint32_t dynamic_count = static_cast<uint32_t>(m_dynamic_transforms.size());
+
+    // Vulkan does not allow zero sized buffers, the extra matrix is never indexed
+    std::vector<glm::mat4> static_transforms = m_static_transforms;
+    std::vector<glm::mat4> dynamic_transforms = m_dynamic_transforms;
+    static_transforms.resize(std::max<size_t>(static_transforms.size(), 1), glm::mat4(1.f));
+    dynamic_transforms.resize(std::max<size_t>(dynamic_transforms.size(), 1), glm::mat4(1.f));
+
+    uint32_t static_size = sizeof(glm::mat4) * static_cast<uint32_t>(static_transforms.size());
+    m_static_transform_group = renderer.create_static_storage_group(1, static_size, VK_SHADER_STAGE_VERTEX_BIT);
+    renderer.update_uniform_group(m_static_transform_group, static_transforms.data());
+
+    // Every frame's copy starts out complete, after that only changes are written
+    uint32_t dynamic_size = sizeof(glm::mat4) * static_cast<uint32_t>(dynamic_transforms.size());
+    m_dynamic_transform_group = renderer.create_uniform_group(4, dynamic_size, VK_SHADER_STAGE_VERTEX_BIT, true);
+    renderer.update_uniform_group(m_dynamic_transform_group, dynamic_transforms.data());
+    for (DirtyRanges &dirty : m_dirty_transforms)
+        dirty.resize(dynamic_count);
+
+    // Instances: a section per indirect section with room for every batch to hold all models of
+    // its mesh, then the transparent models which never change so they are only written here
+    m_instance_section_size = 0;
+    for (const DrawBatch &batch : m_opaque_batches)
+        m_instance_section_size += batch.instance_count;
+    m_transparent_first_instance = section_count * m_instance_section_size;
+    std::vector<InstanceData> instances(m_transparent_first_instance + m_transparent_models.size() + 1);
+    for (size_t i = 0; i < m_transparent_models.size(); i++) {
+        instances[m_transparent_first_instance + i].transform_idx = m_transparent_models[i].transform_idx;
+        instances[m_transparent_first_instance + i].base_texture = m_transparent_models[i].base_texture;
+    }
+
+    uint32_t instance_buffer_size = sizeof(InstanceData) * static_cast<uint32_t>(instances.size());
+    m_instance_group = renderer.create_uniform_group(3, instance_buffer_size, VK_SHADER_STAGE_VERTEX_BIT, true);
+    renderer.update_uniform_group(m_instance_group, instances.data());
+
+    m_shadow_depth_clamp = renderer.supports_depth_clamp();
+    m_multiview_shadows = renderer.use_multiview_shadows();
+
+    // Rewritten every frame, cascades follow the camera
+    m_shadow_cascade_group = renderer.create_uniform_group<ShadowCascades>(5, VK_SHADER_STAGE_FRAGMENT_BIT);
+    renderer.update_uniform_group(m_shadow_cascade_group, &m_shadow_cascades);
 
-    size_t ub_idx = renderer.create_uniform_group(1, buffer_size, VK_SHADER_STAGE_VERTEX_BIT, true);
-    renderer.update_uniform_group(ub_idx, m_model_transform_matrices.data());
+    // Point and spot lights, bindings 7 to 9
+    m_light_clusters.initialize(renderer, 7);
+
+    if (m_gpu_culling)
+        m_gpu_culler.initialize(renderer, m_opaque_models, m_meshes, m_opaque_batches, m_static_transform_group, m_dynamic_transform_group, m_instance_group, m_instance_section_size);
     
     // renderer.add_texture("textures/viking_room.jpg", 1);
     uint32_t tex_count = static_cast<uint32_t>(num_textures());
     uint32_t layer_count = tex_count < 4 ? 4: tex_count;
-    renderer.add_texture_array(m_textures, 1024, 1024, layer_count, 2);
+    // Textures added through add_model after loading the xml are decoded at upload time instead
+    if (m_decoded_textures.size() != m_textures.size())
+        m_decoded_textures.clear();
+    renderer.add_texture_array(m_textures, 1024, 1024, layer_count, 2, std::move(m_decoded_textures));
 }
 
-void Scene::render_opaque_models(Renderer &renderer, VkCommandBuffer &command_buffer) {
-    for (int mod = 0; mod < m_opaque_models.size(); mod++) {
-        // std::cout << "Rendering model\n";
-        const Engine::Model &model = m_opaque_models[mod];
+void Scene::create_geometry_buffers(Renderer &renderer) {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
 
-        // Retreive vertex and index buffers ===========================================================
-        VkBuffer vertex_buffers[] = {renderer.get_buffer(model.vertex_buffer_idx)};
-        VkDeviceSize offsets[] = {0};
-        VkBuffer index_buffer = renderer.get_buffer(model.index_buffer_idx);
-        
-        // Bind vertex and index buffers ===============================================================
-        renderer.m_dispatch.cmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
-        renderer.m_dispatch.cmdBindIndexBuffer(command_buffer, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    // Once per mesh no matter how many models use it
+    for (Mesh &mesh: m_meshes) {
+        mesh.first_index = static_cast<uint32_t>(indices.size());
+        mesh.index_count = static_cast<uint32_t>(mesh.indices.size());
+        mesh.vertex_offset = static_cast<int32_t>(vertices.size());
 
-        // Set push constants ==========================================================================
-        renderer.m_dispatch.cmdPushConstants(command_buffer, renderer.get_pipeline_layout(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_push_constants), &m_push_constants);
-        
-        // draw call ===================================================================================
-        renderer.m_dispatch.cmdDrawIndexed(command_buffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+        indices.insert(indices.end(), mesh.lod_indices.begin(), mesh.lod_indices.end());
+    }
+
+    // Vulkan does not allow zero sized buffers
+    if (vertices.empty())
+        vertices.push_back(Vertex{});
+    if (indices.empty())
+        indices.push_back(0);
+
+    size_t vertex_buffer_size = sizeof(vertices[0]) * vertices.size();
+    size_t index_buffer_size = sizeof(indices[0]) * indices.size();
+    // Meshes never change after loading, so they live in device local memory
+    size_t vertex_buffer_idx = renderer.create_device_local_buffer(vertex_buffer_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    size_t index_buffer_idx = renderer.create_device_local_buffer(index_buffer_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+    renderer.upload_buffer(vertex_buffer_idx, vertices.data(), vertex_buffer_size);
+    renderer.upload_buffer(index_buffer_idx, indices.data(), index_buffer_size);
+    renderer.set_geometry_buffers(vertex_buffer_idx, index_buffer_idx);
+}
+
+void Scene::create_draw_batches() {
+    // One batch per LOD of each mesh used by an opaque model, in order of first use.
+    // A model draws with batch_idx + lod
+    std::vector<uint32_t> mesh_batch(m_meshes.size(), UINT32_MAX);
+    m_opaque_batches.clear();
+
+    for (Model &model: m_opaque_models) {
+        const Mesh &mesh = m_meshes[model.mesh_idx];
+        if (mesh_batch[model.mesh_idx] == UINT32_MAX) {
+            mesh_batch[model.mesh_idx] = static_cast<uint32_t>(m_opaque_batches.size());
+            for (uint32_t lod = 0; lod < mesh.lod_count; lod++)
+                m_opaque_batches.push_back(DrawBatch{model.mesh_idx, lod, 0, 0});
+        }
+        model.batch_idx = mesh_batch[model.mesh_idx];
+        for (uint32_t lod = 0; lod < mesh.lod_count; lod++)
+            m_opaque_batches[model.batch_idx + lod].instance_count++;
+    }
+
+    uint32_t first_instance = 0;
+    for (DrawBatch &batch: m_opaque_batches) {
+        batch.first_instance = first_instance;
+        first_instance += batch.instance_count;
     }
 }
 
-void Scene::render_transparent_models(Renderer &renderer, VkCommandBuffer &command_buffer) {
-    for (int mod = 0; mod < m_transparent_models.size(); mod++) {
-        const Engine::Model &model = m_transparent_models[mod];
+void Scene::write_draw_commands(Renderer &renderer, int current_frame, uint32_t section, const std::vector<uint32_t> &visible, const glm::vec4 &depth_plane) {
+    VkDrawIndexedIndirectCommand *commands = renderer.get_indirect_commands(current_frame, section);
+    InstanceData *instances = static_cast<InstanceData*>(renderer.map_uniform_group(m_instance_group, current_frame));
+    uint32_t instance_idx = section * m_instance_section_size;
 
-        // Retreive vertex and index buffers ===========================================================
-        VkBuffer vertex_buffers[] = {renderer.get_buffer(model.vertex_buffer_idx)};
-        VkDeviceSize offsets[] = {0};
-        VkBuffer index_buffer = renderer.get_buffer(model.index_buffer_idx);
-        
-        // Bind vertex and index buffers ===============================================================
-        renderer.m_dispatch.cmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
-        renderer.m_dispatch.cmdBindIndexBuffer(command_buffer, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    // Batch first so each batch is one contiguous instanced command, front to back inside it
+    m_sort_items.resize(visible.size());
+    for (size_t i = 0; i < visible.size(); i++) {
+        const Model &model = m_opaque_models[visible[i]];
+        glm::vec3 center = glm::vec3(model.world_sphere());
+        float depth = glm::dot(glm::vec3(depth_plane), center) + depth_plane.w;
 
-        // Set push constants ==========================================================================
-        renderer.m_dispatch.cmdPushConstants(command_buffer, renderer.get_pipeline_layout(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_push_constants), &m_push_constants);
-        
-        // draw call ===================================================================================
-        renderer.m_dispatch.cmdDrawIndexed(command_buffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+        m_sort_items[i].key = SortKey::opaque(0, model.batch_idx + model.lod, static_cast<uint32_t>(model.base_texture), depth);
+        m_sort_items[i].value = visible[i];
+    }
+    radix_sort(m_sort_items, m_sort_scratch);
+
+    uint32_t draw_count = 0;
+    uint32_t current_batch = UINT32_MAX;
+    for (const SortItem &item : m_sort_items) {
+        const Model &model = m_opaque_models[item.value];
+
+        if (model.batch_idx + model.lod != current_batch) {
+            current_batch = model.batch_idx + model.lod;
+
+            const DrawBatch &batch = m_opaque_batches[current_batch];
+            const Mesh &mesh = m_meshes[batch.mesh_idx];
+            VkDrawIndexedIndirectCommand &command = commands[draw_count++];
+            command.indexCount = mesh.lods[batch.lod].index_count;
+            command.instanceCount = 0;
+            command.firstIndex = mesh.first_index + mesh.lods[batch.lod].first_index;
+            command.vertexOffset = mesh.vertex_offset;
+            command.firstInstance = instance_idx;
+        }
+
+        commands[draw_count - 1].instanceCount++;
+
+        InstanceData &instance = instances[instance_idx++];
+        instance.transform_idx = model.transform_idx;
+        instance.base_texture = model.base_texture;
+    }
+
+    renderer.set_indirect_draw_count(current_frame, section, draw_count);
+}
+
+void Scene::sort_transparent_models(const glm::vec4 &depth_plane) {
+    // Back to front for blending
+    m_sort_items.resize(m_visible_transparent.size());
+    for (size_t i = 0; i < m_visible_transparent.size(); i++) {
+        glm::vec3 center = glm::vec3(m_transparent_models[m_visible_transparent[i]].world_sphere());
+        float depth = glm::dot(glm::vec3(depth_plane), center) + depth_plane.w;
+
+        m_sort_items[i].key = SortKey::transparent(1, depth);
+        m_sort_items[i].value = m_visible_transparent[i];
+    }
+    radix_sort(m_sort_items, m_sort_scratch);
+
+    for (size_t i = 0; i < m_sort_items.size(); i++)
+        m_visible_transparent[i] = m_sort_items[i].value;
+}
+
+void Scene::upload_transforms(Renderer &renderer, VkCommandBuffer command_buffer, int current_frame) {
+    // Static models rarely move, a full copy recorded into the frame is enough for them
+    if (m_static_transforms_dirty) {
+        renderer.record_static_group_update(command_buffer, current_frame, m_static_transform_group, m_static_transforms.data());
+        m_static_transforms_dirty = false;
+    }
+
+    DirtyRanges &dirty = m_dirty_transforms[current_frame];
+    if (dirty.empty())
+        return;
+
+    // Coherent and persistently mapped, and the frame's fence has been waited on
+    glm::mat4 *transforms = static_cast<glm::mat4*>(renderer.map_uniform_group(m_dynamic_transform_group, current_frame));
+    for (const DirtyRange &range : dirty.build_ranges(TRANSFORM_MERGE_GAP))
+        memcpy(transforms + range.first, m_dynamic_transforms.data() + range.first, sizeof(glm::mat4) * range.count);
+    dirty.clear();
+}
+
+void Scene::record_draw_commands(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame) {
+    // Both the cull dispatch and the draws read this frame's transforms
+    upload_transforms(renderer, command_buffer, current_frame);
+
+    // Cascades were refitted in update, the shadow passes and the main pass both use them
+    for (uint32_t c = 0; c < m_cascade_count; c++)
+        renderer.set_light_matrix(m_cascade_first_light + c, m_lights[m_cascade_first_light + c].mvp);
+    for (uint32_t c = 0; c < m_shadow_cascades.count; c++)
+        m_shadow_cascades.atlas_rects[c] = renderer.get_shadow_atlas_rect(m_shadow_cascades.first_light + c);
+    memcpy(renderer.map_uniform_group(m_shadow_cascade_group, current_frame), &m_shadow_cascades, sizeof(m_shadow_cascades));
+
+    // Before the GPU culling returns, the main passes shade with the clusters
+    m_light_clusters.record(renderer, command_buffer, current_frame, m_local_lights, m_push_constants.view, m_push_constants.proj, m_near_plane, m_far_plane);
+
+    // Lights that cannot shadow anything on screen keep their layer as it is
+    auto light_visible = [&](uint32_t l) { return l < m_light_culls.size() && m_light_culls[l].visible; };
+    for (uint32_t l = 0; l < m_lights.size(); l++)
+        renderer.set_skip_shadow_pass(l, !light_visible(l));
+
+    // Static casters are only culled for lights whose cached shadow is redrawn this frame. With
+    // multiview shadows all caches are redrawn together and both sections hold every light's casters
+    bool redraw_caches = m_multiview_shadows && !renderer.shadow_caches_valid(m_static_version);
+
+    if (m_gpu_culler.initialized()) {
+        m_light_frustums.clear();
+        m_light_jobs.clear();
+        if (m_multiview_shadows) {
+            for (uint32_t l = 0; l < m_lights.size(); l++)
+                if (redraw_caches && light_visible(l))
+                    m_light_frustums.push_back(m_light_culls[l].casters);
+            uint32_t static_count = static_cast<uint32_t>(m_light_frustums.size());
+            for (uint32_t l = 0; l < m_lights.size(); l++)
+                if (light_visible(l))
+                    m_light_frustums.push_back(m_light_culls[l].dynamic_casters);
+            uint32_t dynamic_count = static_cast<uint32_t>(m_light_frustums.size()) - static_count;
+
+            if (static_count > 0)
+                m_light_jobs.push_back({0, static_count, DRAW_SECTION_FIRST_LIGHT, CULL_PHASE_STATIC_CASTERS});
+            if (dynamic_count > 0)
+                m_light_jobs.push_back({static_count, dynamic_count, DRAW_SECTION_FIRST_LIGHT + 1, CULL_PHASE_DYNAMIC_CASTERS});
+        } else {
+            for (uint32_t l = 0; l < m_lights.size(); l++) {
+                if (!light_visible(l))
+                    continue;
+
+                uint32_t first = static_cast<uint32_t>(m_light_frustums.size());
+                m_light_frustums.push_back(m_light_culls[l].casters);
+                m_light_frustums.push_back(m_light_culls[l].dynamic_casters);
+                if (!renderer.shadow_cache_valid(l, m_static_version))
+                    m_light_jobs.push_back({first, 1, DRAW_SECTION_FIRST_LIGHT + 2 * l, CULL_PHASE_STATIC_CASTERS});
+                m_light_jobs.push_back({first + 1, 1, DRAW_SECTION_FIRST_LIGHT + 2 * l + 1, CULL_PHASE_DYNAMIC_CASTERS});
+            }
+        }
+
+        // The camera's late section is filled in record_occlusion_culling
+        m_gpu_culler.record(renderer, command_buffer, current_frame, m_push_constants.proj * m_push_constants.view, DRAW_SECTION_OPAQUE, m_light_frustums, m_light_jobs);
+        return;
+    }
+
+    // Depth is the distance from the near plane of each view
+    write_draw_commands(renderer, current_frame, DRAW_SECTION_OPAQUE, m_visible_opaque, m_camera_near_plane);
+
+    if (m_multiview_shadows) {
+        // Lights overlap, a caster is drawn once for all of them. Sorted from the first light's near plane
+        m_static_casters.clear();
+        m_dynamic_casters.clear();
+        glm::vec4 light_near_plane(0.f);
+        bool first_light = true;
+        for (uint32_t l = 0; l < m_lights.size(); l++) {
+            if (!light_visible(l))
+                continue;
+            if (first_light)
+                light_near_plane = Frustum::from_matrix(m_lights[l].mvp).planes[4];
+            first_light = false;
+            collect_light_casters(l);
+        }
+        std::sort(m_static_casters.begin(), m_static_casters.end());
+        m_static_casters.erase(std::unique(m_static_casters.begin(), m_static_casters.end()), m_static_casters.end());
+        std::sort(m_dynamic_casters.begin(), m_dynamic_casters.end());
+        m_dynamic_casters.erase(std::unique(m_dynamic_casters.begin(), m_dynamic_casters.end()), m_dynamic_casters.end());
+
+        if (redraw_caches)
+            write_draw_commands(renderer, current_frame, DRAW_SECTION_FIRST_LIGHT, m_static_casters, light_near_plane);
+        write_draw_commands(renderer, current_frame, DRAW_SECTION_FIRST_LIGHT + 1, m_dynamic_casters, light_near_plane);
+        return;
+    }
+
+    for (uint32_t l = 0; l < m_lights.size(); l++) {
+        if (!light_visible(l))
+            continue;
+
+        glm::vec4 light_near_plane = Frustum::from_matrix(m_lights[l].mvp).planes[4];
+        m_static_casters.clear();
+        m_dynamic_casters.clear();
+        collect_light_casters(l);
+
+        uint32_t section = DRAW_SECTION_FIRST_LIGHT + 2 * l;
+        if (!renderer.shadow_cache_valid(l, m_static_version))
+            write_draw_commands(renderer, current_frame, section, m_static_casters, light_near_plane);
+        write_draw_commands(renderer, current_frame, section + 1, m_dynamic_casters, light_near_plane);
+    }
+}
+
+void Scene::collect_light_casters(uint32_t light) {
+    // Dynamic casters also have to reach the part of the light volume the camera sees
+    for (uint32_t model : m_shadow_casters[light]) {
+        if (!m_opaque_models[model].updating) {
+            m_static_casters.push_back(model);
+            continue;
+        }
+        glm::vec4 sphere = m_opaque_models[model].world_sphere();
+        if (m_light_culls[light].dynamic_casters.intersects_sphere(glm::vec3(sphere), sphere.w))
+            m_dynamic_casters.push_back(model);
+    }
+}
+
+void Scene::render_early_models(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame, uint32_t image_index) {
+    // A single indirect draw, still a secondary since the pass is begun for them
+    m_pass_framebuffers.assign(1, renderer.get_framebuffer(image_index));
+    renderer.record_secondaries(current_frame, renderer.get_render_pass(), m_pass_framebuffers, [&](uint32_t, CommandRecorder &recorder) {
+        renderer.set_default_viewport_and_scissor(recorder);
+        render_opaque_models(renderer, recorder, current_frame, DRAW_SECTION_OPAQUE);
+    }, m_pass_secondaries);
+
+    renderer.m_dispatch.cmdExecuteCommands(command_buffer, static_cast<uint32_t>(m_pass_secondaries.size()), m_pass_secondaries.data());
+}
+
+void Scene::record_occlusion_culling(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame) {
+    // CPU culling has no occlusion test, everything was in the first pass
+    if (!m_gpu_culler.initialized())
+        return;
+
+    renderer.build_depth_pyramid(command_buffer);
+    m_gpu_culler.record_late(renderer, command_buffer, current_frame, DRAW_SECTION_OPAQUE_LATE);
+}
+
+void Scene::render_models(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame, uint32_t image_index) {
+    // Secondary 0 is the late opaque indirect draw, the sorted transparents are cut into consecutive
+    // chunks after it so executing them in order keeps the blending order
+    uint32_t transparent_count = static_cast<uint32_t>(m_visible_transparent.size());
+    // Rounded down and split evenly, so every chunk gets at least the minimum
+    uint32_t chunk_count = transparent_count > 0 ? std::max(1u, transparent_count / MIN_TRANSPARENT_DRAWS_PER_SECONDARY) : 0;
+    chunk_count = std::min(chunk_count, renderer.get_secondary_slot_count());
+
+    m_pass_framebuffers.assign(1 + chunk_count, renderer.get_framebuffer(image_index));
+    renderer.record_secondaries(current_frame, renderer.get_keep_contents_render_pass(), m_pass_framebuffers, [&](uint32_t i, CommandRecorder &recorder) {
+        if (i == 0) {
+            renderer.set_default_viewport_and_scissor(recorder);
+            render_opaque_models(renderer, recorder, current_frame, DRAW_SECTION_OPAQUE_LATE);
+            return;
+        }
+
+        uint32_t first = (i - 1) * transparent_count / chunk_count;
+        uint32_t last = i * transparent_count / chunk_count;
+        renderer.bind_pipeline_and_descriptors(recorder, 1, current_frame);
+        renderer.set_default_viewport_and_scissor(recorder);
+        render_transparent_models(renderer, recorder, first, last - first);
+    }, m_pass_secondaries);
+
+    renderer.m_dispatch.cmdExecuteCommands(command_buffer, static_cast<uint32_t>(m_pass_secondaries.size()), m_pass_secondaries.data());
+}
+
+void Scene::render_opaque_models(Renderer &renderer, CommandRecorder &recorder, int current_frame, uint32_t section) {
+    // Transform and material offset come from the instance buffer, so one bind + push covers every draw
+    renderer.bind_geometry_buffers(recorder);
+
+    // Depth only first, then the same draws shaded with an EQUAL test so each pixel is shaded once
+    size_t pipeline_idx = 0;
+    if (renderer.depth_prepass_enabled()) {
+        renderer.bind_depth_prepass_pipeline(recorder, current_frame);
+        recorder.push_constants(renderer.get_depth_prepass_pipeline_layout(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_push_constants), &m_push_constants);
+        renderer.draw_indirect(recorder, current_frame, section);
+        pipeline_idx = 2;
+    }
+
+    renderer.bind_pipeline_and_descriptors(recorder, static_cast<int>(pipeline_idx), current_frame);
+    recorder.push_constants(renderer.get_pipeline_layout(pipeline_idx), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_push_constants), &m_push_constants);
+    renderer.draw_indirect(recorder, current_frame, section);
+}
+
+void Scene::render_shadow_maps(Renderer &renderer, VkCommandBuffer &command_buffer, int current_frame) {
+    renderer.render_shadow_maps(command_buffer, current_frame, DRAW_SECTION_FIRST_LIGHT, m_static_version);
+}
+
+void Scene::render_transparent_models(Renderer &renderer, CommandRecorder &recorder, uint32_t first, uint32_t count) {
+    // Direct draws, blending depends on the order these are recorded in
+    renderer.bind_geometry_buffers(recorder);
+    recorder.push_constants(renderer.get_pipeline_layout(1), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(m_push_constants), &m_push_constants);
+
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t mod = m_visible_transparent[i];
+        const Engine::Model &model = m_transparent_models[mod];
+        const Engine::MeshLod &lod = m_meshes[model.mesh_idx].lods[model.lod];
+        const Engine::Mesh &mesh = m_meshes[model.mesh_idx];
+        recorder.draw_indexed(lod.index_count, 1, mesh.first_index + lod.first_index, mesh.vertex_offset, m_transparent_first_instance + mod);
     }
 }
 
@@ -416,6 +849,14 @@ void Scene::add_light(glm::vec3 light_color, glm::vec3 light_pos, glm::mat4 ligh
 
     m_lights.push_back(light);
 
+    // The fragment shader only shadows one light, the latest one or the cascaded light
+    if (m_cascade_count == 0) {
+        m_shadow_cascades.light_pv[0] = light_matrix;
+        m_shadow_cascades.split_depths = glm::vec4(std::numeric_limits<float>::max());
+        m_shadow_cascades.count = 1;
+        m_shadow_cascades.first_light = static_cast<uint32_t>(m_lights.size()) - 1;
+    }
+
     m_push_constants.light_PV = light_matrix;
     m_push_constants.light_pos = glm::vec4(light_pos, 0.f);
     m_push_constants.light_color = glm::vec4(light_color, 1.0);
@@ -442,6 +883,128 @@ void Scene::add_orthographic_light(glm::vec3 color, glm::vec3 position, glm::vec
     return add_light(color, position, light_pv);
 }
 
+void Scene::add_cascaded_light(glm::vec3 color, glm::vec3 position, glm::vec3 look_at, glm::vec3 up, uint32_t cascade_count, float caster_distance) {
+    if (cascade_count == 0 || cascade_count > MAX_SHADOW_CASCADES)
+        throw std::runtime_error("Need 1 to 4 shadow cascades");
+
+    m_cascade_count = cascade_count;
+    m_cascade_first_light = static_cast<uint32_t>(m_lights.size());
+    m_cascade_direction = glm::normalize(look_at - position);
+    m_cascade_up = up;
+    m_cascade_caster_distance = caster_distance;
+
+    // The matrices are fitted on every update, once the camera is known
+    for (uint32_t c = 0; c < cascade_count; c++)
+        add_light(color, position, glm::mat4(1.f));
+
+    m_shadow_cascades.count = cascade_count;
+    m_shadow_cascades.first_light = m_cascade_first_light;
+}
+
+void Scene::set_light_shadow(uint32_t light, uint32_t resolution, bool low_precision) {
+    m_lights[light].shadow_resolution = resolution;
+    m_lights[light].low_precision_shadow = low_precision;
+}
+
+uint32_t Scene::add_point_light(glm::vec3 color, glm::vec3 position, float range, float intensity) {
+    if (m_local_lights.size() >= MAX_LOCAL_LIGHTS)
+        throw std::runtime_error("Too many local lights!");
+
+    LocalLight light{};
+    light.position = position;
+    light.range = range;
+    light.color = color;
+    light.intensity = intensity;
+    light.direction = glm::vec3(0.f, -1.f, 0.f);
+    light.cos_outer = -2.f;
+    light.cos_inner = -1.f;
+    m_local_lights.push_back(light);
+    return static_cast<uint32_t>(m_local_lights.size() - 1);
+}
+
+uint32_t Scene::add_spot_light(glm::vec3 color, glm::vec3 position, glm::vec3 direction, float range, float inner_degrees, float outer_degrees, float intensity) {
+    if (inner_degrees > outer_degrees)
+        throw std::runtime_error("Spot light inner angle is wider than the outer one");
+
+    uint32_t idx = add_point_light(color, position, range, intensity);
+    m_local_lights[idx].direction = glm::normalize(direction);
+    m_local_lights[idx].cos_outer = std::cos(glm::radians(outer_degrees));
+    m_local_lights[idx].cos_inner = std::cos(glm::radians(inner_degrees));
+    return idx;
+}
+
+void Scene::update_local_light(uint32_t light, glm::vec3 position, glm::vec3 direction) {
+    m_local_lights[light].position = position;
+    // Point lights ignore it
+    if (m_local_lights[light].cos_outer > -1.f)
+        m_local_lights[light].direction = glm::normalize(direction);
+}
+
+void Scene::update_shadow_cascades() {
+    if (m_cascade_count == 0)
+        return;
+
+    // Corners of the whole camera frustum, a slice's corners are on the lines between them
+    glm::mat4 inv_view_proj = glm::inverse(m_push_constants.proj * m_push_constants.view);
+    glm::vec3 near_corners[4];
+    glm::vec3 far_corners[4];
+    for (int i = 0; i < 4; i++) {
+        float x = (i & 1) ? 1.f : -1.f;
+        float y = (i & 2) ? 1.f : -1.f;
+        glm::vec4 near_corner = inv_view_proj * glm::vec4(x, y, 0.f, 1.f);
+        glm::vec4 far_corner = inv_view_proj * glm::vec4(x, y, 1.f, 1.f);
+        near_corners[i] = glm::vec3(near_corner) / near_corner.w;
+        far_corners[i] = glm::vec3(far_corner) / far_corner.w;
+    }
+
+    float depth_range = m_far_plane - m_near_plane;
+    float slice_near = m_near_plane;
+    for (uint32_t c = 0; c < m_cascade_count; c++) {
+        // Practical split scheme, a blend of logarithmic and uniform splits
+        float p = static_cast<float>(c + 1) / static_cast<float>(m_cascade_count);
+        float log_split = m_near_plane * std::pow(m_far_plane / m_near_plane, p);
+        float uniform_split = m_near_plane + depth_range * p;
+        float slice_far = m_cascade_split_lambda * log_split + (1.f - m_cascade_split_lambda) * uniform_split;
+
+        glm::vec3 corners[8];
+        glm::vec3 center(0.f);
+        for (int i = 0; i < 4; i++) {
+            glm::vec3 ray = far_corners[i] - near_corners[i];
+            corners[i] = near_corners[i] + ray * ((slice_near - m_near_plane) / depth_range);
+            corners[i + 4] = near_corners[i] + ray * ((slice_far - m_near_plane) / depth_range);
+            center += corners[i] + corners[i + 4];
+        }
+        center /= 8.f;
+
+        // A bounding sphere keeps the size the same when the camera turns, rounded so float noise
+        // does not change it either
+        float radius = 0.f;
+        for (const glm::vec3 &corner : corners)
+            radius = std::max(radius, glm::length(corner - center));
+        radius = std::ceil(radius * 16.f) / 16.f;
+
+        float back = radius + m_cascade_caster_distance;
+        glm::mat4 light_view = glm::lookAt(center - m_cascade_direction * back, center, m_cascade_up);
+        glm::mat4 light_proj = glm::ortho(-radius, radius, -radius, radius, 0.f, back + radius);
+        light_proj[1][1] *= -1;
+
+        // Snap to whole texels, so the map only moves in texel steps and the edges do not shimmer
+        float half_size = static_cast<float>(m_lights[m_cascade_first_light + c].shadow_resolution) * 0.5f;
+        glm::vec4 origin = light_proj * light_view * glm::vec4(0.f, 0.f, 0.f, 1.f);
+        glm::vec2 texel = glm::vec2(origin.x, origin.y) * half_size;
+        glm::vec2 offset = (glm::round(texel) - texel) / half_size;
+        light_proj[3][0] += offset.x;
+        light_proj[3][1] += offset.y;
+
+        glm::mat4 light_pv = light_proj * light_view;
+        m_lights[m_cascade_first_light + c].mvp = light_pv;
+        m_shadow_cascades.light_pv[c] = light_pv;
+        m_shadow_cascades.split_depths[c] = slice_far;
+
+        slice_near = slice_far;
+    }
+}
+
 void Scene::set_camera(glm::mat4 proj, glm::mat4 view) {
     m_push_constants.proj = proj;
     m_push_constants.view = view;
@@ -467,7 +1030,8 @@ void Scene::update_opaque_model_transform(ModelInfo &mi, glm::mat4 transform, bo
     else
         m_opaque_models[mi.model_idx].model_matrix = transform * m_opaque_models[mi.model_idx].model_matrix;
         
-    m_model_transform_matrices[mi.model_transform_idx] = m_opaque_models[mi.model_idx].model_matrix;
+    write_model_transform(m_opaque_models[mi.model_idx]);
+    mark_moved(m_opaque_models[mi.model_idx]);
 }
 
 void Scene::update_transparent_model_transform(ModelInfo &mi, glm::mat4 transform, bool replace) {
@@ -476,7 +1040,44 @@ void Scene::update_transparent_model_transform(ModelInfo &mi, glm::mat4 transfor
     else
         m_transparent_models[mi.model_idx].model_matrix = transform * m_transparent_models[mi.model_idx].model_matrix;
 
-    m_model_transform_matrices[mi.model_transform_idx] = m_transparent_models[mi.model_idx].model_matrix;
+    write_model_transform(m_transparent_models[mi.model_idx]);
+    mark_moved(m_transparent_models[mi.model_idx]);
+}
+
+void Scene::set_occluder(const ModelInfo &mi, const std::string &proxy_filename) {
+    uint32_t model_idx = static_cast<uint32_t>(mi.model_idx);
+
+    // Full detail index range only, with just the vertices it uses
+    auto add_occluder_mesh = [&](const Mesh &mesh) {
+        std::vector<uint32_t> remap(mesh.vertices.size(), UINT32_MAX);
+        std::vector<glm::vec3> positions;
+        std::vector<uint32_t> indices(mesh.indices.size());
+        for (size_t i = 0; i < mesh.indices.size(); i++) {
+            uint32_t &vertex = remap[mesh.indices[i]];
+            if (vertex == UINT32_MAX) {
+                vertex = static_cast<uint32_t>(positions.size());
+                positions.push_back(mesh.vertices[mesh.indices[i]].pos);
+            }
+            indices[i] = vertex;
+        }
+        return m_occlusion_rasterizer.add_mesh(std::move(positions), std::move(indices));
+    };
+
+    uint32_t occluder_mesh;
+    if (!proxy_filename.empty()) {
+        auto cached = m_occluder_proxies.find(proxy_filename);
+        if (cached == m_occluder_proxies.end())
+            cached = m_occluder_proxies.emplace(proxy_filename, add_occluder_mesh(load_mesh_file(proxy_filename))).first;
+        occluder_mesh = cached->second;
+    } else {
+        uint32_t mesh_idx = m_opaque_models[model_idx].mesh_idx;
+        auto cached = m_occluder_meshes.find(mesh_idx);
+        if (cached == m_occluder_meshes.end())
+            cached = m_occluder_meshes.emplace(mesh_idx, add_occluder_mesh(m_meshes[mesh_idx])).first;
+        occluder_mesh = cached->second;
+    }
+
+    m_occluders.push_back(Occluder{model_idx, occluder_mesh});
 }
 
 void Scene::update(float delta_time, float aspect_ratio) {
@@ -492,6 +1093,367 @@ void Scene::update(float delta_time, float aspect_ratio) {
     float camera_d = 10.f;
 
     m_push_constants.view = glm::lookAt(glm::vec3(camera_d * cosf(total_time), camera_d * sinf(total_time),  camera_d), glm::vec3(0.f, 0.f, 0.f), glm::vec3(0.f, 0.f, 1.f));
+
+    update_graph();
+    update_shadow_cascades();
+    select_lods();
+    cull_models();
+}
+
+void Scene::select_lods() {
+    // Sphere radius over distance, scaled by the projection: the fraction of half the screen height
+    // the model covers. Only the camera decides, shadow passes draw whatever it picked
+    glm::vec3 eye = glm::vec3(glm::inverse(m_push_constants.view)[3]);
+    float proj_scale = std::abs(m_push_constants.proj[1][1]);
+
+    auto select = [&](Model &model) {
+        const Mesh &mesh = m_meshes[model.mesh_idx];
+        if (mesh.lod_count == 1)
+            return false;
+
+        glm::vec4 sphere = model.world_sphere();
+        float size = sphere.w * proj_scale;
+        if (perspective)
+            size /= std::max(glm::distance(eye, glm::vec3(sphere)), m_near_plane);
+
+        // Switching needs a margin past the threshold, so models sitting on one do not flicker
+        uint32_t lod = std::min(model.lod, mesh.lod_count - 1);
+        while (lod + 1 < mesh.lod_count && size < LOD_SCREEN_SIZES[lod] * (1.f - LOD_HYSTERESIS))
+            lod++;
+        while (lod > 0 && size > LOD_SCREEN_SIZES[lod - 1] * (1.f + LOD_HYSTERESIS))
+            lod--;
+
+        if (lod == model.lod)
+            return false;
+        model.lod = lod;
+        return true;
+    };
+
+    // The cull shader picks the opaque levels from the same inputs, the CPU only sees transparents then
+    if (m_gpu_culler.initialized()) {
+        m_gpu_culler.set_lod_view(eye, proj_scale, perspective, m_near_plane);
+    } else {
+        for (Model &model : m_opaque_models)
+            select(model);
+    }
+    for (Model &model : m_transparent_models)
+        select(model);
+}
+
+void Scene::attach_model(const ModelInfo &mi, NodeId node, bool opaque) {
+    Model &model = opaque ? m_opaque_models[mi.model_idx] : m_transparent_models[mi.model_idx];
+    // A moving static model would rebuild the BVHs, reupload the static transforms and invalidate
+    // every shadow cache each time its node moves
+    if (!model.updating)
+        throw std::runtime_error("Only updating models can be attached to a node");
+    m_node_attachments.push_back(NodeAttachment{node, static_cast<uint32_t>(mi.model_idx), opaque, model.model_matrix});
+    // Placed by the next update even if the node itself does not move
+    m_graph.mark_dirty(node);
+}
+
+void Scene::update_graph() {
+    m_graph.update();
+    if (m_graph.get_changed().empty())
+        return;
+
+    for (const NodeAttachment &attachment : m_node_attachments) {
+        if (!m_graph.changed(attachment.node))
+            continue;
+
+        Model &model = attachment.opaque ? m_opaque_models[attachment.model_idx] : m_transparent_models[attachment.model_idx];
+        model.model_matrix = m_graph.get_world(attachment.node) * attachment.offset;
+        write_model_transform(model);
+        mark_moved(model);
+    }
+}
+
+void Scene::mark_moved(const Model &model) {
+    // Static models only move while the scene is being set up, rebuilding is fine then
+    if (model.updating)
+        m_dynamic_bvh_moved = true;
+    else
+        m_bvh_dirty = true;
+}
+
+void Scene::partition_transforms() {
+    m_static_transforms.clear();
+    m_dynamic_transforms.clear();
+
+    auto assign = [&](Model &model) {
+        const glm::mat4 &matrix = m_model_transform_matrices[model.transform_idx];
+        if (model.updating) {
+            model.transform_idx = DYNAMIC_TRANSFORM_BIT | static_cast<uint32_t>(m_dynamic_transforms.size());
+            m_dynamic_transforms.push_back(matrix);
+        } else {
+            model.transform_idx = static_cast<uint32_t>(m_static_transforms.size());
+            m_static_transforms.push_back(matrix);
+        }
+    };
+    for (Model &model : m_opaque_models)
+        assign(model);
+    for (Model &model : m_transparent_models)
+        assign(model);
+
+    // From here on the partitions are the only copy
+    m_model_transform_matrices.clear();
+    m_transforms_partitioned = true;
+}
+
+void Scene::write_model_transform(const Model &model) {
+    if (!m_transforms_partitioned) {
+        m_model_transform_matrices[model.transform_idx] = model.model_matrix;
+        return;
+    }
+
+    if (model.transform_idx & DYNAMIC_TRANSFORM_BIT) {
+        uint32_t slot = model.transform_idx & ~DYNAMIC_TRANSFORM_BIT;
+        m_dynamic_transforms[slot] = model.model_matrix;
+        mark_transform_dirty(slot);
+    } else {
+        m_static_transforms[model.transform_idx] = model.model_matrix;
+        m_static_transforms_dirty = true;
+        m_static_version++;
+    }
+}
+
+void Scene::mark_transform_dirty(uint32_t transform_idx) {
+    // Each frame in flight has its own copy that needs the change
+    for (DirtyRanges &dirty : m_dirty_transforms)
+        dirty.mark(transform_idx);
+}
+
+void Scene::gather_bounds(const std::vector<uint32_t> &objects, std::vector<AABB> &boxes) const {
+    boxes.resize(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        uint32_t object = objects[i];
+        if (object & TRANSPARENT_OBJECT_BIT)
+            boxes[i] = m_transparent_models[object & ~TRANSPARENT_OBJECT_BIT].world_bounds();
+        else
+            boxes[i] = m_opaque_models[object].world_bounds();
+    }
+}
+
+void Scene::update_bvh() {
+    std::vector<AABB> boxes;
+
+    if (m_bvh_dirty) {
+        std::vector<uint32_t> static_objects;
+        m_dynamic_objects.clear();
+
+        for (uint32_t i = 0; i < (uint32_t)m_opaque_models.size(); i++)
+            (m_opaque_models[i].updating ? m_dynamic_objects : static_objects).push_back(i);
+        for (uint32_t i = 0; i < (uint32_t)m_transparent_models.size(); i++)
+            (m_transparent_models[i].updating ? m_dynamic_objects : static_objects).push_back(i | TRANSPARENT_OBJECT_BIT);
+
+        gather_bounds(static_objects, boxes);
+        m_static_bvh.build(boxes, static_objects);
+
+        gather_bounds(m_dynamic_objects, boxes);
+        m_dynamic_bvh.build(boxes, m_dynamic_objects);
+
+        m_bvh_dirty = false;
+        m_dynamic_bvh_moved = false;
+    } else if (m_dynamic_bvh_moved) {
+        gather_bounds(m_dynamic_objects, boxes);
+        m_dynamic_bvh.refit(boxes);
+        m_dynamic_bvh_moved = false;
+    }
+}
+
+void Scene::query_frustum(const Frustum &frustum, std::vector<uint32_t> &opaque, std::vector<uint32_t> *transparent) {
+    update_bvh();
+
+    m_query_scratch.clear();
+    m_static_bvh.query_frustum(frustum, m_query_scratch);
+    m_dynamic_bvh.query_frustum(frustum, m_query_scratch);
+
+    // Back to model order so the draw order does not depend on the tree layout
+    std::sort(m_query_scratch.begin(), m_query_scratch.end());
+
+    opaque.clear();
+    if (transparent)
+        transparent->clear();
+
+    for (uint32_t object : m_query_scratch) {
+        if (!(object & TRANSPARENT_OBJECT_BIT))
+            opaque.push_back(object);
+        else if (transparent)
+            transparent->push_back(object & ~TRANSPARENT_OBJECT_BIT);
+    }
+}
+
+void Scene::cull_models() {
+    glm::mat4 view_proj = m_push_constants.proj * m_push_constants.view;
+    Frustum frustum = Frustum::from_matrix(view_proj);
+    if (m_gpu_culler.initialized()) {
+        // The compute pass culls the opaque models, walking the tree would only find the transparents
+        m_visible_opaque.clear();
+        m_visible_transparent.clear();
+        for (uint32_t i = 0; i < (uint32_t)m_transparent_models.size(); i++)
+            if (frustum.intersects_aabb(m_transparent_models[i].world_bounds()))
+                m_visible_transparent.push_back(i);
+    } else {
+        query_frustum(frustum, m_visible_opaque, &m_visible_transparent);
+        if (!m_occluders.empty())
+            cull_occluded_models(frustum, view_proj);
+    }
+
+    // Not known on the CPU when the GPU culls, the counts stay in the indirect buffer
+    m_opaque_cull_stats.visible = (uint32_t)m_visible_opaque.size();
+    m_opaque_cull_stats.culled = m_gpu_culler.initialized() ? 0 : (uint32_t)m_opaque_models.size() - m_opaque_cull_stats.visible;
+    m_transparent_cull_stats.visible = (uint32_t)m_visible_transparent.size();
+    m_transparent_cull_stats.culled = (uint32_t)m_transparent_models.size() - m_transparent_cull_stats.visible;
+
+    m_camera_near_plane = frustum.planes[4];
+    sort_transparent_models(m_camera_near_plane);
+
+    glm::mat4 inv_view_proj = glm::inverse(view_proj);
+    glm::vec3 camera_corners[8];
+    for (int i = 0; i < 8; i++) {
+        glm::vec4 corner = inv_view_proj * glm::vec4((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : 0.f, 1.f);
+        camera_corners[i] = glm::vec3(corner) / corner.w;
+    }
+    m_light_culls.resize(m_lights.size());
+    for (size_t l = 0; l < m_lights.size(); l++)
+        cull_light(m_lights[l], camera_corners, m_light_culls[l]);
+
+    // The compute pass does the opaque and shadow culling, only transparents are needed here
+    if (m_gpu_culler.initialized()) {
+        m_shadow_casters.clear();
+        return;
+    }
+
+    // Only opaque models cast shadows
+    m_shadow_casters.resize(m_lights.size());
+    for (size_t l = 0; l < m_lights.size(); l++) {
+        m_shadow_casters[l].clear();
+        if (m_light_culls[l].visible)
+            query_frustum(m_light_culls[l].casters, m_shadow_casters[l]);
+    }
+}
+
+void Scene::cull_light(const Light &light, const glm::vec3 (&camera_corners)[8], LightCull &out) const {
+    out.casters = Frustum::from_matrix(light.mvp);
+    // Always passes, the shadow pass flattens anything in front of the near plane onto it
+    if (m_shadow_depth_clamp)
+        out.casters.planes[4] = glm::vec4(0.f, 0.f, 0.f, 1.f);
+
+    // Box of the camera frustum in the light's clip space, clipped to the light volume. Every
+    // receiver on screen is in there
+    AABB receivers;
+    for (const glm::vec3 &corner : camera_corners) {
+        glm::vec4 clip = light.mvp * glm::vec4(corner, 1.f);
+        receivers.expand(glm::vec3(clip) / clip.w);
+    }
+    glm::vec3 low = glm::max(receivers.min, glm::vec3(-1.f, -1.f, 0.f));
+    glm::vec3 high = glm::min(receivers.max, glm::vec3(1.f, 1.f, 1.f));
+    out.visible = low.x <= high.x && low.y <= high.y && low.z <= high.z;
+    if (!out.visible)
+        return;
+
+    // Crop the light's projection to that box, sideways and behind it. Towards the light it stays
+    // as open as the whole volume, casters off screen still shadow what is on it
+    glm::vec3 size = glm::max(high - low, glm::vec3(1e-6f));
+    glm::mat4 crop(1.f);
+    crop[0][0] = 2.f / size.x;
+    crop[1][1] = 2.f / size.y;
+    crop[3][0] = -(high.x + low.x) / size.x;
+    crop[3][1] = -(high.y + low.y) / size.y;
+    crop[2][2] = 1.f / std::max(high.z, 1e-6f);
+    out.dynamic_casters = Frustum::from_matrix(crop * light.mvp);
+    out.dynamic_casters.planes[4] = out.casters.planes[4];
+}
+
+void Scene::cull_occluded_models(const Frustum &frustum, const glm::mat4 &view_proj) {
+    m_occlusion_rasterizer.begin(view_proj);
+    for (const Occluder &occluder : m_occluders) {
+        const Model &model = m_opaque_models[occluder.model_idx];
+        if (frustum.intersects_aabb(model.world_bounds()))
+            m_occlusion_rasterizer.add_occluder(occluder.mesh, model.model_matrix);
+    }
+    m_occlusion_rasterizer.rasterize();
+
+    // Before any draw is written, the indirect sections only ever see what is left
+    auto occluded_opaque = [&](uint32_t idx) { return !m_occlusion_rasterizer.is_visible(m_opaque_models[idx].world_bounds()); };
+    auto occluded_transparent = [&](uint32_t idx) { return !m_occlusion_rasterizer.is_visible(m_transparent_models[idx].world_bounds()); };
+    m_visible_opaque.erase(std::remove_if(m_visible_opaque.begin(), m_visible_opaque.end(), occluded_opaque), m_visible_opaque.end());
+    m_visible_transparent.erase(std::remove_if(m_visible_transparent.begin(), m_visible_transparent.end(), occluded_transparent), m_visible_transparent.end());
+}
+
+PickResult Scene::pick(const glm::vec3 &origin, const glm::vec3 &dir) {
+    update_bvh();
+
+    // Exact test against the triangles, done in model space so the ray t stays the same
+    auto hit_test = [&](uint32_t object) -> float {
+        const Model &model = (object & TRANSPARENT_OBJECT_BIT) ? m_transparent_models[object & ~TRANSPARENT_OBJECT_BIT] : m_opaque_models[object];
+        const Mesh &mesh = m_meshes[model.mesh_idx];
+        glm::mat4 inv_model = glm::inverse(model.model_matrix);
+        glm::vec3 o = glm::vec3(inv_model * glm::vec4(origin, 1.f));
+        glm::vec3 d = glm::vec3(inv_model * glm::vec4(dir, 0.f));
+
+        float closest = -1.f;
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            // Moller-Trumbore, both faces
+            glm::vec3 v0 = mesh.vertices[mesh.indices[i + 0]].pos;
+            glm::vec3 e1 = mesh.vertices[mesh.indices[i + 1]].pos - v0;
+            glm::vec3 e2 = mesh.vertices[mesh.indices[i + 2]].pos - v0;
+
+            glm::vec3 p = glm::cross(d, e2);
+            float det = glm::dot(e1, p);
+            if (std::abs(det) < 1e-12f)
+                continue;
+
+            float inv_det = 1.f / det;
+            glm::vec3 s = o - v0;
+            float u = glm::dot(s, p) * inv_det;
+            if (u < 0.f || u > 1.f)
+                continue;
+
+            glm::vec3 q = glm::cross(s, e1);
+            float v = glm::dot(d, q) * inv_det;
+            if (v < 0.f || u + v > 1.f)
+                continue;
+
+            float t = glm::dot(e2, q) * inv_det;
+            if (t >= 0.f && (closest < 0.f || t < closest))
+                closest = t;
+        }
+
+        return closest;
+    };
+
+    PickResult ret{};
+    float t_static = 0.f, t_dynamic = 0.f;
+    uint32_t id_static = 0, id_dynamic = 0;
+    bool hit_static = m_static_bvh.raycast(origin, dir, t_static, id_static, hit_test);
+    bool hit_dynamic = m_dynamic_bvh.raycast(origin, dir, t_dynamic, id_dynamic, hit_test);
+
+    if (!hit_static && !hit_dynamic)
+        return ret;
+
+    uint32_t object = id_static;
+    ret.distance = t_static;
+    if (hit_dynamic && (!hit_static || t_dynamic < t_static)) {
+        object = id_dynamic;
+        ret.distance = t_dynamic;
+    }
+
+    ret.hit = true;
+    ret.opaque = !(object & TRANSPARENT_OBJECT_BIT);
+    ret.model_idx = object & ~TRANSPARENT_OBJECT_BIT;
+    return ret;
+}
+
+PickResult Scene::pick_screen(float ndc_x, float ndc_y) {
+    // Vulkan NDC, y points down (proj already has the flip) and depth goes 0 to 1
+    glm::mat4 inv_view_proj = glm::inverse(m_push_constants.proj * m_push_constants.view);
+    glm::vec4 near_point = inv_view_proj * glm::vec4(ndc_x, ndc_y, 0.f, 1.f);
+    glm::vec4 far_point = inv_view_proj * glm::vec4(ndc_x, ndc_y, 1.f, 1.f);
+
+    glm::vec3 origin = glm::vec3(near_point) / near_point.w;
+    glm::vec3 target = glm::vec3(far_point) / far_point.w;
+
+    return pick(origin, glm::normalize(target - origin));
 }
 
 std::vector<float> Scene::parse_floats(const std::string& str) {
@@ -579,12 +1541,29 @@ void Scene::process_light(const pugi::xml_node& node) {
     float near_plane = 0.1f;
     float far_plane = 15.f;
     float ortho_size = 6.f;
+    uint32_t cascades = 0;
+    uint32_t shadow_resolution = SHADOW_MAP_SIZE;
+    bool low_precision = false;
+    // Point and spot lights
+    float range = 5.f;
+    float intensity = 1.f;
+    float inner_angle = 20.f;
+    float outer_angle = 30.f;
 
     for (pugi::xml_node child : node.children()) {
         std::string child_name(child.name());
 
         std::string child_value = child.attribute("value").as_string();
 
+        // Shadow depth format, d16 or d32
+        if (child_name.compare("format") == 0) {
+            if (child_value.compare("d16") != 0 && child_value.compare("d32") != 0)
+                throw std::runtime_error("Shadow format has to be d16 or d32");
+
+            low_precision = child_value.compare("d16") == 0;
+            continue;
+        }
+
         std::vector<float> value = parse_floats(child_value);
 
         if (child_name.compare("eye") == 0) {
@@ -615,13 +1594,49 @@ void Scene::process_light(const pugi::xml_node& node) {
             if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify a float");
 
             far_plane = value[0];
+        } else if (child_name.compare("cascades") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify a count");
+
+            cascades = static_cast<uint32_t>(value[0]);
+        } else if (child_name.compare("resolution") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify a resolution");
+
+            shadow_resolution = static_cast<uint32_t>(value[0]);
+        } else if (child_name.compare("range") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify a float");
+
+            range = value[0];
+        } else if (child_name.compare("intensity") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify a float");
+
+            intensity = value[0];
+        } else if (child_name.compare("inner") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify an angle");
+
+            inner_angle = value[0];
+        } else if (child_name.compare("outer") == 0) {
+            if (value.size() != 1) throw std::runtime_error("Need 1 floats to specify an angle");
+
+            outer_angle = value[0];
         } else {
             throw std::runtime_error("Unsupported attribute for a camera!");
         }
     }
 
-    if (light_type.compare("directional") == 0)
+    // With cascades the size is fitted to the camera, far is how far casters reach
+    uint32_t first_light = static_cast<uint32_t>(m_lights.size());
+    if (light_type.compare("directional") == 0 && cascades > 0)
+        add_cascaded_light(color, eye, center, up, cascades, far_plane);
+    else if (light_type.compare("directional") == 0)
         add_orthographic_light(color, eye, center, up, near_plane, far_plane, ortho_size);
+    else if (light_type.compare("point") == 0)
+        add_point_light(color, eye, range, intensity);
+    else if (light_type.compare("spot") == 0)
+        add_spot_light(color, eye, center - eye, range, inner_angle, outer_angle, intensity);
+
+    // Every cascade gets the same square
+    for (uint32_t l = first_light; l < m_lights.size(); l++)
+        set_light_shadow(l, shadow_resolution, low_precision);
     // else if (camera_type.compare("orthographic") == 0)
     //     set_orthographic_camera(eye, center, up, near_plane, far_plane);
     
@@ -669,6 +1684,8 @@ void Scene::process_mesh(const pugi::xml_node& node) {
     bool updated_transform = false;
     bool opaque = true;
     bool updating = false;
+    bool occluder = false;
+    std::string occluder_proxy;
 
     for (pugi::xml_node child : node.children()) {
         std::string child_name(child.name());
@@ -694,16 +1711,26 @@ void Scene::process_mesh(const pugi::xml_node& node) {
                 updating = true;
             else
                 updating = false;
+        } else if (child_name.compare("occluder") == 0) {
+            occluder = child_value.compare("true") == 0;
+        } else if (child_name.compare("occluder_proxy") == 0) {
+            // Has to lie inside the mesh, see set_occluder
+            occluder = true;
+            occluder_proxy = child_value;
         }
     }
 
-    ModelInfo mi = add_model(filename, textures, opaque, updating);
-    if (updated_transform) {
-        if (opaque)
-            update_opaque_model_transform(mi, transform, false);
-        else 
-            update_transparent_model_transform(mi, transform, false);
-    }
+    PendingMesh pending{};
+    pending.filename = filename;
+    pending.textures = textures;
+    pending.transform = transform;
+    pending.updated_transform = updated_transform;
+    pending.opaque = opaque;
+    pending.updating = updating;
+    pending.occluder = occluder;
+    pending.occluder_proxy = occluder_proxy;
+
+    m_pending_meshes.push_back(pending);
 }
 
 void Scene::process_node(const pugi::xml_node& node) {
@@ -719,9 +1746,14 @@ void Scene::process_node(const pugi::xml_node& node) {
 }
 
 void Scene::load_scene_from_xml(std::string filename) {
+    PROFILE_SCOPE("Scene::load_scene_from_xml");
     pugi::xml_document doc;
 
-    pugi::xml_parse_result result = doc.load_file(filename.c_str());
+    pugi::xml_parse_result result;
+    {
+        PROFILE_SCOPE("parse_xml");
+        result = doc.load_file(filename.c_str());
+    }
     if(!result)
         throw std::runtime_error(result.description());
     
@@ -731,6 +1763,8 @@ void Scene::load_scene_from_xml(std::string filename) {
         process_node(child);
     }
 
+    load_pending_meshes();
+
     return;
 }
 
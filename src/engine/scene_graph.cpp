@@ -0,0 +1,172 @@
+#include <engine/scene_graph.h>
+
+#include <stdexcept>
+
+namespace Engine {
+
+template<typename T>
+static void permute(std::vector<T> &values, const std::vector<uint32_t> &old_positions) {
+    std::vector<T> permuted(values.size());
+    for (size_t i = 0; i < old_positions.size(); i++)
+        permuted[i] = values[old_positions[i]];
+    values.swap(permuted);
+}
+
+NodeId SceneGraph::create_node(NodeId parent) {
+    if (parent != NO_NODE && parent >= size())
+        throw std::runtime_error("Parent node does not exist!");
+
+    // Appended for now, the depth-first order is restored in the next update
+    NodeId node = static_cast<NodeId>(size());
+    uint32_t position = static_cast<uint32_t>(m_node_of.size());
+
+    m_parent.push_back(parent == NO_NODE ? NO_NODE : m_position_of[parent]);
+    m_subtree_size.push_back(1);
+    m_translation.push_back(glm::vec3(0.f));
+    m_rotation.push_back(glm::quat(1.f, 0.f, 0.f, 0.f));
+    m_scale.push_back(glm::vec3(1.f));
+    m_world.push_back(glm::mat4(1.f));
+    m_dirty.push_back(1);
+    m_node_of.push_back(node);
+
+    m_position_of.push_back(position);
+    m_parent_ids.push_back(parent);
+    m_changed_flags.push_back(0);
+
+    m_order_dirty = true;
+    return node;
+}
+
+void SceneGraph::set_parent(NodeId node, NodeId parent) {
+    for (NodeId ancestor = parent; ancestor != NO_NODE; ancestor = m_parent_ids[ancestor]) {
+        if (ancestor == node)
+            throw std::runtime_error("A node can not be parented to its own subtree!");
+    }
+
+    m_parent_ids[node] = parent;
+    mark_dirty(node);
+    m_order_dirty = true;
+}
+
+void SceneGraph::set_local(NodeId node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale) {
+    uint32_t position = m_position_of[node];
+    m_translation[position] = translation;
+    m_rotation[position] = rotation;
+    m_scale[position] = scale;
+    m_dirty[position] = 1;
+}
+
+void SceneGraph::set_translation(NodeId node, const glm::vec3 &translation) {
+    m_translation[m_position_of[node]] = translation;
+    mark_dirty(node);
+}
+
+void SceneGraph::set_rotation(NodeId node, const glm::quat &rotation) {
+    m_rotation[m_position_of[node]] = rotation;
+    mark_dirty(node);
+}
+
+void SceneGraph::set_scale(NodeId node, const glm::vec3 &scale) {
+    m_scale[m_position_of[node]] = scale;
+    mark_dirty(node);
+}
+
+void SceneGraph::rebuild_order() {
+    size_t count = size();
+
+    // Children in id order, so the result does not depend on when nodes were moved
+    std::vector<uint32_t> first_child(count + 1, 0);
+    for (NodeId parent : m_parent_ids)
+        if (parent != NO_NODE) first_child[parent + 1]++;
+    for (size_t i = 0; i < count; i++)
+        first_child[i + 1] += first_child[i];
+    std::vector<NodeId> children(first_child[count]);
+    std::vector<uint32_t> fill(first_child.begin(), first_child.end() - 1);
+    for (NodeId node = 0; node < count; node++)
+        if (m_parent_ids[node] != NO_NODE) children[fill[m_parent_ids[node]]++] = node;
+
+    std::vector<NodeId> order;
+    order.reserve(count);
+    std::vector<NodeId> stack;
+    for (NodeId root = 0; root < count; root++) {
+        if (m_parent_ids[root] != NO_NODE)
+            continue;
+
+        stack.push_back(root);
+        while (!stack.empty()) {
+            NodeId node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            // Reversed so the first child comes out first
+            for (uint32_t c = first_child[node + 1]; c > first_child[node]; c--)
+                stack.push_back(children[c - 1]);
+        }
+    }
+
+    std::vector<uint32_t> old_positions(count);
+    for (size_t i = 0; i < count; i++)
+        old_positions[i] = m_position_of[order[i]];
+
+    permute(m_translation, old_positions);
+    permute(m_rotation, old_positions);
+    permute(m_scale, old_positions);
+    permute(m_world, old_positions);
+    permute(m_dirty, old_positions);
+
+    for (uint32_t i = 0; i < count; i++) {
+        m_node_of[i] = order[i];
+        m_position_of[order[i]] = i;
+    }
+
+    // Sizes accumulate from the back, children always sit after their parent
+    for (uint32_t i = 0; i < count; i++) {
+        NodeId parent = m_parent_ids[order[i]];
+        m_parent[i] = parent == NO_NODE ? NO_NODE : m_position_of[parent];
+        m_subtree_size[i] = 1;
+    }
+    for (uint32_t i = static_cast<uint32_t>(count); i-- > 0;) {
+        if (m_parent[i] != NO_NODE)
+            m_subtree_size[m_parent[i]] += m_subtree_size[i];
+    }
+
+    m_order_dirty = false;
+}
+
+void SceneGraph::update() {
+    if (m_order_dirty)
+        rebuild_order();
+
+    for (NodeId node : m_changed)
+        m_changed_flags[node] = 0;
+    m_changed.clear();
+
+    // Clean nodes cost one byte compare, a dirty node recomputes its whole subtree in order
+    uint32_t count = static_cast<uint32_t>(m_node_of.size());
+    uint32_t i = 0;
+    while (i < count) {
+        if (!m_dirty[i]) {
+            i++;
+            continue;
+        }
+
+        uint32_t end = i + m_subtree_size[i];
+        for (uint32_t j = i; j < end; j++) {
+            glm::mat3 rotation = glm::mat3_cast(m_rotation[j]);
+            glm::mat4 local(
+                glm::vec4(rotation[0] * m_scale[j].x, 0.f),
+                glm::vec4(rotation[1] * m_scale[j].y, 0.f),
+                glm::vec4(rotation[2] * m_scale[j].z, 0.f),
+                glm::vec4(m_translation[j], 1.f));
+
+            m_world[j] = m_parent[j] == NO_NODE ? local : m_world[m_parent[j]] * local;
+            m_dirty[j] = 0;
+
+            NodeId node = m_node_of[j];
+            m_changed_flags[node] = 1;
+            m_changed.push_back(node);
+        }
+        i = end;
+    }
+}
+
+}
@@ -9,29 +9,34 @@ void ShadowPipeline::create_pipeline(Engine::Renderer &device, VkFormat image_fo
     (void)old_render_pass;
 
     Engine::PipelineBuilder builder;
-    std::vector<VkDescriptorSetLayout> layout = {};
+    // Same set as the main pipelines, the model matrices come from the storage buffer at binding 1
+    std::vector<VkDescriptorSetLayout> layout = {device.get_descriptor_set_layout()};
 
-    struct LightModel {
-        glm::mat4 mvp;
-        glm::mat4 model;
-    };
-
-    builder.add_push_constants(sizeof(LightModel));
+    // light projection * view, or the mask of the views that draw for multiview
+    builder.add_push_constants(m_view_mask != 0 ? sizeof(uint32_t) : sizeof(glm::mat4));
     builder.disable_msaa();
     builder.disable_color_attachment();
-    builder.disable_dynamic_state();
+    // Viewport and scissor are the light's square in the shadow atlas
+    builder.enable_dynamic_state();
 
     builder.create_pipeline_layout(device, layout);
     
-    builder.create_shadow_render_pass(device);
-    
-    builder.set_shaders(device, "shaders/shadow_shader.vert.spv", "shaders/shadow_shader.frag.spv");
+    builder.create_shadow_render_pass(device, false, m_view_mask);
+
+    if (m_view_mask != 0)
+        builder.set_shaders(device, "shaders/shadow_multiview.vert.spv", "shaders/shadow_shader.frag.spv");
+    else
+        builder.set_shaders(device, "shaders/shadow_shader.vert.spv", "shaders/shadow_shader.frag.spv");
     builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
     builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
     builder.enable_culling(VK_CULL_MODE_BACK_BIT);
     builder.disable_blending();
     builder.enable_depth_test();
     builder.enable_depth_write();
+    // Casters in front of the light's near plane are flattened onto it instead of clipped, so the
+    // light volume does not have to reach back to every caster
+    if (device.supports_depth_clamp())
+        builder.enable_depth_clamp();
 
     auto bind_desc = Engine::Vertex::get_binding_description();
     auto attr_desc = Engine::Vertex::get_attribute_description();
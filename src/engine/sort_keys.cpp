@@ -0,0 +1,53 @@
+#include <engine/sort_keys.h>
+
+#include <algorithm>
+
+namespace Engine {
+
+void radix_sort(std::vector<SortItem> &items, std::vector<SortItem> &scratch) {
+    const size_t count = items.size();
+
+    // Not worth the histograms
+    if (count < 64) {
+        std::stable_sort(items.begin(), items.end(), [](const SortItem &a, const SortItem &b) { return a.key < b.key; });
+        return;
+    }
+
+    // All eight histograms in one read
+    uint32_t histograms[8][256] = {};
+    for (const SortItem &item : items) {
+        for (int pass = 0; pass < 8; pass++)
+            histograms[pass][(item.key >> (pass * 8)) & 0xFF]++;
+    }
+
+    scratch.resize(count);
+    SortItem *src = items.data();
+    SortItem *dst = scratch.data();
+
+    for (int pass = 0; pass < 8; pass++) {
+        uint32_t *histogram = histograms[pass];
+
+        // Every key has the same byte here
+        if (histogram[(src[0].key >> (pass * 8)) & 0xFF] == count)
+            continue;
+
+        uint32_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            uint32_t c = histogram[b];
+            histogram[b] = offset;
+            offset += c;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const SortItem &item = src[i];
+            dst[histogram[(item.key >> (pass * 8)) & 0xFF]++] = item;
+        }
+
+        std::swap(src, dst);
+    }
+
+    if (src != items.data())
+        std::memcpy(items.data(), src, count * sizeof(SortItem));
+}
+
+}
@@ -0,0 +1,50 @@
+#include <engine/thread_pool.h>
+
+namespace Engine {
+
+ThreadPool::ThreadPool(size_t num_threads) {
+    if (num_threads == 0) {
+        size_t hw_threads = std::thread::hardware_concurrency();
+        num_threads = hw_threads > 1 ? hw_threads - 1 : 1;
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+        m_workers.emplace_back([this]() { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread &worker : m_workers)
+        worker.join();
+}
+
+ThreadPool& ThreadPool::get() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+
+            if (m_stop && m_tasks.empty())
+                return;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop();
+        }
+
+        task();
+    }
+}
+
+}
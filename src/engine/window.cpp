@@ -3,6 +3,7 @@
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_vulkan.h>
 
+#include <algorithm>
 #include <iostream>
 
 namespace Engine {
@@ -59,6 +60,7 @@ std::vector<const char*> Window::get_required_instance_extensions() const {
 
 void Window::poll_events() {
     SDL_Event event;
+    m_pressed_keys.clear();
 
     while(SDL_PollEvent(&event)) {
         if (event.type == SDL_EVENT_WINDOW_RESIZED) {
@@ -67,6 +69,8 @@ void Window::poll_events() {
                 current_width = event.window.data1;
                 current_height = event.window.data2;
             }
+        } else if (event.type == SDL_EVENT_KEY_DOWN && !event.key.repeat) {
+            m_pressed_keys.push_back(event.key.key);
         } else if (event.type == SDL_EVENT_QUIT)
             m_should_close = true;
     }
@@ -89,4 +93,8 @@ bool Window::window_should_close() {
     return m_should_close;
 }
 
+bool Window::was_key_pressed(SDL_Keycode key) const {
+    return std::find(m_pressed_keys.begin(), m_pressed_keys.end(), key) != m_pressed_keys.end();
+}
+
 }
\ No newline at end of file
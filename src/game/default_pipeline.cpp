@@ -21,7 +21,12 @@ void DefaultPipeline::create_pipeline(Engine::Renderer &device, VkFormat image_f
     builder.disable_blending();
 
     builder.enable_depth_test();
-    builder.enable_depth_write();
+    if (m_after_depth_prepass) {
+        builder.set_depth_compare_op(VK_COMPARE_OP_EQUAL);
+        builder.disable_depth_write();
+    } else {
+        builder.enable_depth_write();
+    }
 
     auto bind_desc = Engine::Vertex::get_binding_description();
     auto attr_desc = Engine::Vertex::get_attribute_description();
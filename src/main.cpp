@@ -8,6 +8,7 @@
 #include <engine/renderer.h>
 #include <engine/models.h>
 #include <engine/scene.h>
+#include <engine/profiler.h>
 
 #include <game/default_pipeline.h>
 #include <game/default_transparent_pipeline.h>
@@ -16,6 +17,7 @@
 #include <iostream>
 
 #include <chrono>   // for FPS
+#include <future>   // for loading the scene during vulkan init
 
 #include <filesystem>   // for abs filename
 
@@ -40,12 +42,34 @@
 #endif
 
 int main(int argc, char** argv) {
-    (void) argc; (void) argv;
-
     #ifdef _WIN32
         attach_console(); // Attach to console of parent process if any
     #endif
 
+    // Parsing arguments: [scene.xml] [--trace=trace.json] =============================================
+    std::string scene_arg;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg.rfind("--trace=", 0) == 0)
+            Engine::Profiler::get().set_chrome_trace_file(arg.substr(8));
+        else
+            scene_arg = arg;
+    }
+
+    std::filesystem::path scene_path;
+    if (!scene_arg.empty()) {
+        scene_path = std::filesystem::absolute(scene_arg);
+    } else {
+        scene_path = std::filesystem::absolute("./scenes/scene.xml");
+    }
+
+    // Loading Scene (CPU side) ========================================================================
+    // Starts right away on its own thread, the aspect ratio is corrected in scene.update once the swapchain exists
+    Engine::Scene scene((float)WIDTH / (float)HEIGHT);
+    std::future<void> scene_loading = std::async(std::launch::async, [&scene, scene_path]() {
+        scene.load_scene_from_xml(scene_path.string());
+    });
+
     // Initializing Vulkan  ============================================================================
     Engine::Renderer renderer;
     Game::DefaultPipeline pipeline;
@@ -54,20 +78,12 @@ int main(int argc, char** argv) {
     
     float width = (float) renderer.get_swapchain_extent().width;
     float height = (float) renderer.get_swapchain_extent().height;
-    
-    // Initializing Scene  =============================================================================
-    float aspect_ratio = width/height;
-    Engine::Scene scene(aspect_ratio);
 
-    std::filesystem::path scene_path;
-    if (argc > 1) {
-        scene_path = std::filesystem::absolute(argv[1]);
-    } else {
-        scene_path = std::filesystem::absolute("./scenes/scene.xml");
+    {
+        PROFILE_SCOPE("wait_for_scene_loading");
+        scene_loading.get();
     }
 
-    scene.load_scene_from_xml(scene_path.string());
-
     /*
     Engine::ModelInfo car = scene.add_model("./models/F1_2026.glb", {"textures/Livery.jpg", "textures/Checkerboard.png", "textures/WheelCovers.jpg", "textures/TyreSoft.png"});
     Engine::ModelInfo ground = scene.add_model("./models/plane.obj", {"textures/Checkerboard.png"});
@@ -90,10 +106,17 @@ int main(int argc, char** argv) {
     scene.add_orthographic_light(light_color, light_pos, light_target, light_up, 0.1f, 15.f, 6.f);
     */
 
+    // A compute cull with a depth pyramid costs more than it saves on software Vulkan and integrated
+    // GPUs, those cull on the CPU against the scene's occluders instead
+    VkPhysicalDeviceType device_type = renderer.get_physical_device_properties().deviceType;
+    scene.set_gpu_culling(device_type != VK_PHYSICAL_DEVICE_TYPE_CPU && device_type != VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU);
+
     scene.create_buffers(renderer);
     
     // Initializing Program ============================================================================
-    std::vector<Engine::Pipeline*> pipelines = {&pipeline, &transparent_pipeline};
+    // The third is the opaque pipeline for after the depth pre-pass, P toggles it
+    Game::DefaultPipeline prepassed_pipeline(true);
+    std::vector<Engine::Pipeline*> pipelines = {&pipeline, &transparent_pipeline, &prepassed_pipeline};
     renderer.initialize(pipelines);
     
     // Starting Game Loop   ============================================================================
@@ -104,6 +127,7 @@ int main(int argc, char** argv) {
     using clock = std::chrono::high_resolution_clock;
     auto previous_frame_time = clock::now();
     float total_time = 0.0;
+    bool first_frame = true;
 
     while(renderer.begin_frame(current_frame, image_index, command_buffer)) {
         auto current_time = clock::now();
@@ -113,36 +137,50 @@ int main(int argc, char** argv) {
         
         if (false) {
             double fps = delta_time > 0.0 ? 1.0 / delta_time: 0.0;
-            fmt::println("{}", fps);
+            Engine::CullStats opaque = scene.get_opaque_cull_stats();
+            Engine::CullStats transparent = scene.get_transparent_cull_stats();
+            Engine::RecorderStats commands = renderer.get_recorder().get_last_stats();
+            Engine::FragmentStats fragments = renderer.get_fragment_stats();
+            fmt::println("{} fps, opaque {} visible / {} culled, transparent {} visible / {} culled, commands {} issued / {} skipped",
+                         fps, opaque.visible, opaque.culled, transparent.visible, transparent.culled, commands.issued, commands.skipped);
+            fmt::println("fragment invocations: {} with depth pre-pass, {} without", fragments.with_prepass, fragments.without_prepass);
         }
 
+        if (renderer.get_window().was_key_pressed(SDLK_P))
+            renderer.set_depth_prepass(!renderer.depth_prepass_enabled());
+
         // Updating scene ==============================================================================
         width = (float) renderer.get_swapchain_extent().width;
         height = (float) renderer.get_swapchain_extent().height;
         scene.update(delta_time, width / height);
 
-        renderer.render_shadow_maps(command_buffer, scene.m_opaque_models);
+        scene.record_draw_commands(renderer, command_buffer, current_frame);
+        scene.render_shadow_maps(renderer, command_buffer, current_frame);
 
-        renderer.begin_render_pass(command_buffer, image_index);
-        // Rendering opaque objects ====================================================================
-        renderer.bind_pipeline_and_descriptors(command_buffer, 0, current_frame);
-        renderer.set_default_viewport_and_scissor(command_buffer);
+        // Opaque objects visible last frame, then the ones that pass the occlusion test against their
+        // depth and the transparent objects. Recorded on the worker threads
+        renderer.begin_pipeline_statistics(command_buffer);
+        renderer.begin_render_pass(command_buffer, image_index, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        scene.render_early_models(renderer, command_buffer, current_frame, image_index);
+        renderer.end_render_pass(command_buffer);
 
-        scene.render_opaque_models(renderer, command_buffer);
+        scene.record_occlusion_culling(renderer, command_buffer, current_frame);
 
-        // Rendering transparent objects ===============================================================
-        if (scene.m_transparent_models.size() > 0) {
-            renderer.bind_pipeline_and_descriptors(command_buffer, 1, current_frame);
-            renderer.set_default_viewport_and_scissor(command_buffer);
-    
-            scene.render_transparent_models(renderer, command_buffer);
-        }
+        renderer.begin_render_pass(command_buffer, image_index, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS, true);
+        scene.render_models(renderer, command_buffer, current_frame, image_index);
 
         renderer.end_render_pass_and_command_buffer(command_buffer);
         renderer.end_frame();
+
+        if (first_frame) {
+            Engine::Profiler::get().record_since_start("time_to_first_frame");
+            first_frame = false;
+        }
     }
 
     renderer.cleanup();
 
+    Engine::Profiler::get().end_session();
+
     return 0;
 }
\ No newline at end of file